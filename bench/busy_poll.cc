@@ -0,0 +1,434 @@
+// Latency versus CPU time of Epoll's busy polling: one echo server loop and
+// one client loop in this process exchange a message every --interval us,
+// so both loops go idle between messages and every message pays for a
+// wakeup unless the spin budget bridges the gap.
+//
+// Runs once per spin budget and prints one JSON object per run with the round
+// trip time percentiles and the CPU time the process used per second of wall
+// time.
+//
+// Build with src/ reachable as linux_epoll/ on the include path:
+//   g++ -O2 -std=c++03 -I<include dir> bench/busy_poll.cc src/util.cc -lpthread
+//
+// Usage:
+//   busy_poll [--budgets=us,us,...] [--interval=us] [--messages=N]
+//             [--size=bytes] [--socket-busy-poll=us] [--port=N]
+//
+// --socket-busy-poll additionally sets SO_BUSY_POLL and SO_PREFER_BUSY_POLL
+// on both ends, which needs CAP_NET_ADMIN and only has an effect on devices
+// with NAPI, not on loopback.
+
+#include "linux_epoll/epoll.h"
+#include "linux_epoll/sockets.h"
+#include "linux_epoll/loop_group.h"
+#include "linux_epoll/histogram.h"
+
+#include <vector>
+#include <string>
+#include <tr1/functional>
+#include <tr1/memory>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+
+using namespace linux_epoll;
+
+
+namespace
+{
+
+
+typedef Epoll<16> Loop_t;
+
+
+struct Options
+{
+	Options()
+	: interval(200)
+	, messages(20000)
+	, size(64)
+	, socket_busy_poll(0)
+	, port(47100)
+	{
+		budgets.push_back(0);
+		budgets.push_back(10);
+		budgets.push_back(50);
+		budgets.push_back(200);
+		budgets.push_back(1000);
+	}
+
+	std::vector<uint32_t> budgets;
+	uint32_t              interval;
+	uint32_t              messages;
+	uint32_t              size;
+	uint32_t              socket_busy_poll;
+	uint32_t              port;
+};
+
+
+uint64_t clock_ns()
+{
+	return to_ns(now());
+}
+
+
+uint64_t cpu_ns()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (
+		(uint64_t(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000000000ull +
+		(uint64_t(usage.ru_utime.tv_usec) + usage.ru_stime.tv_usec) * 1000);
+}
+
+
+//----------------------------------------------------------------------------//
+
+
+struct Echo
+{
+	uint8_t * get_buffer()
+	{
+		return buffer;
+	}
+
+	uint32_t get_buffer_size()
+	{
+		return sizeof(buffer);
+	}
+
+	void process_read_data(uint8_t const* data, uint32_t size)
+	{
+		write(data, size);
+	}
+
+	void connected()
+	{}
+
+	void disconnected()
+	{}
+
+	void set_write_function(Delegate<void(uint8_t const*, uint32_t)> const& write_)
+	{
+		write = write_;
+	}
+
+	Delegate<void(uint8_t const*, uint32_t)> write;
+	uint8_t buffer[64 * 1024];
+};
+
+
+struct Server
+{
+	typedef PassiveSocket<Loop_t, Echo, 4> Listener_t;
+
+	Server(Loop_t & loop, Options const& options)
+	: listener(
+		&loop,
+		std::tr1::bind(&Server::connect, this),
+		options.port,
+		"127.0.0.1",
+		DurationMs(100))
+	{
+		listener.set_no_delay(true);
+
+		if(options.socket_busy_poll != 0)
+		{
+			listener.set_busy_poll(options.socket_busy_poll, true);
+		}
+	}
+
+	Echo * connect()
+	{
+		return &echo;
+	}
+
+	Echo       echo;
+	Listener_t listener;
+};
+
+
+std::tr1::shared_ptr<void> setup_server(
+	Options const& options,
+	uint32_t budget,
+	uint32_t * ready,
+	Loop_t & loop,
+	uint32_t)
+{
+	loop.set_busy_poll(DurationNs(budget * 1000ull));
+
+	std::tr1::shared_ptr<void> server(new Server(loop, options));
+	__atomic_store_n(ready, 1, __ATOMIC_RELEASE);
+	return server;
+}
+
+
+//----------------------------------------------------------------------------//
+
+
+// Sends a message, waits for all of it to come back and sends the next one
+// interval later.
+class Client
+{
+public:
+	typedef ActiveSocket<Loop_t, Client> Socket_t;
+
+	Client(Loop_t & loop, Options const& options)
+	: loop_(loop)
+	, options_(options)
+	, message_(options.size, 'x')
+	, received_(0)
+	, count_(0)
+	, sent_at_(0)
+	{
+		socket_ = new Socket_t(
+			&loop_,
+			this,
+			DurationMs(100),
+			"127.0.0.1",
+			options.port);
+		socket_->set_no_delay(true);
+
+		if(options.socket_busy_poll != 0)
+		{
+			socket_->set_busy_poll(options.socket_busy_poll, true);
+		}
+	}
+
+	~Client()
+	{
+		delete socket_;
+	}
+
+	bool done() const
+	{
+		return count_ >= options_.messages;
+	}
+
+	HistogramSnapshot rtt() const
+	{
+		return rtt_.snapshot();
+	}
+
+	uint8_t * get_buffer()
+	{
+		return buffer_;
+	}
+
+	uint32_t get_buffer_size()
+	{
+		return sizeof(buffer_);
+	}
+
+	void process_read_data(uint8_t const*, uint32_t size)
+	{
+		received_ += size;
+		if(received_ < message_.size())
+		{
+			return;
+		}
+
+		rtt_.record(clock_ns() - sent_at_);
+		received_ = 0;
+		++count_;
+
+		if(not done())
+		{
+			loop_.register_timeout(
+				DurationNs(options_.interval * 1000ull),
+				std::tr1::bind(&Client::send_, this),
+				this);
+		}
+	}
+
+	void connected()
+	{
+		send_();
+	}
+
+	void disconnected()
+	{}
+
+	void set_write_function(Delegate<void(uint8_t const*, uint32_t)> const& write)
+	{
+		write_ = write;
+	}
+
+private:
+	Loop_t                                 & loop_;
+	Options                                  options_;
+	Socket_t                               * socket_;
+	Delegate<void(uint8_t const*, uint32_t)> write_;
+	std::vector<uint8_t>                     message_;
+	uint8_t                                  buffer_[64 * 1024];
+	uint32_t                                 received_;
+	uint32_t                                 count_;
+	uint64_t                                 sent_at_;
+	Histogram                                rtt_;
+
+	void send_()
+	{
+		sent_at_ = clock_ns();
+		write_(&message_[0], message_.size());
+	}
+};
+
+
+void run(Options const& options, uint32_t budget)
+{
+	uint32_t ready = 0;
+	LoopGroup<Loop_t> server(
+		1,
+		std::tr1::bind(
+			&setup_server,
+			options,
+			budget,
+			&ready,
+			std::tr1::placeholders::_1,
+			std::tr1::placeholders::_2));
+	server.start();
+
+	while(not __atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+	{
+		usleep(1000);
+	}
+
+	// fine timer resolution so the interval is kept
+	Loop_t loop(DurationNs(10000), PreciseTimers);
+	loop.set_busy_poll(DurationNs(budget * 1000ull));
+
+	uint64_t wall = clock_ns();
+	uint64_t cpu = cpu_ns();
+
+	{
+		Client client(loop, options);
+		while(not client.done())
+		{
+			loop.wait();
+			loop.process();
+		}
+
+		wall = clock_ns() - wall;
+		cpu = cpu_ns() - cpu;
+
+		HistogramSnapshot rtt = client.rtt();
+
+		printf(
+			"{\"benchmark\":\"busy_poll\",\"budget_us\":%u,\"interval_us\":%u,"
+			"\"socket_busy_poll_us\":%u,\"size\":%u,\"messages\":%llu,"
+			"\"cpu_per_wall_s\":%.3f,\"cpu_ns_per_message\":%.1f,"
+			"\"rtt_ns\":{\"mean\":%.1f,\"p50\":%llu,\"p99\":%llu,"
+			"\"p999\":%llu,\"max\":%llu}}\n",
+			budget,
+			options.interval,
+			options.socket_busy_poll,
+			options.size,
+			(unsigned long long)rtt.count,
+			double(cpu) / wall,
+			rtt.count == 0 ? 0.0 : double(cpu) / rtt.count,
+			rtt.mean(),
+			(unsigned long long)rtt.percentile(50),
+			(unsigned long long)rtt.percentile(99),
+			(unsigned long long)rtt.percentile(99.9),
+			(unsigned long long)rtt.max);
+		fflush(stdout);
+	}
+
+	server.stop();
+	server.join();
+}
+
+
+//----------------------------------------------------------------------------//
+
+
+bool parse(int argc, char ** argv, Options & options)
+{
+	for(int i=1; i<argc; ++i)
+	{
+		std::string arg(argv[i]);
+		size_t equal = arg.find('=');
+
+		if(arg.compare(0, 2, "--") != 0 or equal == std::string::npos)
+		{
+			return false;
+		}
+
+		std::string key = arg.substr(2, equal - 2);
+		std::string value = arg.substr(equal + 1);
+		unsigned long long number = strtoull(value.c_str(), NULL, 10);
+
+		if(key == "budgets")
+		{
+			options.budgets.clear();
+
+			char const* p = value.c_str();
+			while(*p != '\0')
+			{
+				char * end;
+				options.budgets.push_back(strtoul(p, &end, 10));
+				if(end == p or (*end != ',' and *end != '\0'))
+				{
+					return false;
+				}
+				p = *end == ',' ? end + 1 : end;
+			}
+		}
+		else if(key == "interval")
+		{
+			options.interval = number;
+		}
+		else if(key == "messages" and number > 0)
+		{
+			options.messages = number;
+		}
+		else if(key == "size" and number > 0 and number <= 64 * 1024)
+		{
+			options.size = number;
+		}
+		else if(key == "socket-busy-poll")
+		{
+			options.socket_busy_poll = number;
+		}
+		else if(key == "port" and number > 0 and number < 65536)
+		{
+			options.port = number;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return not options.budgets.empty();
+}
+
+
+} //namespace
+
+
+int main(int argc, char ** argv)
+{
+	Options options;
+	if(not parse(argc, argv, options))
+	{
+		fprintf(
+			stderr,
+			"usage: %s [--budgets=us,us,...] [--interval=us] [--messages=N] "
+			"[--size=N] [--socket-busy-poll=us] [--port=N]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for(uint32_t i=0; i<options.budgets.size(); ++i)
+	{
+		run(options, options.budgets[i]);
+	}
+
+	return EXIT_SUCCESS;
+}
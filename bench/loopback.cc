@@ -0,0 +1,730 @@
+// End-to-end loopback benchmark: a server on a LoopGroup (echo or
+// request/response) and an open-loop load generator built on ActiveSocket,
+// both in this process.
+//
+// The generator sends at a fixed total rate, spread round-robin over all
+// connections, whether or not earlier responses arrived. Every request
+// carries the time it was scheduled for and latency is measured from that
+// time, so a stalled server shows up as latency instead of as fewer samples
+// (coordinated omission).
+//
+// Prints one JSON object per run:
+//   throughput, p50/p99/p99.9 latency, connection setup (accept) rate and the
+//   RSS growth per connection, which covers both ends of every connection.
+//
+// Build with src/ reachable as linux_epoll/ on the include path:
+//   g++ -O2 -std=c++03 -I<include dir> bench/loopback.cc src/util.cc -lpthread
+//
+// Usage:
+//   loopback [--mode=echo|rr] [--connections=N] [--rate=requests/s]
+//            [--size=bytes] [--duration=s] [--warmup=s] [--threads=N]
+//            [--port=N] [--transport=tcp|unix]
+//
+// --transport=unix connects over an AF_UNIX stream socket in the abstract
+// namespace instead of loopback TCP; it takes a single server thread, since
+// only TCP listeners can share their address with SO_REUSEPORT.
+//
+// Both ends of every connection live in this process, so the open file limit
+// has to be above twice the number of connections.
+
+#include "linux_epoll/epoll.h"
+#include "linux_epoll/sockets.h"
+#include "linux_epoll/loop_group.h"
+#include "linux_epoll/histogram.h"
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <tr1/functional>
+#include <tr1/memory>
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+
+using namespace linux_epoll;
+
+
+namespace
+{
+
+
+static const uint32_t MAX_CONNECTIONS = 20000;
+static const uint32_t REQUEST_SIZE_RR = 16;
+
+typedef Epoll<MAX_CONNECTIONS> Loop_t;
+
+
+struct Options
+{
+	Options()
+	: mode("echo")
+	, connections(1000)
+	, rate(100000)
+	, size(64)
+	, duration(10)
+	, warmup(2)
+	, threads(1)
+	, port(47000)
+	, transport("tcp")
+	{}
+
+	std::string mode;
+	uint32_t    connections;
+	uint64_t    rate;
+	uint32_t    size;
+	uint32_t    duration;
+	uint32_t    warmup;
+	uint32_t    threads;
+	uint32_t    port;
+	std::string transport;
+
+	bool request_response() const
+	{
+		return mode == "rr";
+	}
+
+	bool unix_transport() const
+	{
+		return transport == "unix";
+	}
+
+	// the port tells concurrent runs apart
+	SocketAddress unix_address() const
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "linux_epoll.loopback.%u", port);
+		return SocketAddress::unix_abstract(name);
+	}
+};
+
+
+uint64_t clock_ns()
+{
+	return to_ns(now());
+}
+
+
+uint64_t rss_bytes()
+{
+	unsigned long size = 0;
+	unsigned long resident = 0;
+
+	FILE * f = fopen("/proc/self/statm", "r");
+	if(f)
+	{
+		if(fscanf(f, "%lu %lu", &size, &resident) != 2)
+		{
+			resident = 0;
+		}
+		fclose(f);
+	}
+
+	return uint64_t(resident) * sysconf(_SC_PAGESIZE);
+}
+
+
+//----------------------------------------------------------------------------//
+
+
+// Per loop state of the server, connections share its buffers since they are
+// only used while a single handler runs.
+struct ServerState;
+
+
+struct ServerConnection
+{
+	ServerConnection()
+	: state(NULL)
+	, pending_size(0)
+	{}
+
+	uint8_t * get_buffer();
+	uint32_t get_buffer_size();
+	void process_read_data(uint8_t const* data, uint32_t size);
+
+	void connected()
+	{
+		pending_size = 0;
+	}
+
+	void disconnected()
+	{}
+
+	void set_write_function(Delegate<void(uint8_t const*, uint32_t)> const& write_)
+	{
+		write = write_;
+	}
+
+	Delegate<void(uint8_t const*, uint32_t)> write;
+	ServerState * state;
+	uint8_t       pending[REQUEST_SIZE_RR];
+	uint32_t      pending_size;
+};
+
+
+struct ServerState
+{
+	typedef PassiveSocket<Loop_t, ServerConnection, MAX_CONNECTIONS> Listener_t;
+
+	ServerState(Loop_t & loop, Options const& options)
+	: options(options)
+	, input(64 * 1024)
+	, connections(MAX_CONNECTIONS)
+	, next(0)
+	{
+		for(uint32_t i=0; i<connections.size(); ++i)
+		{
+			connections[i].state = this;
+		}
+
+		if(options.unix_transport())
+		{
+			listener.reset(new Listener_t(
+				&loop,
+				std::tr1::bind(&ServerState::connect, this),
+				options.unix_address(),
+				SOCK_STREAM,
+				DurationMs(100)));
+			return;
+		}
+
+		listener.reset(new Listener_t(
+			&loop,
+			std::tr1::bind(&ServerState::connect, this),
+			options.port,
+			"127.0.0.1",
+			DurationMs(100),
+			options.threads > 1));
+		listener->set_no_delay(true);
+	}
+
+	ServerConnection * connect()
+	{
+		return &connections[next++ % connections.size()];
+	}
+
+	Options                           options;
+	std::vector<uint8_t>              input;
+	std::vector<uint8_t>              output;
+	std::vector<ServerConnection>     connections;
+	uint32_t                          next;
+	std::tr1::shared_ptr<Listener_t>  listener;
+};
+
+
+uint8_t * ServerConnection::get_buffer()
+{
+	return &state->input[0];
+}
+
+
+uint32_t ServerConnection::get_buffer_size()
+{
+	return state->input.size();
+}
+
+
+// echo returns the bytes as they are, request/response answers every 16 byte
+// request {scheduled time, response size} with a response of that size
+// starting with the scheduled time
+void ServerConnection::process_read_data(uint8_t const* data, uint32_t size)
+{
+	if(not state->options.request_response())
+	{
+		write(data, size);
+		return;
+	}
+
+	std::vector<uint8_t> & output = state->output;
+	output.clear();
+
+	while(size != 0)
+	{
+		uint32_t count = std::min(size, REQUEST_SIZE_RR - pending_size);
+		memcpy(pending + pending_size, data, count);
+		pending_size += count;
+		data += count;
+		size -= count;
+
+		if(pending_size == REQUEST_SIZE_RR)
+		{
+			uint64_t response_size;
+			memcpy(&response_size, pending + 8, 8);
+
+			size_t offset = output.size();
+			output.resize(offset + response_size, 0);
+			memcpy(&output[offset], pending, 8);
+			pending_size = 0;
+		}
+	}
+
+	if(not output.empty())
+	{
+		write(&output[0], output.size());
+	}
+}
+
+
+std::tr1::shared_ptr<void> setup_server(
+	Options const& options,
+	uint32_t * ready,
+	Loop_t & loop,
+	uint32_t)
+{
+	std::tr1::shared_ptr<void> state(new ServerState(loop, options));
+	__atomic_add_fetch(ready, 1, __ATOMIC_RELEASE);
+	return state;
+}
+
+
+//----------------------------------------------------------------------------//
+
+
+class LoadGenerator;
+
+
+// Parses responses, every one starts with the time its request was
+// scheduled for.
+struct ClientConnection
+{
+	ClientConnection()
+	: generator(NULL)
+	, offset(0)
+	{}
+
+	uint8_t * get_buffer();
+	uint32_t get_buffer_size();
+	void process_read_data(uint8_t const* data, uint32_t size);
+	void connected();
+	void disconnected();
+
+	void set_write_function(Delegate<void(uint8_t const*, uint32_t)> const& write_)
+	{
+		write = write_;
+	}
+
+	Delegate<void(uint8_t const*, uint32_t)> write;
+	LoadGenerator * generator;
+	uint32_t        offset;
+	uint8_t         scheduled[8];
+};
+
+
+class LoadGenerator
+{
+public:
+	typedef ActiveSocket<Loop_t, ClientConnection> Socket_t;
+
+	LoadGenerator(Loop_t & loop, Options const& options)
+	: loop_(loop)
+	, options_(options)
+	, connections_(options.connections)
+	, input_(64 * 1024)
+	, connected_(0)
+	, sent_(0)
+	, received_(0)
+	, bytes_(0)
+	, sequence_(0)
+	{
+		request_.resize(
+			options.request_response() ?
+				REQUEST_SIZE_RR :
+				std::max(options.size, uint32_t(8)),
+			0);
+		response_size_ = options.request_response() ?
+			std::max(options.size, uint32_t(8)) :
+			request_.size();
+
+		for(uint32_t i=0; i<connections_.size(); ++i)
+		{
+			connections_[i].generator = this;
+		}
+	}
+
+	~LoadGenerator()
+	{
+		for(uint32_t i=0; i<sockets_.size(); ++i)
+		{
+			delete sockets_[i];
+		}
+	}
+
+	// returns the time it took until every connection was established
+	uint64_t connect()
+	{
+		uint64_t start = clock_ns();
+
+		for(uint32_t i=0; i<connections_.size(); ++i)
+		{
+			if(options_.unix_transport())
+			{
+				sockets_.push_back(new Socket_t(
+					&loop_,
+					&connections_[i],
+					DurationMs(100),
+					options_.unix_address()));
+				continue;
+			}
+
+			sockets_.push_back(new Socket_t(
+				&loop_,
+				&connections_[i],
+				DurationMs(100),
+				"127.0.0.1",
+				options_.port));
+			sockets_.back()->set_no_delay(true);
+		}
+
+		uint64_t deadline = start + 30000000000ull;
+		while(connected_ < connections_.size() and clock_ns() < deadline)
+		{
+			loop_.wait();
+			loop_.process();
+		}
+
+		return clock_ns() - start;
+	}
+
+	void run()
+	{
+		start_ = clock_ns();
+		warm_ = start_ + options_.warmup * 1000000000ull;
+		end_ = warm_ + options_.duration * 1000000000ull;
+		pace_();
+
+		uint64_t drain = end_ + 1000000000ull;
+		uint64_t t;
+		while((t = clock_ns()) < drain and (t < end_ or received_ < sent_))
+		{
+			loop_.wait();
+			loop_.process();
+		}
+	}
+
+	void response(uint8_t const* scheduled)
+	{
+		uint64_t time;
+		memcpy(&time, scheduled, 8);
+
+		++received_;
+
+		if(time >= warm_ and time < end_)
+		{
+			latency_.record(clock_ns() - time);
+			bytes_ += response_size_;
+		}
+	}
+
+	void connected()
+	{
+		++connected_;
+	}
+
+	uint8_t * input()
+	{
+		return &input_[0];
+	}
+
+	uint32_t input_size() const
+	{
+		return input_.size();
+	}
+
+	uint32_t response_size() const
+	{
+		return response_size_;
+	}
+
+	uint32_t connected_count() const
+	{
+		return connected_;
+	}
+
+	uint64_t sent() const
+	{
+		return sent_;
+	}
+
+	uint64_t received() const
+	{
+		return received_;
+	}
+
+	uint64_t bytes() const
+	{
+		return bytes_;
+	}
+
+	HistogramSnapshot latency() const
+	{
+		return latency_.snapshot();
+	}
+
+private:
+	Loop_t                       & loop_;
+	Options                        options_;
+	std::vector<ClientConnection>  connections_;
+	std::vector<Socket_t *>        sockets_;
+	std::vector<uint8_t>           request_;
+	std::vector<uint8_t>           input_;
+	uint32_t                       response_size_;
+	uint32_t                       connected_;
+	uint64_t                       sent_;
+	uint64_t                       received_;
+	uint64_t                       bytes_;
+	uint64_t                       sequence_;
+	uint64_t                       start_;
+	uint64_t                       warm_;
+	uint64_t                       end_;
+	Histogram                      latency_;
+
+	uint64_t scheduled_(uint64_t sequence) const
+	{
+		return start_ + sequence * 1000000000ull / options_.rate;
+	}
+
+	// sends every request scheduled up to now, each stamped with the time it
+	// was due rather than the time it actually left
+	void pace_()
+	{
+		uint64_t limit = std::min(clock_ns(), end_);
+		uint64_t time;
+
+		while((time = scheduled_(sequence_)) <= limit)
+		{
+			ClientConnection & c = connections_[sequence_ % connections_.size()];
+			++sequence_;
+
+			if(not c.write)
+			{
+				continue;
+			}
+
+			memcpy(&request_[0], &time, 8);
+			if(options_.request_response())
+			{
+				uint64_t size = response_size_;
+				memcpy(&request_[8], &size, 8);
+			}
+
+			c.write(&request_[0], request_.size());
+			++sent_;
+		}
+
+		if(limit < end_)
+		{
+			loop_.register_timeout(
+				DurationNs(50000),
+				std::tr1::bind(&LoadGenerator::pace_, this),
+				this);
+		}
+	}
+};
+
+
+uint8_t * ClientConnection::get_buffer()
+{
+	return generator->input();
+}
+
+
+uint32_t ClientConnection::get_buffer_size()
+{
+	return generator->input_size();
+}
+
+
+void ClientConnection::process_read_data(uint8_t const* data, uint32_t size)
+{
+	uint32_t response_size = generator->response_size();
+
+	while(size != 0)
+	{
+		if(offset < 8)
+		{
+			uint32_t count = std::min(size, 8 - offset);
+			memcpy(scheduled + offset, data, count);
+			offset += count;
+			data += count;
+			size -= count;
+		}
+		else
+		{
+			uint32_t count = std::min(size, response_size - offset);
+			offset += count;
+			data += count;
+			size -= count;
+		}
+
+		if(offset == response_size)
+		{
+			generator->response(scheduled);
+			offset = 0;
+		}
+	}
+}
+
+
+void ClientConnection::connected()
+{
+	offset = 0;
+	generator->connected();
+}
+
+
+void ClientConnection::disconnected()
+{}
+
+
+//----------------------------------------------------------------------------//
+
+
+bool parse(int argc, char ** argv, Options & options)
+{
+	for(int i=1; i<argc; ++i)
+	{
+		std::string arg(argv[i]);
+		size_t equal = arg.find('=');
+
+		if(arg.compare(0, 2, "--") != 0 or equal == std::string::npos)
+		{
+			return false;
+		}
+
+		std::string key = arg.substr(2, equal - 2);
+		std::string value = arg.substr(equal + 1);
+		unsigned long long number = strtoull(value.c_str(), NULL, 10);
+
+		if(key == "mode" and (value == "echo" or value == "rr"))
+		{
+			options.mode = value;
+		}
+		else if(key == "connections" and number > 0 and number <= MAX_CONNECTIONS / 2)
+		{
+			options.connections = number;
+		}
+		else if(key == "rate" and number > 0)
+		{
+			options.rate = number;
+		}
+		else if(key == "size" and number > 0)
+		{
+			options.size = number;
+		}
+		else if(key == "duration" and number > 0)
+		{
+			options.duration = number;
+		}
+		else if(key == "warmup")
+		{
+			options.warmup = number;
+		}
+		else if(key == "threads" and number > 0)
+		{
+			options.threads = number;
+		}
+		else if(key == "port" and number > 0 and number < 65536)
+		{
+			options.port = number;
+		}
+		else if(key == "transport" and (value == "tcp" or value == "unix"))
+		{
+			options.transport = value;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return not (options.unix_transport() and options.threads > 1);
+}
+
+
+} //namespace
+
+
+int main(int argc, char ** argv)
+{
+	Options options;
+	if(not parse(argc, argv, options))
+	{
+		fprintf(
+			stderr,
+			"usage: %s [--mode=echo|rr] [--connections=N] [--rate=N] "
+			"[--size=N] [--duration=s] [--warmup=s] [--threads=N] [--port=N] "
+			"[--transport=tcp|unix]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	uint32_t ready = 0;
+	LoopGroup<Loop_t> server(
+		options.threads,
+		std::tr1::bind(
+			&setup_server,
+			options,
+			&ready,
+			std::tr1::placeholders::_1,
+			std::tr1::placeholders::_2));
+	server.start();
+
+	while(__atomic_load_n(&ready, __ATOMIC_ACQUIRE) < options.threads)
+	{
+		usleep(1000);
+	}
+
+	// fine timer resolution so the pacer keeps up with the schedule
+	std::tr1::shared_ptr<Loop_t> loop(
+		new Loop_t(DurationNs(50000), PreciseTimers));
+	LoadGenerator generator(*loop, options);
+
+	uint64_t rss_before = rss_bytes();
+	uint64_t connect_ns = generator.connect();
+	uint32_t connected = generator.connected_count();
+
+	generator.run();
+
+	uint64_t rss_after = rss_bytes();
+	HistogramSnapshot latency = generator.latency();
+
+	printf(
+		"{\"benchmark\":\"loopback\",\"mode\":\"%s\",\"transport\":\"%s\","
+		"\"connections\":%u,"
+		"\"connected\":%u,\"server_threads\":%u,\"rate\":%llu,\"size\":%u,"
+		"\"duration_s\":%u,\"connect_s\":%.6f,\"accept_rate\":%.1f,"
+		"\"rss_per_connection_bytes\":%.1f,\"sent\":%llu,\"received\":%llu,"
+		"\"throughput_rps\":%.1f,\"throughput_bytes_per_s\":%.1f,"
+		"\"latency_ns\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%llu,"
+		"\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+		options.mode.c_str(),
+		options.transport.c_str(),
+		options.connections,
+		connected,
+		options.threads,
+		(unsigned long long)options.rate,
+		options.size,
+		options.duration,
+		connect_ns / 1e9,
+		connected / (connect_ns / 1e9),
+		connected == 0 ? 0.0 : double(rss_after - rss_before) / connected,
+		(unsigned long long)generator.sent(),
+		(unsigned long long)generator.received(),
+		latency.count / double(options.duration),
+		generator.bytes() / double(options.duration),
+		(unsigned long long)latency.count,
+		latency.mean(),
+		(unsigned long long)latency.percentile(50),
+		(unsigned long long)latency.percentile(99),
+		(unsigned long long)latency.percentile(99.9),
+		(unsigned long long)latency.max);
+
+	server.stop();
+	server.join();
+
+	return connected == options.connections ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,330 @@
+// Micro benchmarks of the loop's building blocks:
+//   timers    adding, cancelling and firing timeouts of the timing wheel,
+//             with 1k, 10k, 100k and 1M timers pending
+//   dispatch  events per second through Epoll with Pollable and with
+//             StaticPollable handlers, once including epoll_wait and once
+//             with a poller replaying the same batch, which leaves the cost
+//             of dispatching alone
+//
+// Prints one JSON object per measurement.
+//
+// Build with src/ reachable as linux_epoll/ on the include path:
+//   g++ -O2 -std=c++03 -I<include dir> bench/micro.cc src/util.cc -lpthread
+//
+// Usage:
+//   micro [timers|dispatch]...
+
+#include "linux_epoll/epoll.h"
+#include "linux_epoll/timeout.h"
+#include "linux_epoll/pollable.h"
+
+#include <vector>
+#include <algorithm>
+#include <string>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+
+using namespace linux_epoll;
+
+
+namespace
+{
+
+
+uint64_t clock_ns()
+{
+	return to_ns(now());
+}
+
+
+void report(char const* benchmark, char const* op, uint64_t count, uint64_t ns)
+{
+	printf(
+		"{\"benchmark\":\"%s\",\"op\":\"%s\",\"count\":%llu,"
+		"\"ns_per_op\":%.2f,\"ops_per_s\":%.1f}\n",
+		benchmark,
+		op,
+		(unsigned long long)count,
+		double(ns) / count,
+		count / (ns / 1e9));
+}
+
+
+void report_timers(char const* op, uint32_t pending, uint64_t count, uint64_t ns)
+{
+	printf(
+		"{\"benchmark\":\"timers\",\"op\":\"%s\",\"pending\":%u,"
+		"\"count\":%llu,\"ns_per_op\":%.2f,\"ops_per_s\":%.1f}\n",
+		op,
+		pending,
+		(unsigned long long)count,
+		double(ns) / count,
+		count / (ns / 1e9));
+}
+
+
+uint64_t fired = 0;
+
+void fire()
+{
+	++fired;
+}
+
+
+// every operation runs once per pending timer, so ns_per_op shows how the
+// wheel scales with the number of timers it holds
+void bench_timers(std::vector<uint64_t> const& durations, uint32_t pending)
+{
+	int owner;
+	std::vector<TimeoutHandle> handles(pending);
+
+	{
+		TimeoutList timeouts;
+
+		uint64_t start = clock_ns();
+		for(uint32_t i=0; i<pending; ++i)
+		{
+			handles[i] = timeouts.add(DurationNs(durations[i]), fire, &owner);
+		}
+		report_timers("add", pending, pending, clock_ns() - start);
+
+		start = clock_ns();
+		for(uint32_t i=0; i<pending; ++i)
+		{
+			timeouts.rearm(handles[i], DurationNs(durations[pending - 1 - i]));
+		}
+		report_timers("rearm", pending, pending, clock_ns() - start);
+
+		start = clock_ns();
+		for(uint32_t i=0; i<pending; ++i)
+		{
+			timeouts.cancel(handles[i]);
+		}
+		report_timers("cancel", pending, pending, clock_ns() - start);
+	}
+
+	{
+		// 10ms worth of timers on a 1us wheel. Every round sleeps until all
+		// of them are due and times the one process() expiring them, so
+		// ns_per_op is the cost per fired timer and not that of polling
+		// empty ticks; small sizes run more rounds for a stable figure
+		uint32_t rounds = std::max(100000 / pending, 1u);
+		uint64_t busy = 0;
+		fired = 0;
+
+		for(uint32_t round=0; round<rounds; ++round)
+		{
+			TimeoutList timeouts(DurationNs(1000));
+			for(uint32_t i=0; i<pending; ++i)
+			{
+				timeouts.add(DurationNs(durations[i] % 10000000), fire, &owner);
+			}
+
+			usleep(11000);
+
+			uint64_t start = clock_ns();
+			timeouts.process();
+			busy += clock_ns() - start;
+		}
+		report_timers("fire", pending, fired, busy);
+	}
+}
+
+
+void bench_timers()
+{
+	static const uint32_t COUNT = 1000000;
+
+	std::vector<uint64_t> durations(COUNT);
+	srand(1);
+	for(uint32_t i=0; i<COUNT; ++i)
+	{
+		// up to ten minutes, so timers land on every level of the wheel
+		durations[i] = (uint64_t(rand()) << 16 | (rand() & 0xffff)) % 600000000000ull;
+	}
+
+	for(uint32_t pending = 1000; pending <= COUNT; pending *= 10)
+	{
+		bench_timers(durations, pending);
+	}
+}
+
+
+struct Ready
+{
+	int      fd;
+	uint64_t hits;
+
+	int get_fd() const
+	{
+		return fd;
+	}
+
+	void added()
+	{}
+
+	void removed()
+	{}
+
+	void process_events(int)
+	{
+		++hits;
+	}
+};
+
+
+struct Other : Ready
+{};
+
+
+// Poller reporting every registered handler ready on each wait without a
+// system call, a loop on top of it spends its time dispatching only
+template<uint32_t SIZE>
+class ReplayPoller
+{
+public:
+	void open(uint32_t)
+	{}
+
+	int get_fd() const
+	{
+		return -1;
+	}
+
+	void add(int fd, int event_mask, uint64_t data)
+	{
+		// the loop's own timer and wakeup fds are tagged with slots beyond
+		// SIZE and never ready here
+		if(uint32_t(data) >= SIZE)
+		{
+			return;
+		}
+
+		epoll_event event;
+		event.events = event_mask & ~EPOLLET;
+		event.data.u64 = data;
+		fds_.push_back(fd);
+		events_.push_back(event);
+	}
+
+	void remove(int fd)
+	{
+		for(uint32_t i=0; i<fds_.size(); ++i)
+		{
+			if(fds_[i] == fd)
+			{
+				fds_.erase(fds_.begin() + i);
+				events_.erase(events_.begin() + i);
+				return;
+			}
+		}
+	}
+
+	int wait(struct epoll_event * events, int max_events, int)
+	{
+		int count = std::min(max_events, int(events_.size()));
+		std::copy(events_.begin(), events_.begin() + count, events);
+		return count;
+	}
+
+private:
+	std::vector<int>         fds_;
+	std::vector<epoll_event> events_;
+};
+
+
+// HANDLERS level-triggered eventfds that stay readable, so every wait
+// returns all of them. Ready and Other alternate, so a virtual call does not
+// hit the same target every time
+template<class LOOP>
+void bench_dispatch(char const* benchmark, char const* name)
+{
+	static const uint32_t HANDLERS = 256;
+	static const uint32_t ROUNDS = 20000;
+
+	LOOP * loop = new LOOP();
+	std::vector<Ready> readies(HANDLERS / 2);
+	std::vector<Other> others(HANDLERS / 2);
+
+	for(uint32_t i=0; i<HANDLERS / 2; ++i)
+	{
+		readies[i].fd = eventfd(1, EFD_NONBLOCK);
+		readies[i].hits = 0;
+		loop->add(readies[i], EPOLLIN);
+
+		others[i].fd = eventfd(1, EFD_NONBLOCK);
+		others[i].hits = 0;
+		loop->add(others[i], EPOLLIN);
+	}
+
+	uint64_t start = clock_ns();
+	for(uint32_t i=0; i<ROUNDS; ++i)
+	{
+		loop->wait();
+		loop->process();
+	}
+	uint64_t elapsed = clock_ns() - start;
+
+	uint64_t hits = 0;
+	for(uint32_t i=0; i<HANDLERS / 2; ++i)
+	{
+		hits += readies[i].hits + others[i].hits;
+		loop->remove(readies[i]);
+		loop->remove(others[i]);
+		close(readies[i].fd);
+		close(others[i].fd);
+	}
+	delete loop;
+
+	report(benchmark, name, hits, elapsed);
+}
+
+
+} //namespace
+
+
+int main(int argc, char ** argv)
+{
+	std::vector<std::string> benchmarks(argv + 1, argv + argc);
+	if(benchmarks.empty())
+	{
+		benchmarks.push_back("timers");
+		benchmarks.push_back("dispatch");
+	}
+
+	for(uint32_t i=0; i<benchmarks.size(); ++i)
+	{
+		if(benchmarks[i] == "timers")
+		{
+			bench_timers();
+		}
+		else if(benchmarks[i] == "dispatch")
+		{
+			bench_dispatch<Epoll<512> >("dispatch", "pollable");
+			bench_dispatch<Epoll<512, StaticPollable<Ready, Other> > >(
+				"dispatch",
+				"static_pollable");
+
+			bench_dispatch<Epoll<512, Pollable, ReplayPoller<512> > >(
+				"dispatch_only",
+				"pollable");
+			bench_dispatch<
+				Epoll<512, StaticPollable<Ready, Other>, ReplayPoller<512> > >(
+				"dispatch_only",
+				"static_pollable");
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [timers|dispatch]...\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
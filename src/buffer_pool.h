@@ -0,0 +1,199 @@
+#pragma once
+
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+
+namespace linux_epoll
+{
+
+
+// Fixed size receive buffers shared by the connections of one loop. Sockets
+// of endpoints that set READ_BUFFER_POOL borrow a slab while they read and
+// give it back as soon as the endpoint has consumed everything, so idle
+// connections hold no buffer at all.
+//
+// Slabs are carved from 2MiB chunks, either explicit huge pages or, when
+// none are reserved, ordinary memory advised for transparent huge pages.
+// Released slabs are reused last in first out, the next read lands in memory
+// that is likely still cached. Chunks are only returned when the pool is
+// destroyed.
+//
+// Not thread-safe, a pool belongs to the thread running its loop.
+class BufferPool
+{
+public:
+	static const uint32_t DEFAULT_SLAB_SIZE = 64 * 1024;
+	static const uint32_t CHUNK_SIZE        = 2 * 1024 * 1024;
+
+	BufferPool(uint32_t slab_size = DEFAULT_SLAB_SIZE, bool huge_pages = false)
+	: free_(NULL)
+	, carved_(CHUNK_SIZE)
+	, in_use_(0)
+	{
+		configure(slab_size, huge_pages);
+	}
+
+	~BufferPool()
+	{
+		for(uint32_t i=0; i<chunks_.size(); ++i)
+		{
+			munmap(chunks_[i], CHUNK_SIZE);
+		}
+	}
+
+	// slab_size is rounded up to a power of two of at least 4KiB and at most
+	// CHUNK_SIZE; only takes effect before the first slab is handed out
+	void configure(uint32_t slab_size, bool huge_pages)
+	{
+		if(not chunks_.empty())
+		{
+			return;
+		}
+
+		slab_size_ = 4096;
+		while(slab_size_ < slab_size and slab_size_ < CHUNK_SIZE)
+		{
+			slab_size_ <<= 1;
+		}
+
+		huge_pages_ = huge_pages;
+	}
+
+	uint32_t slab_size() const
+	{
+		return slab_size_;
+	}
+
+	uint32_t in_use() const
+	{
+		return in_use_;
+	}
+
+	// bytes mapped for slabs, in use or free
+	uint64_t reserved() const
+	{
+		return uint64_t(chunks_.size()) * CHUNK_SIZE;
+	}
+
+	uint8_t * acquire()
+	{
+		++in_use_;
+
+		if(free_ != NULL)
+		{
+			FreeSlab * slab = free_;
+			free_ = slab->next;
+			return reinterpret_cast<uint8_t*>(slab);
+		}
+
+		if(carved_ == CHUNK_SIZE)
+		{
+			chunks_.push_back(map_chunk_());
+			carved_ = 0;
+		}
+
+		uint8_t * slab = chunks_.back() + carved_;
+		carved_ += slab_size_;
+		return slab;
+	}
+
+	void release(uint8_t * slab)
+	{
+		--in_use_;
+
+		FreeSlab * free = reinterpret_cast<FreeSlab*>(slab);
+		free->next = free_;
+		free_ = free;
+	}
+
+private:
+	struct FreeSlab
+	{
+		FreeSlab * next;
+	};
+
+	uint32_t               slab_size_;
+	bool                   huge_pages_;
+	FreeSlab             * free_;
+	uint32_t               carved_;
+	uint32_t               in_use_;
+	std::vector<uint8_t *> chunks_;
+
+	uint8_t * map_chunk_()
+	{
+		void * chunk = MAP_FAILED;
+
+		if(huge_pages_)
+		{
+			chunk = mmap(
+				NULL,
+				CHUNK_SIZE,
+				PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,
+				-1,
+				0);
+		}
+
+		if(chunk == MAP_FAILED)
+		{
+			// a transparent huge page has to start on a 2MiB boundary,
+			// which mmap does not guarantee, so a chunk more is mapped and
+			// what lies outside the aligned chunk is unmapped again
+			size_t size = huge_pages_ ? 2 * CHUNK_SIZE : CHUNK_SIZE;
+
+			chunk = mmap(
+				NULL,
+				size,
+				PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS,
+				-1,
+				0);
+
+			if(chunk == MAP_FAILED)
+			{
+				perror("BufferPool mmap");
+				exit(EXIT_FAILURE);
+			}
+
+			if(huge_pages_)
+			{
+				chunk = trim_(static_cast<uint8_t*>(chunk), size);
+				madvise(chunk, CHUNK_SIZE, MADV_HUGEPAGE);
+			}
+		}
+
+		return static_cast<uint8_t*>(chunk);
+	}
+
+	// returns the CHUNK_SIZE aligned chunk within mapping
+	static uint8_t * trim_(uint8_t * mapping, size_t size)
+	{
+		uintptr_t address = reinterpret_cast<uintptr_t>(mapping);
+		uintptr_t aligned = (address + CHUNK_SIZE - 1) & ~uintptr_t(CHUNK_SIZE - 1);
+		uint8_t * chunk = reinterpret_cast<uint8_t*>(aligned);
+
+		size_t head = chunk - mapping;
+		size_t tail = size - head - CHUNK_SIZE;
+
+		if(head != 0)
+		{
+			munmap(mapping, head);
+		}
+
+		if(tail != 0)
+		{
+			munmap(chunk + CHUNK_SIZE, tail);
+		}
+
+		return chunk;
+	}
+};
+
+
+} //namespace linux_epoll
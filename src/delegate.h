@@ -0,0 +1,418 @@
+#pragma once
+
+#include <new>
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace linux_epoll
+{
+
+
+// room for a member function pointer, an object pointer and one more bound
+// argument, which covers every tr1::bind the loop and the sockets create
+static const uint32_t DELEGATE_CAPACITY = 4 * sizeof(void*);
+
+
+// Keeps the functor of a Delegate inline and knows how to copy and destroy
+// it. Functors larger than CAPACITY are rejected at compile time instead of
+// being moved to the heap.
+template<uint32_t CAPACITY>
+class DelegateStorage
+{
+public:
+	DelegateStorage()
+	: manage_(NULL)
+	{}
+
+	DelegateStorage(DelegateStorage const& other)
+	: manage_(NULL)
+	{
+		copy_(other);
+	}
+
+	DelegateStorage & operator=(DelegateStorage const& other)
+	{
+		if(this != &other)
+		{
+			destroy_();
+			copy_(other);
+		}
+		return *this;
+	}
+
+	~DelegateStorage()
+	{
+		destroy_();
+	}
+
+protected:
+	union Buffer
+	{
+		char        bytes[CAPACITY];
+		void      * pointer;
+		long long   integer;
+		double      real;
+		void     (* function)();
+	};
+
+	// copy constructs target from source, or destroys target if source is NULL
+	typedef void (*Manage_t)(Buffer & target, Buffer const* source);
+
+	Buffer   buffer_;
+	Manage_t manage_;
+
+	template<class F>
+	void store_(F const& functor)
+	{
+		typedef char FunctorExceedsDelegateCapacity[
+			sizeof(F) <= CAPACITY ? 1 : -1];
+		(void)sizeof(FunctorExceedsDelegateCapacity);
+
+		destroy_();
+		new (buffer_.bytes) F(functor);
+		manage_ = &manage_functor_<F>;
+	}
+
+	void destroy_()
+	{
+		if(manage_ != NULL)
+		{
+			manage_(buffer_, NULL);
+			manage_ = NULL;
+		}
+	}
+
+	template<class F>
+	static F & functor_(Buffer & buffer)
+	{
+		return *reinterpret_cast<F*>(buffer.bytes);
+	}
+
+private:
+	void copy_(DelegateStorage const& other)
+	{
+		if(other.manage_ != NULL)
+		{
+			other.manage_(buffer_, &other.buffer_);
+			manage_ = other.manage_;
+		}
+	}
+
+	template<class F>
+	static void manage_functor_(Buffer & target, Buffer const* source)
+	{
+		if(source == NULL)
+		{
+			functor_<F>(target).~F();
+		}
+		else
+		{
+			new (target.bytes) F(*reinterpret_cast<F const*>(source->bytes));
+		}
+	}
+};
+
+
+// Fixed capacity replacement for std::tr1::function: free functions and
+// functors such as the result of tr1::bind are kept inside the object, so
+// creating, copying and calling a Delegate never allocates.
+//
+// Delegate<void(int)> d(std::tr1::bind(&T::f, this, _1));
+// if(d) d(1);
+template<class SIGNATURE, uint32_t CAPACITY = DELEGATE_CAPACITY>
+class Delegate;
+
+
+template<class R, uint32_t CAPACITY>
+class Delegate<R(), CAPACITY> : public DelegateStorage<CAPACITY>
+{
+	typedef DelegateStorage<CAPACITY> Base_t;
+	typedef typename Base_t::Buffer   Buffer;
+
+public:
+	Delegate()
+	: invoke_(NULL)
+	{}
+
+	Delegate(R (*function)())
+	: invoke_(NULL)
+	{
+		set_(function);
+	}
+
+	template<class F>
+	Delegate(F const& functor)
+	: invoke_(NULL)
+	{
+		set_(functor);
+	}
+
+	R operator()() const
+	{
+		return invoke_(const_cast<Buffer&>(this->buffer_));
+	}
+
+	operator bool() const
+	{
+		return invoke_ != NULL;
+	}
+
+	void reset()
+	{
+		this->destroy_();
+		invoke_ = NULL;
+	}
+
+private:
+	R (*invoke_)(Buffer &);
+
+	template<class F>
+	void set_(F const& functor)
+	{
+		this->store_(functor);
+		invoke_ = &invoke_functor_<F>;
+	}
+
+	template<class F>
+	static R invoke_functor_(Buffer & buffer)
+	{
+		return Base_t::template functor_<F>(buffer)();
+	}
+};
+
+
+template<class R, class A1, uint32_t CAPACITY>
+class Delegate<R(A1), CAPACITY> : public DelegateStorage<CAPACITY>
+{
+	typedef DelegateStorage<CAPACITY> Base_t;
+	typedef typename Base_t::Buffer   Buffer;
+
+public:
+	Delegate()
+	: invoke_(NULL)
+	{}
+
+	Delegate(R (*function)(A1))
+	: invoke_(NULL)
+	{
+		set_(function);
+	}
+
+	template<class F>
+	Delegate(F const& functor)
+	: invoke_(NULL)
+	{
+		set_(functor);
+	}
+
+	R operator()(A1 a1) const
+	{
+		return invoke_(const_cast<Buffer&>(this->buffer_), a1);
+	}
+
+	operator bool() const
+	{
+		return invoke_ != NULL;
+	}
+
+	void reset()
+	{
+		this->destroy_();
+		invoke_ = NULL;
+	}
+
+private:
+	R (*invoke_)(Buffer &, A1);
+
+	template<class F>
+	void set_(F const& functor)
+	{
+		this->store_(functor);
+		invoke_ = &invoke_functor_<F>;
+	}
+
+	template<class F>
+	static R invoke_functor_(Buffer & buffer, A1 a1)
+	{
+		return Base_t::template functor_<F>(buffer)(a1);
+	}
+};
+
+
+template<class R, class A1, class A2, uint32_t CAPACITY>
+class Delegate<R(A1, A2), CAPACITY> : public DelegateStorage<CAPACITY>
+{
+	typedef DelegateStorage<CAPACITY> Base_t;
+	typedef typename Base_t::Buffer   Buffer;
+
+public:
+	Delegate()
+	: invoke_(NULL)
+	{}
+
+	Delegate(R (*function)(A1, A2))
+	: invoke_(NULL)
+	{
+		set_(function);
+	}
+
+	template<class F>
+	Delegate(F const& functor)
+	: invoke_(NULL)
+	{
+		set_(functor);
+	}
+
+	R operator()(A1 a1, A2 a2) const
+	{
+		return invoke_(const_cast<Buffer&>(this->buffer_), a1, a2);
+	}
+
+	operator bool() const
+	{
+		return invoke_ != NULL;
+	}
+
+	void reset()
+	{
+		this->destroy_();
+		invoke_ = NULL;
+	}
+
+private:
+	R (*invoke_)(Buffer &, A1, A2);
+
+	template<class F>
+	void set_(F const& functor)
+	{
+		this->store_(functor);
+		invoke_ = &invoke_functor_<F>;
+	}
+
+	template<class F>
+	static R invoke_functor_(Buffer & buffer, A1 a1, A2 a2)
+	{
+		return Base_t::template functor_<F>(buffer)(a1, a2);
+	}
+};
+
+
+template<class R, class A1, class A2, class A3, uint32_t CAPACITY>
+class Delegate<R(A1, A2, A3), CAPACITY> : public DelegateStorage<CAPACITY>
+{
+	typedef DelegateStorage<CAPACITY> Base_t;
+	typedef typename Base_t::Buffer   Buffer;
+
+public:
+	Delegate()
+	: invoke_(NULL)
+	{}
+
+	Delegate(R (*function)(A1, A2, A3))
+	: invoke_(NULL)
+	{
+		set_(function);
+	}
+
+	template<class F>
+	Delegate(F const& functor)
+	: invoke_(NULL)
+	{
+		set_(functor);
+	}
+
+	R operator()(A1 a1, A2 a2, A3 a3) const
+	{
+		return invoke_(const_cast<Buffer&>(this->buffer_), a1, a2, a3);
+	}
+
+	operator bool() const
+	{
+		return invoke_ != NULL;
+	}
+
+	void reset()
+	{
+		this->destroy_();
+		invoke_ = NULL;
+	}
+
+private:
+	R (*invoke_)(Buffer &, A1, A2, A3);
+
+	template<class F>
+	void set_(F const& functor)
+	{
+		this->store_(functor);
+		invoke_ = &invoke_functor_<F>;
+	}
+
+	template<class F>
+	static R invoke_functor_(Buffer & buffer, A1 a1, A2 a2, A3 a3)
+	{
+		return Base_t::template functor_<F>(buffer)(a1, a2, a3);
+	}
+};
+
+
+template<class R, class A1, class A2, class A3, class A4, uint32_t CAPACITY>
+class Delegate<R(A1, A2, A3, A4), CAPACITY> : public DelegateStorage<CAPACITY>
+{
+	typedef DelegateStorage<CAPACITY> Base_t;
+	typedef typename Base_t::Buffer   Buffer;
+
+public:
+	Delegate()
+	: invoke_(NULL)
+	{}
+
+	Delegate(R (*function)(A1, A2, A3, A4))
+	: invoke_(NULL)
+	{
+		set_(function);
+	}
+
+	template<class F>
+	Delegate(F const& functor)
+	: invoke_(NULL)
+	{
+		set_(functor);
+	}
+
+	R operator()(A1 a1, A2 a2, A3 a3, A4 a4) const
+	{
+		return invoke_(const_cast<Buffer&>(this->buffer_), a1, a2, a3, a4);
+	}
+
+	operator bool() const
+	{
+		return invoke_ != NULL;
+	}
+
+	void reset()
+	{
+		this->destroy_();
+		invoke_ = NULL;
+	}
+
+private:
+	R (*invoke_)(Buffer &, A1, A2, A3, A4);
+
+	template<class F>
+	void set_(F const& functor)
+	{
+		this->store_(functor);
+		invoke_ = &invoke_functor_<F>;
+	}
+
+	template<class F>
+	static R invoke_functor_(Buffer & buffer, A1 a1, A2 a2, A3 a3, A4 a4)
+	{
+		return Base_t::template functor_<F>(buffer)(a1, a2, a3, a4);
+	}
+};
+
+
+} //namespace linux_epoll
@@ -1,9 +1,19 @@
 #pragma once
 
 #include "linux_epoll/util.h"
+#include "linux_epoll/log.h"
 #include "linux_epoll/timeout.h"
+#include "linux_epoll/timer_fd.h"
+#include "linux_epoll/event_fd.h"
+#include "linux_epoll/task_queue.h"
+#include "linux_epoll/epoll_poller.h"
+#include "linux_epoll/uring_poller.h"
+#include "linux_epoll/loop_metrics.h"
+#include "linux_epoll/buffer_pool.h"
+#include "linux_epoll/file_cache.h"
 #include "linux_epoll/list.h"
 #include "linux_epoll/sockets.h"
+#include "linux_epoll/uring_sockets.h"
 #include "linux_epoll/pollable.h"
 
 #include <deque>
@@ -22,29 +32,93 @@ namespace linux_epoll
 {
 
 
-template<uint32_t SIZE>
+#if defined(LINUX_EPOLL_IO_URING)
+typedef UringPoller DefaultPoller;
+#else
+typedef EpollPoller DefaultPoller;
+#endif
+
+#if defined(LINUX_EPOLL_METRICS)
+typedef LoopMetrics DefaultMetrics;
+#else
+typedef NoMetrics DefaultMetrics;
+#endif
+
+
+// POLLABLE is the type erasure used for registered handlers: Pollable accepts
+// any type, StaticPollable<...> is restricted to a closed list of handler types
+// but dispatches without virtual calls.
+// POLLER is the readiness backend, EpollPoller or UringPoller; the default is
+// chosen at compile time by defining LINUX_EPOLL_IO_URING.
+// METRICS is LoopMetrics or NoMetrics, whose empty hooks compile away; the
+// default is chosen at compile time by defining LINUX_EPOLL_METRICS.
+template<
+	uint32_t SIZE,
+	class POLLABLE = Pollable,
+	class POLLER = DefaultPoller,
+	class METRICS = DefaultMetrics>
 class Epoll
 {
 public:
-	Epoll()
+	Epoll(
+		DurationNs timer_resolution = DurationMs(1),
+		TimerMode timer_mode = CoarseTimers)
 	: event_count_(0)
+	, timeouts_(timer_resolution)
+	, timer_mode_(timer_mode)
+	, spin_ns_(0)
 	{
-		printf("Epoll CTor\n");
-		fd_ = epoll_create(SIZE);
-		if(fd_ == -1)
+		LINUX_EPOLL_LOG_DEBUG("Epoll CTor");
+		memset(generations_, 0, sizeof(generations_));
+		memset(ready_mask_, 0, sizeof(ready_mask_));
+		events_.resize(SIZE);
+		poller_.open(SIZE);
+
+		if(timer_mode_ == PreciseTimers)
 		{
-			perror("epoll_create");
-			exit(EXIT_FAILURE);
+			timer_.open();
+			add_internal_(timer_.get_fd(), TIMER_SLOT);
 		}
+
+		wakeup_.open();
+		add_internal_(wakeup_.get_fd(), WAKEUP_SLOT);
 	}
 
+	// the callback may run up to slack later than duration, which lets the
+	// loop fire it together with other timers, see TimeoutList
 	template<class T>
-	void register_timeout(
+	TimeoutHandle register_timeout(
 		DurationMs duration,
-		std::tr1::function<void()> callback,
-		T const* dependencies)
+		TimeoutList::Callback_t const& callback,
+		T const* dependencies,
+		DurationNs slack = DurationNs(0))
 	{
-		timeouts_.add(duration, callback, dependencies);
+		return timeouts_.add(duration, callback, dependencies, slack);
+	}
+
+	template<class T>
+	TimeoutHandle register_timeout(
+		DurationNs duration,
+		TimeoutList::Callback_t const& callback,
+		T const* dependencies,
+		DurationNs slack = DurationNs(0))
+	{
+		return timeouts_.add(duration, callback, dependencies, slack);
+	}
+
+	bool cancel_timeout(TimeoutHandle const& handle)
+	{
+		return timeouts_.cancel(handle);
+	}
+
+	bool rearm_timeout(TimeoutHandle const& handle, DurationMs duration)
+	{
+		return timeouts_.rearm(handle, duration);
+	}
+
+	bool rearm_timeout(TimeoutHandle const& handle, DurationNs duration)
+	{
+		return timeouts_.rearm(handle, duration);
 	}
 
 	template<class T>
@@ -53,48 +127,146 @@ public:
 		timeouts_.remove(dependency);
 	}
 
+	// with busy polling enabled wait() first polls without blocking for up
+	// to budget, which saves the sleep and wakeup when events follow each
+	// other closely at the price of a core kept busy; 0 disables it
+	void set_busy_poll(DurationNs budget)
+	{
+		spin_ns_ = budget.value;
+	}
+
+	// upper bound of events taken from the poller per wait(), SIZE unless
+	// set; smaller batches return to the timers and the ready-list sooner
+	void set_batch_size(uint32_t size)
+	{
+		events_.resize(std::max(size, uint32_t(1)));
+	}
+
+	// dispatches t with event_mask again during the next process(). Handlers
+	// that stop early to let others run, like a TcpSocket that used up its
+	// read budget, use it to be resumed although no new edge is coming;
+	// wait() does not block while handlers are scheduled.
+	template<class T>
+	void schedule(T & t, int event_mask)
+	{
+		int fd = t.get_fd();
+
+		if(fd < 0 or fd >= int(slots_.size()) or slots_[fd] == NO_SLOT)
+		{
+			return;
+		}
+
+		uint32_t slot = slots_[fd];
+		if(ready_mask_[slot] == 0)
+		{
+			epoll_event event;
+			event.events = 0;
+			event.data.u64 = (uint64_t(generations_[slot]) << 32) | slot;
+			ready_.push_back(event);
+		}
+		ready_mask_[slot] |= event_mask;
+	}
+
 	void wait()
 	{
-		event_count_ = epoll_wait(
-			fd_,
-			events_,
-			SIZE,
-			timeouts_.wait_interval());
+		int timeout = ready_.empty() ? timeouts_.wait_interval() : 0;
 
-		if(event_count_ == -1)
+		metrics_.wait_begin();
+
+		if(spin_ns_ != 0 and timeout != 0 and spin_())
 		{
-			perror("epoll_wait");
-			exit(EXIT_FAILURE);
+			metrics_.wait_end(event_count_);
+			return;
 		}
+
+		if(timer_mode_ == PreciseTimers and timeout > 0)
+		{
+			struct timespec deadline;
+			timeouts_.next_deadline(deadline);
+			timer_.arm(deadline);
+			timeout = -1;
+		}
+
+		event_count_ = poller_.wait(&events_[0], events_.size(), timeout);
+		metrics_.wait_end(event_count_);
 	}
 
 	void process()
 	{
-		printf("-->process()\n");
+		LINUX_EPOLL_LOG_TRACE("-->process()");
+
+		metrics_.process_begin();
 
-		timeouts_.process();
+		// handlers scheduled from here on run in the next process(), after
+		// the poller had a chance to report everybody else
+		running_.swap(ready_);
+
+		timeouts_.process(metrics_);
 
 		for (int n = 0; n < event_count_; ++n)
 		{
-			reinterpret_cast<Pollable *>(events_[n].data.ptr)->
-				process_events(events_[n].events);
+			uint32_t slot = events_[n].data.u64;
+
+			if(slot >= SIZE)
+			{
+				process_internal_(slot, events_[n].events);
+				continue;
+			}
+
+			dispatch_(events_[n].data.u64, events_[n].events);
+		}
+
+		for(uint32_t i=0; i<running_.size(); ++i)
+		{
+			uint32_t slot = running_[i].data.u64;
+			uint32_t generation = running_[i].data.u64 >> 32;
+
+			if(generations_[slot] != generation or ready_mask_[slot] == 0)
+			{
+				continue;
+			}
+
+			uint32_t event_mask = ready_mask_[slot];
+			ready_mask_[slot] = 0;
+			dispatch_(running_[i].data.u64, event_mask);
 		}
+		running_.clear();
+
+		metrics_.process_end();
 	}
 
+	// false if the loop is full or t has no descriptor
 	template<class T>
 	bool add(T & t, int event_mask = EPOLLIN|EPOLLOUT|EPOLLHUP|EPOLLET)
 	{
-		Pollable * p = pollables_.add(Pollable(t));
+		int fd = t.get_fd();
+		if(fd < 0)
+		{
+			return false;
+		}
+
+		POLLABLE * p = pollables_.add(POLLABLE(t));
 
 		if(p)
 		{
-			printf("epoll_fd:%d add fd:%d\n", fd_, p->get_fd());
+			uint32_t slot = pollables_.index_of(p);
 
-			if(epoll_ctl(fd_, EPOLL_CTL_ADD, p->get_fd(), ev(event_mask, p)) == -1)
+			LINUX_EPOLL_LOG_DEBUG("epoll_fd:%d add fd:%d", poller_.get_fd(), fd);
+
+			if(fd >= int(slots_.size()))
 			{
-				perror("epoll_ctl: add fd");
-				exit(EXIT_FAILURE);
+				// a copy, resize() binds a reference and NO_SLOT has no
+				// definition to refer to
+				slots_.resize(fd + 1, uint32_t(NO_SLOT));
 			}
+			slots_[fd] = slot;
+
+			poller_.add(
+				fd,
+				event_mask,
+				(uint64_t(generations_[slot]) << 32) | slot);
+
+			metrics_.occupancy(pollables_.count());
 
 			p->added();
 			return true;
@@ -105,24 +277,55 @@ public:
 	template<class T>
 	void remove(T & t)
 	{
-		Pollable tmp(t);
-
-		Pollable * pollable = pollables_.find_if(FdPred(tmp.get_fd()));
+		int fd = t.get_fd();
 
-		if(pollable)
+		if(fd < 0 or fd >= int(slots_.size()) or slots_[fd] == NO_SLOT)
 		{
-			printf("epoll_fd:%d remove fd:%d\n", fd_, pollable->get_fd());
+			return;
+		}
 
-			if(epoll_ctl(fd_, EPOLL_CTL_DEL, pollable->get_fd(), ev()) == -1)
-			{
-				perror("epoll_ctl: remove fd");
-				exit(EXIT_FAILURE);
-			}
+		uint32_t slot = slots_[fd];
+		POLLABLE * pollable = pollables_.at(slot);
 
-			pollables_.remove(pollable);
-			remove_timeouts(&t);
-			pollable->removed();
-		}
+		LINUX_EPOLL_LOG_DEBUG("epoll_fd:%d remove fd:%d", poller_.get_fd(), fd);
+
+		poller_.remove(fd);
+
+		slots_[fd] = NO_SLOT;
+		++generations_[slot];
+		ready_mask_[slot] = 0;
+
+		remove_timeouts(&t);
+		pollable->removed();
+		pollables_.remove(pollable);
+
+		metrics_.occupancy(pollables_.count());
+	}
+
+	// receive buffers shared by the sockets of this loop, configure() it
+	// before the first connection reads
+	BufferPool & buffer_pool()
+	{
+		return buffer_pool_;
+	}
+
+	// open files the sockets of this loop send by path
+	FileCache & file_cache()
+	{
+		return file_cache_;
+	}
+
+	// the backend, for handlers that submit their I/O to it themselves like
+	// the UringTcpSocket does
+	POLLER & poller()
+	{
+		return poller_;
+	}
+
+	// thread-safe snapshots are taken with metrics().snapshot()
+	METRICS const& metrics() const
+	{
+		return metrics_;
 	}
 
 	bool is_full() const
@@ -130,35 +333,110 @@ public:
 		return pollables_.is_full();
 	}
 
+	// makes a concurrent or the next wait() return; safe to call from any thread
+	void wakeup()
+	{
+		wakeup_.notify();
+	}
+
+	// runs task on the loop thread during one of the next process() calls;
+	// safe to call from any thread
+	void post(std::tr1::function<void()> const& task)
+	{
+		if(tasks_.push(task))
+		{
+			wakeup_.notify();
+		}
+	}
+
 private:
-	int                  fd_;
-	int                  event_count_;
-	struct epoll_event   events_[SIZE];
-	List<Pollable, SIZE> pollables_;
-	TimeoutList          timeouts_;
+	POLLER                   poller_;
+	int                      event_count_;
+	std::vector<epoll_event> events_;
+	List<POLLABLE, SIZE>     pollables_;
+	uint32_t                 generations_[SIZE];
+	std::vector<uint32_t>    slots_;
+	TimeoutList              timeouts_;
+	TimerMode                timer_mode_;
+	TimerFd                  timer_;
+	EventFd                  wakeup_;
+	TaskQueue                tasks_;
+	METRICS                  metrics_;
+	BufferPool               buffer_pool_;
+	FileCache                file_cache_;
+	uint64_t                 spin_ns_;
+	std::vector<epoll_event> ready_;
+	std::vector<epoll_event> running_;
+	uint32_t                 ready_mask_[SIZE];
+
+	static const uint32_t NO_SLOT = 0xffffffff;
+
+	// polls until events arrive, the spin budget is used up or the next
+	// timer is due; returns false if wait() has to block after all
+	bool spin_()
+	{
+		uint64_t end = to_ns(now()) + spin_ns_;
+
+		struct timespec deadline;
+		if(timeouts_.next_deadline(deadline))
+		{
+			end = std::min(end, to_ns(deadline));
+		}
+
+		do
+		{
+			event_count_ = poller_.wait(&events_[0], events_.size(), 0);
+			if(event_count_ != 0)
+			{
+				return true;
+			}
+		}
+		while(to_ns(now()) < end);
 
-	struct FdPred
+		return false;
+	}
+
+	// fds owned by the loop itself are tagged with slots beyond SIZE and
+	// dispatched directly, so they need not be part of a StaticPollable list
+	static const uint32_t TIMER_SLOT  = SIZE;
+	static const uint32_t WAKEUP_SLOT = SIZE + 1;
+
+	void add_internal_(int fd, uint32_t slot)
 	{
-		int fd;
+		poller_.add(fd, EPOLLIN, slot);
+	}
 
-		FdPred(int fd_)
-		: fd(fd_)
-		{}
+	void dispatch_(uint64_t data, int event_mask)
+	{
+		uint32_t slot = data;
+		uint32_t generation = data >> 32;
 
-		bool operator()(Pollable const& pollable) const
+		// the handler was removed by an earlier event of this batch
+		if(generations_[slot] != generation)
 		{
-			return pollable.get_fd() == fd;
+			return;
 		}
-	};
 
-	epoll_event * ev(int mask=0, void* ptr=NULL)
+		uint64_t start = metrics_.dispatch_begin();
+		pollables_.at(slot)->process_events(event_mask);
+		metrics_.dispatch_end(start);
+	}
+
+	void process_internal_(uint32_t slot, int event_mask)
 	{
-		static epoll_event ev;
-		memset(&ev, 0, sizeof(ev));
-		ev.events = mask;
-		ev.data.ptr = ptr;
-		return &ev;
+		switch(slot)
+		{
+			case TIMER_SLOT:
+				timer_.process_events(event_mask);
+				break;
+
+			case WAKEUP_SLOT:
+				wakeup_.process_events(event_mask);
+				tasks_.run();
+				break;
+		}
 	}
+
 };
 
 
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+
+
+namespace linux_epoll
+{
+
+
+// Readiness backend of Epoll on top of epoll(7). Every registration carries
+// 64 bit of user data which is handed back in epoll_event.data.u64.
+class EpollPoller
+{
+public:
+	EpollPoller()
+	: fd_(-1)
+	{}
+
+	~EpollPoller()
+	{
+		if(fd_ != -1)
+		{
+			::close(fd_);
+		}
+	}
+
+	void open(uint32_t size)
+	{
+		fd_ = epoll_create(size);
+		if(fd_ == -1)
+		{
+			perror("epoll_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	int get_fd() const
+	{
+		return fd_;
+	}
+
+	void add(int fd, int event_mask, uint64_t data)
+	{
+		if(epoll_ctl(fd_, EPOLL_CTL_ADD, fd, ev(event_mask, data)) == -1)
+		{
+			perror("epoll_ctl: add fd");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	void remove(int fd)
+	{
+		if(epoll_ctl(fd_, EPOLL_CTL_DEL, fd, ev()) == -1)
+		{
+			perror("epoll_ctl: remove fd");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// timeout in milliseconds, -1 blocks until an event arrives
+	int wait(struct epoll_event * events, int max_events, int timeout)
+	{
+		int count = epoll_wait(fd_, events, max_events, timeout);
+
+		if(count == -1)
+		{
+			if(errno == EINTR)
+			{
+				return 0;
+			}
+
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+
+		return count;
+	}
+
+private:
+	int fd_;
+
+	epoll_event * ev(int mask=0, uint64_t data=0)
+	{
+		static epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = mask;
+		ev.data.u64 = data;
+		return &ev;
+	}
+};
+
+
+} //namespace linux_epoll
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+
+namespace linux_epoll
+{
+
+
+// Counter fd used to wake a loop that is blocked in epoll_wait. notify() may
+// be called from any thread.
+class EventFd
+{
+public:
+	EventFd()
+	: fd_(-1)
+	{}
+
+	~EventFd()
+	{
+		close();
+	}
+
+	void open()
+	{
+		if(fd_ == -1)
+		{
+			fd_ = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+			if(fd_ == -1)
+			{
+				perror("eventfd");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	void close()
+	{
+		if(fd_ != -1)
+		{
+			::close(fd_);
+			fd_ = -1;
+		}
+	}
+
+	void notify()
+	{
+		uint64_t one = 1;
+
+		if(::write(fd_, &one, sizeof(one)) == -1)
+		{
+			// EAGAIN means the counter is saturated, the loop wakes up anyway
+		}
+	}
+
+	int get_fd() const
+	{
+		return fd_;
+	}
+
+	void added()
+	{}
+
+	void removed()
+	{}
+
+	void process_events(int /*event_mask*/)
+	{
+		uint64_t count = 0;
+
+		if(::read(fd_, &count, sizeof(count)) == -1)
+		{
+			// EAGAIN, another reader already reset the counter
+		}
+	}
+
+private:
+	int fd_;
+};
+
+
+} //namespace linux_epoll
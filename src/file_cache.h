@@ -0,0 +1,351 @@
+#pragma once
+
+#include "linux_epoll/util.h"
+#include "linux_epoll/log.h"
+#include "linux_epoll/timeout.h"
+
+#include <vector>
+#include <string>
+#include <tr1/unordered_map>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+namespace linux_epoll
+{
+
+
+// length of a file range that extends to the end of the file
+static const uint64_t WHOLE_FILE = ~uint64_t(0);
+
+
+// Open file descriptors and fstat results of the files the sockets of one
+// loop send, so sending a file again costs neither open, fstat nor close.
+//
+// Files nobody is sending are kept in least recently used order and the
+// oldest are closed once more than capacity are cached; files still being
+// sent stay open until the last user releases them. An entry older than
+// validity is compared against its path with stat before it is handed out
+// again, a file that was replaced or modified is then opened anew.
+//
+// Not thread-safe, a cache belongs to the thread running its loop.
+class FileCache
+{
+public:
+	typedef uint32_t Handle;
+
+	static const Handle   NONE             = 0xffffffff;
+	static const uint32_t DEFAULT_CAPACITY = 1024;
+
+	FileCache(
+		uint32_t capacity = DEFAULT_CAPACITY,
+		DurationMs validity = DurationMs(60000))
+	: capacity_(capacity)
+	, validity_ns_(DurationNs(validity).value)
+	, head_(NIL)
+	, tail_(NIL)
+	, free_(NIL)
+	, open_count_(0)
+	{}
+
+	~FileCache()
+	{
+		for(uint32_t i=0; i<entries_.size(); ++i)
+		{
+			if(entries_[i].fd != -1)
+			{
+				::close(entries_[i].fd);
+			}
+		}
+	}
+
+	void configure(uint32_t capacity, DurationMs validity)
+	{
+		capacity_ = capacity;
+		validity_ns_ = DurationNs(validity).value;
+		evict_();
+	}
+
+	// files currently open, cached or being sent
+	uint32_t size() const
+	{
+		return open_count_;
+	}
+
+	// returns the open file at path, or NONE with errno set if it can not be
+	// opened; every handle acquired has to be released again
+	Handle acquire(std::string const& path)
+	{
+		Index::iterator it = index_.find(path);
+
+		if(it != index_.end())
+		{
+			Handle handle = it->second;
+
+			if(revalidate_(handle))
+			{
+				use_(handle);
+				return handle;
+			}
+
+			detach_(handle);
+		}
+
+		return open_(path);
+	}
+
+	void release(Handle handle)
+	{
+		Entry & entry = entries_[handle];
+
+		if(--entry.users != 0)
+		{
+			return;
+		}
+
+		if(entry.detached)
+		{
+			close_(handle);
+			return;
+		}
+
+		link_(handle);
+		evict_();
+	}
+
+	int fd(Handle handle) const
+	{
+		return entries_[handle].fd;
+	}
+
+	struct stat const& stat(Handle handle) const
+	{
+		return entries_[handle].stat;
+	}
+
+	// makes the next acquire of path open the file again, the current
+	// descriptor is closed once nobody is sending it any more
+	void invalidate(std::string const& path)
+	{
+		Index::iterator it = index_.find(path);
+
+		if(it != index_.end())
+		{
+			detach_(it->second);
+		}
+	}
+
+private:
+	static const uint32_t NIL = 0xffffffff;
+
+	struct Entry
+	{
+		std::string path;
+		int         fd;
+		struct stat stat;
+		uint64_t    checked_ns;
+		uint32_t    users;
+		bool        detached;
+		uint32_t    prev;
+		uint32_t    next;
+	};
+
+	typedef std::tr1::unordered_map<std::string, Handle> Index;
+
+	uint32_t           capacity_;
+	uint64_t           validity_ns_;
+	std::vector<Entry> entries_;
+	Index              index_;
+	uint32_t           head_;
+	uint32_t           tail_;
+	uint32_t           free_;
+	uint32_t           open_count_;
+
+	Handle open_(std::string const& path)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY|O_CLOEXEC);
+		if(fd == -1)
+		{
+			// the path is not logged, the drain thread would read it after
+			// the caller's string is gone
+			int error = errno;
+			LINUX_EPOLL_LOG_DEBUG("FileCache open failed errno:%d", error);
+			errno = error;
+			return NONE;
+		}
+
+		struct stat st;
+		if(fstat(fd, &st) == -1)
+		{
+			int error = errno;
+			::close(fd);
+			errno = error;
+			return NONE;
+		}
+
+		// only regular files can be sent with sendfile
+		if(not S_ISREG(st.st_mode))
+		{
+			::close(fd);
+			errno = EINVAL;
+			return NONE;
+		}
+
+		Handle handle = allocate_();
+		Entry & entry = entries_[handle];
+		entry.path = path;
+		entry.fd = fd;
+		entry.stat = st;
+		entry.checked_ns = to_ns(now());
+		entry.users = 1;
+		entry.detached = false;
+		entry.prev = NIL;
+		entry.next = NIL;
+
+		index_[path] = handle;
+		++open_count_;
+		evict_();
+		return handle;
+	}
+
+	// true if the cached descriptor still refers to what is at the path
+	bool revalidate_(Handle handle)
+	{
+		Entry & entry = entries_[handle];
+		uint64_t current = to_ns(now());
+
+		if(current - entry.checked_ns < validity_ns_)
+		{
+			return true;
+		}
+
+		struct stat st;
+		if(::stat(entry.path.c_str(), &st) == -1 or
+		   st.st_dev != entry.stat.st_dev or
+		   st.st_ino != entry.stat.st_ino or
+		   st.st_size != entry.stat.st_size or
+		   st.st_mtim.tv_sec != entry.stat.st_mtim.tv_sec or
+		   st.st_mtim.tv_nsec != entry.stat.st_mtim.tv_nsec or
+		   st.st_ctim.tv_sec != entry.stat.st_ctim.tv_sec or
+		   st.st_ctim.tv_nsec != entry.stat.st_ctim.tv_nsec)
+		{
+			return false;
+		}
+
+		entry.checked_ns = current;
+		return true;
+	}
+
+	void use_(Handle handle)
+	{
+		if(entries_[handle].users++ == 0)
+		{
+			unlink_(handle);
+		}
+	}
+
+	// removes the entry from the index, it is closed once unused
+	void detach_(Handle handle)
+	{
+		Entry & entry = entries_[handle];
+
+		index_.erase(entry.path);
+		entry.detached = true;
+
+		if(entry.users == 0)
+		{
+			unlink_(handle);
+			close_(handle);
+		}
+	}
+
+	// closes the least recently used idle files while above capacity
+	void evict_()
+	{
+		while(index_.size() > capacity_ and tail_ != NIL)
+		{
+			Handle handle = tail_;
+			index_.erase(entries_[handle].path);
+			unlink_(handle);
+			close_(handle);
+		}
+	}
+
+	void close_(Handle handle)
+	{
+		Entry & entry = entries_[handle];
+
+		::close(entry.fd);
+		entry.fd = -1;
+		entry.path.clear();
+		entry.next = free_;
+		free_ = handle;
+		--open_count_;
+	}
+
+	Handle allocate_()
+	{
+		if(free_ == NIL)
+		{
+			entries_.push_back(Entry());
+			return entries_.size() - 1;
+		}
+
+		Handle handle = free_;
+		free_ = entries_[handle].next;
+		return handle;
+	}
+
+	// idle entries, most recently used first
+	void link_(Handle handle)
+	{
+		entries_[handle].prev = NIL;
+		entries_[handle].next = head_;
+
+		if(head_ != NIL)
+		{
+			entries_[head_].prev = handle;
+		}
+		else
+		{
+			tail_ = handle;
+		}
+		head_ = handle;
+	}
+
+	void unlink_(Handle handle)
+	{
+		Entry & entry = entries_[handle];
+
+		if(entry.prev != NIL)
+		{
+			entries_[entry.prev].next = entry.next;
+		}
+		else
+		{
+			head_ = entry.next;
+		}
+
+		if(entry.next != NIL)
+		{
+			entries_[entry.next].prev = entry.prev;
+		}
+		else
+		{
+			tail_ = entry.prev;
+		}
+
+		entry.prev = NIL;
+		entry.next = NIL;
+	}
+};
+
+
+} //namespace linux_epoll
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+
+#include <stdint.h>
+#include <string.h>
+
+
+namespace linux_epoll
+{
+
+
+// Copy of a Histogram taken by Histogram::snapshot().
+struct HistogramSnapshot
+{
+	static const uint32_t SUB_BITS    = 4;
+	static const uint32_t SUB_BUCKETS = 1 << SUB_BITS;
+	static const uint32_t BUCKETS     = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+	HistogramSnapshot()
+	: count(0)
+	, sum(0)
+	, max(0)
+	{
+		memset(buckets, 0, sizeof(buckets));
+	}
+
+	uint64_t buckets[BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+
+	static uint32_t bucket_of(uint64_t value)
+	{
+		if(value < SUB_BUCKETS)
+		{
+			return value;
+		}
+
+		uint32_t shift = 63 - __builtin_clzll(value) - SUB_BITS;
+		return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+	}
+
+	// largest value counted in bucket
+	static uint64_t upper_bound_of(uint32_t bucket)
+	{
+		if(bucket < SUB_BUCKETS)
+		{
+			return bucket;
+		}
+
+		uint32_t shift = bucket / SUB_BUCKETS - 1;
+		uint64_t lower = uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+		return lower + ((uint64_t(1) << shift) - 1);
+	}
+
+	double mean() const
+	{
+		return count == 0 ? 0.0 : double(sum) / count;
+	}
+
+	// value below which percent of the samples are, with the precision of
+	// the bucket it falls into
+	uint64_t percentile(double percent) const
+	{
+		if(count == 0)
+		{
+			return 0;
+		}
+
+		uint64_t rank = uint64_t(percent / 100.0 * count + 0.5);
+		rank = std::min(std::max(rank, uint64_t(1)), count);
+
+		uint64_t seen = 0;
+		for(uint32_t i=0; i<BUCKETS; ++i)
+		{
+			seen += buckets[i];
+			if(seen >= rank)
+			{
+				return std::min(upper_bound_of(i), max);
+			}
+		}
+
+		return max;
+	}
+};
+
+
+// Log-linear histogram: values below 2^SUB_BITS are counted exactly, above
+// that every power of two is split into 2^SUB_BITS buckets, which keeps the
+// relative error below 1/2^SUB_BITS over the whole uint64_t range in 8KiB.
+//
+// There must be a single writer, the loop owning it. Counters are updated
+// with plain atomic stores instead of read-modify-write instructions, so
+// recording costs no locked instruction; snapshot() may be called from any
+// thread and sees every counter without tearing, though not all of them
+// at the same instant.
+class Histogram
+{
+public:
+	typedef HistogramSnapshot Snapshot_t;
+
+	Histogram()
+	: sum_(0)
+	, max_(0)
+	{
+		memset(buckets_, 0, sizeof(buckets_));
+	}
+
+	void record(uint64_t value)
+	{
+		increment_(buckets_[Snapshot_t::bucket_of(value)], 1);
+		increment_(sum_, value);
+
+		if(value > max_)
+		{
+			__atomic_store_n(&max_, value, __ATOMIC_RELAXED);
+		}
+	}
+
+	Snapshot_t snapshot() const
+	{
+		Snapshot_t result;
+
+		for(uint32_t i=0; i<Snapshot_t::BUCKETS; ++i)
+		{
+			result.buckets[i] = __atomic_load_n(&buckets_[i], __ATOMIC_RELAXED);
+			result.count += result.buckets[i];
+		}
+
+		result.sum = __atomic_load_n(&sum_, __ATOMIC_RELAXED);
+		result.max = __atomic_load_n(&max_, __ATOMIC_RELAXED);
+		return result;
+	}
+
+private:
+	uint64_t buckets_[Snapshot_t::BUCKETS];
+	uint64_t sum_;
+	uint64_t max_;
+
+	static void increment_(uint64_t & counter, uint64_t value)
+	{
+		__atomic_store_n(
+			&counter,
+			__atomic_load_n(&counter, __ATOMIC_RELAXED) + value,
+			__ATOMIC_RELAXED);
+	}
+};
+
+
+} //namespace linux_epoll
@@ -3,131 +3,150 @@
 #include <stdint.h>
 #include <string.h>
 #include <cstdlib>
+#include <new>
+
+#if __cplusplus >= 201103L
+#include <utility>
+#endif
 
 namespace linux_epoll
 {
 
 
+// Fixed capacity storage with stable element addresses. Free slots are
+// chained into a LIFO free list and occupied slots are tracked in a packed
+// bitmap, so add, remove and count are O(1) and iterating only touches the
+// occupied slots.
 template<class T, uint32_t SIZE>
 class List
 {
 public:
 	List()
+	: free_(0)
+	, count_(0)
 	{
 		elements_ = reinterpret_cast<T*>(data);
+
 		for(uint32_t i=0; i<SIZE; ++i)
 		{
-			valid_[i] = false;
+			next_free_[i] = i+1;
+		}
+		next_free_[SIZE-1] = NIL;
+
+		for(uint32_t i=0; i<WORDS; ++i)
+		{
+			occupied_[i] = 0;
 		}
 	}
 
 	~List()
 	{
-		for(uint32_t i=0; i<SIZE; ++i)
-		{
-			remove_(i);
-		}
+		clear();
 	}
 
 	bool is_empty() const
 	{
-		return count() == 0;
+		return count_ == 0;
 	}
 
 	bool is_full() const
 	{
-		return count() == SIZE;
+		return count_ == SIZE;
 	}
 
 	uint32_t count() const
 	{
-		uint32_t result = 0;
-
-		for(uint32_t i=0; i<SIZE; ++i)
-		{
-			if(valid_[i])
-			{
-				++result;
-			}
-		}
-
-		return result;
+		return count_;
 	}
 
 	T * add()
 	{
-		for(uint32_t i=0; i<SIZE; ++i)
+		if(free_ == NIL)
 		{
-			if(not valid_[i])
-			{
-				valid_[i] = true;
-				return new (&elements_[i]) T();
-			}
+			return NULL;
 		}
 
-		return NULL;
+		return commit_(new (&elements_[free_]) T());
 	}
 
 	template<class ARG>
 	T * add(ARG & arg)
 	{
-		for(uint32_t i=0; i<SIZE; ++i)
+		if(free_ == NIL)
 		{
-			if(not valid_[i])
-			{
-				valid_[i] = true;
-				return new (&elements_[i]) T(arg);
-			}
+			return NULL;
 		}
 
-		return NULL;
+		return commit_(new (&elements_[free_]) T(arg));
 	}
 
 	template<class ARG>
 	T * add(ARG const& arg)
 	{
-		for(uint32_t i=0; i<SIZE; ++i)
+		if(free_ == NIL)
 		{
-			if(not valid_[i])
-			{
-				valid_[i] = true;
-				return new (&elements_[i]) T(arg);
-			}
+			return NULL;
 		}
 
-		return NULL;
+		return commit_(new (&elements_[free_]) T(arg));
 	}
 
 	template<class ARG1, class ARG2>
 	T * add(ARG1 & arg1, ARG2 & arg2)
 	{
-		for(uint32_t i=0; i<SIZE; ++i)
+		if(free_ == NIL)
 		{
-			if(not valid_[i])
-			{
-				valid_[i] = true;
-				return new (&elements_[i]) T(arg1, arg2);
-			}
+			return NULL;
+		}
+
+		return commit_(new (&elements_[free_]) T(arg1, arg2));
+	}
+
+#if __cplusplus >= 201103L
+	template<class... ARGS>
+	T * emplace(ARGS&&... args)
+	{
+		if(free_ == NIL)
+		{
+			return NULL;
 		}
 
+		return commit_(new (&elements_[free_]) T(std::forward<ARGS>(args)...));
+	}
+#endif
+
+	// NULL when the slot is not occupied
+	T * at(uint32_t index)
+	{
+		if(index < SIZE and is_valid_(index))
+		{
+			return &elements_[index];
+		}
 		return NULL;
 	}
 
+	uint32_t index_of(T const* element) const
+	{
+		return (element - elements_);
+	}
+
 	void remove(T * element)
 	{
 		if(is_in_range_(element))
 		{
-			remove_(index_of_(element));
+			remove_(index_of(element));
 		}
 	}
 
 	template<class PRED>
 	T * find_if(PRED const& pred)
 	{
-		for(uint32_t i=0; i<SIZE; ++i)
+		for(uint32_t w=0; w<WORDS; ++w)
 		{
-			if(valid_[i])
+			for(uint64_t bits = occupied_[w]; bits; bits &= bits - 1)
 			{
+				uint32_t i = w*64 + __builtin_ctzll(bits);
+
 				if(pred(elements_[i]))
 				{
 					return &elements_[i];
@@ -146,29 +165,38 @@ public:
 	template<class FUNC>
 	void for_each(FUNC & func)
 	{
-		for(uint32_t i=0; i<SIZE; ++i)
+		for(uint32_t w=0; w<WORDS; ++w)
 		{
-			if(valid_[i])
+			// re-read the bitmap after every call, func may remove elements
+			for(uint64_t bits = occupied_[w]; bits; )
 			{
-				func(elements_[i]);
+				uint32_t bit = __builtin_ctzll(bits);
+				func(elements_[w*64 + bit]);
+				bits = occupied_[w] & (~uint64_t(1) << bit);
 			}
 		}
 	}
 
 	void clear()
 	{
-		for(uint32_t i=0; i<SIZE; ++i)
+		for(uint32_t w=0; w<WORDS; ++w)
 		{
-			if(valid_[i])
+			while(occupied_[w])
 			{
-				remove_(i);
+				remove_(w*64 + __builtin_ctzll(occupied_[w]));
 			}
 		}
 	}
 
 private:
-	bool valid_[SIZE];
-	char data[sizeof(T)*SIZE];
+	static const uint32_t NIL   = 0xffffffff;
+	static const uint32_t WORDS = (SIZE + 63) / 64;
+
+	uint64_t occupied_[WORDS];
+	uint32_t next_free_[SIZE];
+	uint32_t free_;
+	uint32_t count_;
+	char data[sizeof(T)*SIZE] __attribute__((aligned(__alignof__(T))));
 	T * elements_;
 
 	bool is_in_range_(T * element) const
@@ -179,17 +207,32 @@ private:
 			(element < (elements_ + SIZE)) );
 	}
 
-	uint32_t index_of_(T * element) const
+	bool is_valid_(uint32_t index) const
 	{
-		return (element - elements_);
+		return occupied_[index / 64] & (uint64_t(1) << (index % 64));
+	}
+
+	// called once the element at the head of the free list is constructed
+	T * commit_(T * element)
+	{
+		uint32_t index = index_of(element);
+
+		free_ = next_free_[index];
+		occupied_[index / 64] |= uint64_t(1) << (index % 64);
+		++count_;
+
+		return element;
 	}
 
 	void remove_(uint32_t index)
 	{
-		if(valid_[index])
+		if(is_valid_(index))
 		{
 			elements_[index].~T();
-			valid_[index] = false;
+			occupied_[index / 64] &= ~(uint64_t(1) << (index % 64));
+			next_free_[index] = free_;
+			free_ = index;
+			--count_;
 		}
 	}
 };
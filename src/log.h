@@ -0,0 +1,541 @@
+#pragma once
+
+#include <algorithm>
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+
+// Compile-time log levels. Every message below LINUX_EPOLL_LOG_LEVEL expands
+// to nothing, its arguments are not even evaluated.
+#define LINUX_EPOLL_LOG_LEVEL_TRACE   0
+#define LINUX_EPOLL_LOG_LEVEL_DEBUG   1
+#define LINUX_EPOLL_LOG_LEVEL_INFO    2
+#define LINUX_EPOLL_LOG_LEVEL_WARNING 3
+#define LINUX_EPOLL_LOG_LEVEL_ERROR   4
+#define LINUX_EPOLL_LOG_LEVEL_OFF     5
+
+#ifndef LINUX_EPOLL_LOG_LEVEL
+#define LINUX_EPOLL_LOG_LEVEL LINUX_EPOLL_LOG_LEVEL_WARNING
+#endif
+
+#define LINUX_EPOLL_LOG_DISABLED(...) do {} while(0)
+
+#if LINUX_EPOLL_LOG_LEVEL <= LINUX_EPOLL_LOG_LEVEL_TRACE
+#define LINUX_EPOLL_LOG_TRACE(...) \
+	::linux_epoll::Logger::instance().log(::linux_epoll::LogTrace, __VA_ARGS__)
+#else
+#define LINUX_EPOLL_LOG_TRACE LINUX_EPOLL_LOG_DISABLED
+#endif
+
+#if LINUX_EPOLL_LOG_LEVEL <= LINUX_EPOLL_LOG_LEVEL_DEBUG
+#define LINUX_EPOLL_LOG_DEBUG(...) \
+	::linux_epoll::Logger::instance().log(::linux_epoll::LogDebug, __VA_ARGS__)
+#else
+#define LINUX_EPOLL_LOG_DEBUG LINUX_EPOLL_LOG_DISABLED
+#endif
+
+#if LINUX_EPOLL_LOG_LEVEL <= LINUX_EPOLL_LOG_LEVEL_INFO
+#define LINUX_EPOLL_LOG_INFO(...) \
+	::linux_epoll::Logger::instance().log(::linux_epoll::LogInfo, __VA_ARGS__)
+#else
+#define LINUX_EPOLL_LOG_INFO LINUX_EPOLL_LOG_DISABLED
+#endif
+
+#if LINUX_EPOLL_LOG_LEVEL <= LINUX_EPOLL_LOG_LEVEL_WARNING
+#define LINUX_EPOLL_LOG_WARNING(...) \
+	::linux_epoll::Logger::instance().log(::linux_epoll::LogWarning, __VA_ARGS__)
+#else
+#define LINUX_EPOLL_LOG_WARNING LINUX_EPOLL_LOG_DISABLED
+#endif
+
+#if LINUX_EPOLL_LOG_LEVEL <= LINUX_EPOLL_LOG_LEVEL_ERROR
+#define LINUX_EPOLL_LOG_ERROR(...) \
+	::linux_epoll::Logger::instance().log(::linux_epoll::LogError, __VA_ARGS__)
+#else
+#define LINUX_EPOLL_LOG_ERROR LINUX_EPOLL_LOG_DISABLED
+#endif
+
+
+namespace linux_epoll
+{
+
+
+enum LogLevel
+{
+	LogTrace   = LINUX_EPOLL_LOG_LEVEL_TRACE,
+	LogDebug   = LINUX_EPOLL_LOG_LEVEL_DEBUG,
+	LogInfo    = LINUX_EPOLL_LOG_LEVEL_INFO,
+	LogWarning = LINUX_EPOLL_LOG_LEVEL_WARNING,
+	LogError   = LINUX_EPOLL_LOG_LEVEL_ERROR
+};
+
+
+// One argument of a log record, stored as raw bits plus its type so the
+// drain thread can format it later.
+struct LogArg
+{
+	enum Type
+	{
+		Signed,
+		Unsigned,
+		Double,
+		String,
+		Pointer
+	};
+
+	LogArg(int v)                : type(Signed)   { value.i = v; }
+	LogArg(long v)               : type(Signed)   { value.i = v; }
+	LogArg(long long v)          : type(Signed)   { value.i = v; }
+	LogArg(unsigned v)           : type(Unsigned) { value.u = v; }
+	LogArg(unsigned long v)      : type(Unsigned) { value.u = v; }
+	LogArg(unsigned long long v) : type(Unsigned) { value.u = v; }
+	LogArg(double v)             : type(Double)   { value.d = v; }
+	// the string is not copied, it has to be static like a literal or the
+	// result of strerror()
+	LogArg(char const* v)        : type(String)   { value.s = v; }
+	LogArg(void const* v)        : type(Pointer)  { value.p = v; }
+
+	union
+	{
+		long long           i;
+		unsigned long long  u;
+		double              d;
+		char const        * s;
+		void const        * p;
+	} value;
+	uint8_t type;
+};
+
+
+// Messages are copied as fixed size binary records (format string pointer,
+// timestamp and up to four arguments) into a bounded lock-free ring and
+// formatted by a background thread, so logging costs the loop neither stdio
+// nor a lock. Producers never wait: when the ring is full the record is
+// dropped and counted.
+//
+// The ring is Dmitry Vyukov's bounded queue, every cell carries a sequence
+// number telling whether it is free for the producer owning that position or
+// holds a record for the consumer.
+//
+// The drain thread sleeps on a futex while the ring is empty, the first
+// record pushed after it announced so wakes it up; an idle process sees no
+// wakeups from logging. Should the thread not start, records are written
+// synchronously by the thread logging them.
+class Logger
+{
+public:
+	static Logger & instance()
+	{
+		static Logger logger;
+		return logger;
+	}
+
+	// FILE the drain thread writes to, stderr by default
+	void set_output(FILE * output)
+	{
+		__atomic_store_n(&output_, output, __ATOMIC_RELEASE);
+	}
+
+	uint64_t dropped() const
+	{
+		return __atomic_load_n(&dropped_, __ATOMIC_RELAXED);
+	}
+
+	void log(LogLevel level, char const* format)
+	{
+		push_(level, format, NULL, 0);
+	}
+
+	void log(LogLevel level, char const* format, LogArg a0)
+	{
+		LogArg args[] = {a0};
+		push_(level, format, args, 1);
+	}
+
+	void log(LogLevel level, char const* format, LogArg a0, LogArg a1)
+	{
+		LogArg args[] = {a0, a1};
+		push_(level, format, args, 2);
+	}
+
+	void log(
+		LogLevel level,
+		char const* format,
+		LogArg a0,
+		LogArg a1,
+		LogArg a2)
+	{
+		LogArg args[] = {a0, a1, a2};
+		push_(level, format, args, 3);
+	}
+
+	void log(
+		LogLevel level,
+		char const* format,
+		LogArg a0,
+		LogArg a1,
+		LogArg a2,
+		LogArg a3)
+	{
+		LogArg args[] = {a0, a1, a2, a3};
+		push_(level, format, args, 4);
+	}
+
+private:
+	static const uint32_t CELLS = 4096;
+	static const uint32_t MAX_ARGS = 4;
+
+	struct Cell
+	{
+		uint32_t     sequence;
+		uint8_t      level;
+		uint8_t      arg_count;
+		uint64_t     time_ns;
+		char const * format;
+		LogArg       args[MAX_ARGS];
+	};
+
+	Cell        * cells_;
+	uint32_t      enqueue_pos_;
+	uint32_t      dequeue_pos_;
+	uint64_t      dropped_;
+	FILE        * output_;
+	bool          stopping_;
+	int           waiting_;
+	bool          threaded_;
+	pthread_t     thread_;
+
+	Logger()
+	: cells_(static_cast<Cell*>(operator new(sizeof(Cell) * CELLS)))
+	, enqueue_pos_(0)
+	, dequeue_pos_(0)
+	, dropped_(0)
+	, output_(stderr)
+	, stopping_(false)
+	, waiting_(0)
+	, threaded_(false)
+	{
+		for(uint32_t i=0; i<CELLS; ++i)
+		{
+			cells_[i].sequence = i;
+		}
+
+		int error = pthread_create(&thread_, NULL, &Logger::run_, this);
+		if(error != 0)
+		{
+			fprintf(
+				stderr,
+				"Logger thread not started, logging synchronously: %s\n",
+				strerror(error));
+			return;
+		}
+
+		threaded_ = true;
+	}
+
+	~Logger()
+	{
+		if(threaded_)
+		{
+			__atomic_store_n(&stopping_, true, __ATOMIC_SEQ_CST);
+			wake_();
+			pthread_join(thread_, NULL);
+		}
+		operator delete(cells_);
+	}
+
+	Logger(Logger const&);
+	Logger & operator=(Logger const&);
+
+	void push_(
+		LogLevel level,
+		char const* format,
+		LogArg const* args,
+		uint32_t arg_count)
+	{
+		if(not threaded_)
+		{
+			// raw like the ring's cells, LogArg has no default constructor
+			union
+			{
+				char     bytes[sizeof(Cell)];
+				uint64_t align;
+			} storage;
+			Cell & cell = *reinterpret_cast<Cell*>(storage.bytes);
+			fill_(cell, level, format, args, arg_count);
+
+			FILE * output = __atomic_load_n(&output_, __ATOMIC_ACQUIRE);
+			write_(output, cell);
+			fflush(output);
+			return;
+		}
+
+		uint32_t pos = __atomic_load_n(&enqueue_pos_, __ATOMIC_RELAXED);
+		Cell * cell;
+
+		for(;;)
+		{
+			cell = &cells_[pos & (CELLS - 1)];
+			int32_t diff = int32_t(
+				__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+
+			if(diff == 0)
+			{
+				if(__atomic_compare_exchange_n(
+					&enqueue_pos_, &pos, pos + 1,
+					true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				{
+					break;
+				}
+			}
+			else if(diff < 0)
+			{
+				__atomic_add_fetch(&dropped_, 1, __ATOMIC_RELAXED);
+				return;
+			}
+			else
+			{
+				pos = __atomic_load_n(&enqueue_pos_, __ATOMIC_RELAXED);
+			}
+		}
+
+		fill_(*cell, level, format, args, arg_count);
+		__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+		// pairs with the fence in run_drain_(), either the drain thread sees
+		// the record or this sees it waiting
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&waiting_, __ATOMIC_RELAXED) != 0)
+		{
+			wake_();
+		}
+	}
+
+	static void fill_(
+		Cell & cell,
+		LogLevel level,
+		char const* format,
+		LogArg const* args,
+		uint32_t arg_count)
+	{
+		timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		cell.level = level;
+		cell.arg_count = arg_count;
+		cell.time_ns = uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+		cell.format = format;
+		for(uint32_t i=0; i<arg_count; ++i)
+		{
+			cell.args[i] = args[i];
+		}
+	}
+
+	// only the producer clearing the flag makes the system call
+	void wake_()
+	{
+		if(__atomic_exchange_n(&waiting_, 0, __ATOMIC_SEQ_CST) != 0)
+		{
+			syscall(SYS_futex, &waiting_, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+		}
+	}
+
+	static void * run_(void * arg)
+	{
+		static_cast<Logger*>(arg)->run_drain_();
+		return NULL;
+	}
+
+	void run_drain_()
+	{
+		for(;;)
+		{
+			bool stopping = __atomic_load_n(&stopping_, __ATOMIC_ACQUIRE);
+
+			if(drain_() != 0)
+			{
+				continue;
+			}
+
+			if(stopping)
+			{
+				return;
+			}
+
+			// announces the wait before looking at the ring a last time, a
+			// record pushed in between then finds the flag set
+			__atomic_store_n(&waiting_, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+			if(drain_() != 0 or __atomic_load_n(&stopping_, __ATOMIC_ACQUIRE))
+			{
+				__atomic_store_n(&waiting_, 0, __ATOMIC_RELAXED);
+				continue;
+			}
+
+			// returns at once if a producer cleared the flag meanwhile
+			syscall(SYS_futex, &waiting_, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+		}
+	}
+
+	uint32_t drain_()
+	{
+		FILE * output = __atomic_load_n(&output_, __ATOMIC_ACQUIRE);
+		uint32_t count = 0;
+
+		for(;; ++count)
+		{
+			Cell & cell = cells_[dequeue_pos_ & (CELLS - 1)];
+
+			if(__atomic_load_n(&cell.sequence, __ATOMIC_ACQUIRE) != dequeue_pos_ + 1)
+			{
+				break;
+			}
+
+			write_(output, cell);
+
+			__atomic_store_n(&cell.sequence, dequeue_pos_ + CELLS, __ATOMIC_RELEASE);
+			++dequeue_pos_;
+		}
+
+		if(count != 0)
+		{
+			fflush(output);
+		}
+
+		return count;
+	}
+
+	void write_(FILE * output, Cell const& cell)
+	{
+		static char const* const names[] = {
+			"TRACE", "DEBUG", "INFO", "WARNING", "ERROR"};
+
+		char line[512];
+		int size = snprintf(
+			line,
+			sizeof(line),
+			"%llu.%06llu %s ",
+			(unsigned long long)(cell.time_ns / 1000000000ull),
+			(unsigned long long)(cell.time_ns % 1000000000ull / 1000),
+			names[cell.level]);
+
+		size += format_(cell, line + size, sizeof(line) - size - 1);
+		line[size++] = '\n';
+
+		fwrite(line, 1, size, output);
+	}
+
+	// printf over the stored arguments, every conversion is re-issued with
+	// the length modifier matching how the argument was stored
+	static int format_(Cell const& cell, char * out, int capacity)
+	{
+		char const* f = cell.format;
+		uint32_t arg = 0;
+		int size = 0;
+
+		while(*f != '\0' and size < capacity)
+		{
+			if(*f != '%')
+			{
+				out[size++] = *f++;
+				continue;
+			}
+
+			if(f[1] == '%')
+			{
+				out[size++] = '%';
+				f += 2;
+				continue;
+			}
+
+			char spec[32];
+			uint32_t length = 0;
+			spec[length++] = *f++;
+
+			while(*f != '\0' and strchr("diouxXeEfFgGaAcspn", *f) == NULL)
+			{
+				if(strchr("hlLqjzt", *f) == NULL and length < sizeof(spec) - 4)
+				{
+					spec[length++] = *f;
+				}
+				++f;
+			}
+
+			if(*f == '\0' or arg == cell.arg_count)
+			{
+				break;
+			}
+
+			LogArg const& a = cell.args[arg++];
+			char conversion = conversion_(a, *f++);
+			int written = 0;
+
+			if(a.type == LogArg::Signed or a.type == LogArg::Unsigned)
+			{
+				spec[length++] = 'l';
+				spec[length++] = 'l';
+			}
+			spec[length++] = conversion;
+			spec[length] = '\0';
+
+			switch(a.type)
+			{
+			case LogArg::Signed:
+				written = snprintf(out + size, capacity - size, spec, a.value.i);
+				break;
+			case LogArg::Unsigned:
+				written = snprintf(out + size, capacity - size, spec, a.value.u);
+				break;
+			case LogArg::Double:
+				written = snprintf(out + size, capacity - size, spec, a.value.d);
+				break;
+			case LogArg::String:
+				written = snprintf(out + size, capacity - size, spec, a.value.s);
+				break;
+			case LogArg::Pointer:
+				written = snprintf(out + size, capacity - size, spec, a.value.p);
+				break;
+			}
+
+			if(written < 0)
+			{
+				break;
+			}
+
+			size = std::min(size + written, capacity - 1);
+		}
+
+		return std::min(size, capacity);
+	}
+
+	// a conversion that does not fit the stored argument is replaced
+	// instead of handing snprintf an argument of the wrong type
+	static char conversion_(LogArg const& arg, char conversion)
+	{
+		switch(arg.type)
+		{
+		case LogArg::Signed:
+			return strchr("diouxX", conversion) ? conversion : 'd';
+		case LogArg::Unsigned:
+			return strchr("diouxX", conversion) ? conversion : 'u';
+		case LogArg::Double:
+			return strchr("eEfFgGaA", conversion) ? conversion : 'g';
+		case LogArg::String:
+			return 's';
+		default:
+			return 'p';
+		}
+	}
+};
+
+
+} //namespace linux_epoll
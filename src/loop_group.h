@@ -0,0 +1,175 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <tr1/functional>
+#include <tr1/memory>
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+
+namespace linux_epoll
+{
+
+
+/* EXAMPLE:
+typedef Epoll<1024> Loop_t;
+
+std::tr1::shared_ptr<void> setup(Loop_t & loop, uint32_t index)
+{
+	return std::tr1::shared_ptr<Server>(new Server(loop, port));
+}
+
+LoopGroup<Loop_t> group(4, setup);
+group.start();
+...
+group.stop();
+group.join();*/
+
+
+// Runs one LOOP per thread. setup is called on the loop's own thread before
+// it starts polling, so everything it creates is owned by that thread; the
+// object it returns is kept alive until the loop has stopped. Listeners that
+// should share a port across the group are created with reuse_port set.
+template<class LOOP>
+class LoopGroup
+{
+public:
+	typedef std::tr1::function<
+		std::tr1::shared_ptr<void>(LOOP &, uint32_t)> Setup_t;
+
+	LoopGroup(uint32_t thread_count, Setup_t setup, bool pin_threads = false)
+	: setup_(setup)
+	, pin_threads_(pin_threads)
+	, stopping_(false)
+	, workers_(thread_count)
+	{
+		for(uint32_t i=0; i<workers_.size(); ++i)
+		{
+			workers_[i].group = this;
+			workers_[i].index = i;
+			workers_[i].loop = new LOOP();
+			workers_[i].started = false;
+		}
+	}
+
+	~LoopGroup()
+	{
+		stop();
+		join();
+
+		for(uint32_t i=0; i<workers_.size(); ++i)
+		{
+			delete workers_[i].loop;
+		}
+	}
+
+	void start()
+	{
+		__atomic_store_n(&stopping_, false, __ATOMIC_RELEASE);
+
+		for(uint32_t i=0; i<workers_.size(); ++i)
+		{
+			if(workers_[i].started)
+			{
+				continue;
+			}
+
+			int error = pthread_create(
+				&workers_[i].thread,
+				NULL,
+				&LoopGroup::run_,
+				&workers_[i]);
+
+			if(error != 0)
+			{
+				throw std::runtime_error(
+					std::string("starting loop thread failed with: ") +
+					strerror(error));
+			}
+
+			workers_[i].started = true;
+		}
+	}
+
+	// asks all loops to return after their current iteration, does not block
+	void stop()
+	{
+		__atomic_store_n(&stopping_, true, __ATOMIC_RELEASE);
+
+		for(uint32_t i=0; i<workers_.size(); ++i)
+		{
+			workers_[i].loop->wakeup();
+		}
+	}
+
+	void join()
+	{
+		for(uint32_t i=0; i<workers_.size(); ++i)
+		{
+			if(workers_[i].started)
+			{
+				pthread_join(workers_[i].thread, NULL);
+				workers_[i].started = false;
+			}
+		}
+	}
+
+	uint32_t size() const
+	{
+		return workers_.size();
+	}
+
+	LOOP & loop(uint32_t index)
+	{
+		return *workers_[index].loop;
+	}
+
+private:
+	struct Worker
+	{
+		LoopGroup * group;
+		uint32_t    index;
+		LOOP      * loop;
+		pthread_t   thread;
+		bool        started;
+	};
+
+	Setup_t             setup_;
+	bool                pin_threads_;
+	bool                stopping_;
+	std::vector<Worker> workers_;
+
+	static void * run_(void * arg)
+	{
+		Worker * worker = static_cast<Worker*>(arg);
+		worker->group->run_worker_(*worker);
+		return NULL;
+	}
+
+	void run_worker_(Worker & worker)
+	{
+		if(pin_threads_)
+		{
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(worker.index % CPU_SETSIZE, &cpus);
+			pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		}
+
+		std::tr1::shared_ptr<void> state = setup_(*worker.loop, worker.index);
+
+		while(not __atomic_load_n(&stopping_, __ATOMIC_ACQUIRE))
+		{
+			worker.loop->wait();
+			worker.loop->process();
+		}
+	}
+};
+
+
+} //namespace linux_epoll
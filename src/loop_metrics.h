@@ -0,0 +1,188 @@
+#pragma once
+
+#include "linux_epoll/histogram.h"
+
+#include <stdint.h>
+#include <time.h>
+
+
+namespace linux_epoll
+{
+
+
+// Copy of a loop's metrics taken by LoopMetrics::snapshot(), times in ns.
+struct LoopMetricsSnapshot
+{
+	uint64_t          wakeups;
+	uint64_t          wait_ns;
+	uint64_t          process_ns;
+	uint32_t          pollables;
+	uint32_t          peak_pollables;
+	HistogramSnapshot wait;
+	HistogramSnapshot process;
+	HistogramSnapshot events_per_wakeup;
+	HistogramSnapshot dispatch;
+	HistogramSnapshot timer_lateness;
+
+	// share of the time spent in process() instead of being blocked in the
+	// poller, close to 1 means the loop is saturated
+	double utilisation() const
+	{
+		uint64_t total = wait_ns + process_ns;
+		return total == 0 ? 0.0 : double(process_ns) / total;
+	}
+};
+
+
+// Statistics Epoll collects when LINUX_EPOLL_METRICS is defined: time blocked
+// in the poller versus time spent in process(), events per wakeup, time spent
+// in each handler, how late timers fire relative to the tick they were due in
+// and how many handlers are registered.
+//
+// Only the loop's thread records, snapshot() may be called from any thread.
+class LoopMetrics
+{
+public:
+	LoopMetrics()
+	: wakeups_(0)
+	, wait_ns_(0)
+	, process_ns_(0)
+	, pollables_(0)
+	, peak_pollables_(0)
+	, wait_start_(0)
+	, process_start_(0)
+	{}
+
+	void wait_begin()
+	{
+		wait_start_ = clock_();
+	}
+
+	void wait_end(int event_count)
+	{
+		uint64_t elapsed = clock_() - wait_start_;
+		add_(wait_ns_, elapsed);
+		add_(wakeups_, 1);
+		wait_.record(elapsed);
+		events_per_wakeup_.record(event_count);
+	}
+
+	void process_begin()
+	{
+		process_start_ = clock_();
+	}
+
+	void process_end()
+	{
+		uint64_t elapsed = clock_() - process_start_;
+		add_(process_ns_, elapsed);
+		process_.record(elapsed);
+	}
+
+	uint64_t dispatch_begin()
+	{
+		return clock_();
+	}
+
+	void dispatch_end(uint64_t start)
+	{
+		dispatch_.record(clock_() - start);
+	}
+
+	void timer_fired(uint64_t deadline_ns)
+	{
+		uint64_t fired = clock_();
+		timer_lateness_.record(fired > deadline_ns ? fired - deadline_ns : 0);
+	}
+
+	void occupancy(uint32_t pollables)
+	{
+		__atomic_store_n(&pollables_, pollables, __ATOMIC_RELAXED);
+
+		if(pollables > peak_pollables_)
+		{
+			__atomic_store_n(&peak_pollables_, pollables, __ATOMIC_RELAXED);
+		}
+	}
+
+	LoopMetricsSnapshot snapshot() const
+	{
+		LoopMetricsSnapshot result;
+		result.wakeups = __atomic_load_n(&wakeups_, __ATOMIC_RELAXED);
+		result.wait_ns = __atomic_load_n(&wait_ns_, __ATOMIC_RELAXED);
+		result.process_ns = __atomic_load_n(&process_ns_, __ATOMIC_RELAXED);
+		result.pollables = __atomic_load_n(&pollables_, __ATOMIC_RELAXED);
+		result.peak_pollables = __atomic_load_n(&peak_pollables_, __ATOMIC_RELAXED);
+		result.wait = wait_.snapshot();
+		result.process = process_.snapshot();
+		result.events_per_wakeup = events_per_wakeup_.snapshot();
+		result.dispatch = dispatch_.snapshot();
+		result.timer_lateness = timer_lateness_.snapshot();
+		return result;
+	}
+
+private:
+	uint64_t  wakeups_;
+	uint64_t  wait_ns_;
+	uint64_t  process_ns_;
+	uint32_t  pollables_;
+	uint32_t  peak_pollables_;
+	uint64_t  wait_start_;
+	uint64_t  process_start_;
+	Histogram wait_;
+	Histogram process_;
+	Histogram events_per_wakeup_;
+	Histogram dispatch_;
+	Histogram timer_lateness_;
+
+	// same clock as the timeouts, so lateness compares like with like
+	static uint64_t clock_()
+	{
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return uint64_t(t.tv_sec) * 1000000000ull + t.tv_nsec;
+	}
+
+	static void add_(uint64_t & counter, uint64_t value)
+	{
+		__atomic_store_n(
+			&counter,
+			__atomic_load_n(&counter, __ATOMIC_RELAXED) + value,
+			__ATOMIC_RELAXED);
+	}
+};
+
+
+// Stand-in for LoopMetrics when metrics are compiled out, every hook is empty.
+class NoMetrics
+{
+public:
+	void wait_begin()
+	{}
+
+	void wait_end(int)
+	{}
+
+	void process_begin()
+	{}
+
+	void process_end()
+	{}
+
+	uint64_t dispatch_begin()
+	{
+		return 0;
+	}
+
+	void dispatch_end(uint64_t)
+	{}
+
+	void timer_fired(uint64_t)
+	{}
+
+	void occupancy(uint32_t)
+	{}
+};
+
+
+} //namespace linux_epoll
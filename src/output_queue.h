@@ -0,0 +1,342 @@
+#pragma once
+
+#include "linux_epoll/delegate.h"
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+namespace linux_epoll
+{
+
+
+// Data a TcpSocket could not hand to the kernel yet. Small writes are merged
+// into the last chunk, so a flush needs only a few iovecs.
+//
+// Ranges of files take their place in the queue like data but are sent with
+// sendfile(2): fill() stops in front of them and front_file() hands them out
+// once all data queued before has been sent.
+//
+// Borrowed buffers are queued by pointer instead of being copied, for sends
+// with MSG_ZEROCOPY. fill() never mixes them with copied data, since the
+// kernel may still read a zero-copy buffer after the send returned while the
+// memory of a consumed chunk is reused at once.
+//
+// Descriptors passed over an AF_UNIX socket travel with the first byte of the
+// data they were queued with, so that data starts a send of its own. In
+// message mode, for SOCK_SEQPACKET, every push is one message that is
+// neither merged with others nor sent together with them, an empty push is
+// an empty message. In stream mode empty pushes are dropped.
+class OutputQueue
+{
+public:
+	struct FileRange
+	{
+		int      fd;
+		off_t    offset;
+		uint64_t length;
+	};
+
+	OutputQueue()
+	: size_(0)
+	, offset_(0)
+	, messages_(false)
+	{}
+
+	~OutputQueue()
+	{
+		clear();
+	}
+
+	// an empty message still has to be sent, so this is not size() == 0
+	bool is_empty() const
+	{
+		return chunks_.empty();
+	}
+
+	uint64_t size() const
+	{
+		return size_;
+	}
+
+	void set_message_mode(bool messages)
+	{
+		messages_ = messages;
+	}
+
+	void push(uint8_t const* data, uint32_t size)
+	{
+		if(size == 0 and not messages_)
+		{
+			return;
+		}
+
+		if(not messages_ and
+		   not chunks_.empty() and
+		   is_data_(chunks_.back()) and
+		   chunks_.back().data.size() + size <= MERGE_LIMIT)
+		{
+			chunks_.back().data.insert(chunks_.back().data.end(), data, data + size);
+		}
+		else
+		{
+			chunks_.push_back(Chunk());
+			chunks_.back().data.assign(data, data + size);
+		}
+
+		size_ += size;
+	}
+
+	// release is called once the range was sent or the queue is cleared
+	void push_file(
+		int fd,
+		off_t offset,
+		uint64_t length,
+		Delegate<void()> const& release)
+	{
+		chunks_.push_back(Chunk());
+		chunks_.back().file.fd = fd;
+		chunks_.back().file.offset = offset;
+		chunks_.back().file.length = length;
+		chunks_.back().release = release;
+
+		size_ += length;
+	}
+
+	// queues data with duplicates of fds, false if they can not be duplicated
+	bool push_fds(int const* fds, uint32_t count, uint8_t const* data, uint32_t size)
+	{
+		std::vector<int> duplicates;
+
+		for(uint32_t i=0; i<count; ++i)
+		{
+			int fd = ::fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+			if(fd == -1)
+			{
+				close_all_(duplicates);
+				return false;
+			}
+			duplicates.push_back(fd);
+		}
+
+		chunks_.push_back(Chunk());
+		chunks_.back().data.assign(data, data + size);
+		chunks_.back().fds.swap(duplicates);
+
+		size_ += size;
+		return true;
+	}
+
+	// the caller keeps data alive and unmodified until it was consumed
+	void push_borrowed(uint8_t const* data, uint32_t size)
+	{
+		chunks_.push_back(Chunk());
+		chunks_.back().borrowed = data;
+		chunks_.back().borrowed_size = size;
+
+		size_ += size;
+	}
+
+	// returns the number of iovecs filled, at most max_count; stops at the
+	// first file range and where copied and borrowed data meet
+	int fill(struct iovec * iov, int max_count) const
+	{
+		int count = 0;
+		uint32_t offset = offset_;
+		bool borrowed = front_borrowed();
+
+		if(messages_)
+		{
+			max_count = std::min(max_count, 1);
+		}
+
+		for(std::deque<Chunk>::const_iterator it = chunks_.begin();
+			it != chunks_.end() and it->file.fd == -1 and
+			(it->borrowed != NULL) == borrowed and count < max_count;
+			++it)
+		{
+			if(it != chunks_.begin() and not it->fds.empty())
+			{
+				break;
+			}
+
+			iov[count].iov_base = const_cast<uint8_t*>(start_(*it) + offset);
+			iov[count].iov_len = length_(*it) - offset;
+			offset = 0;
+			++count;
+		}
+
+		return count;
+	}
+
+	// true if the data fill() hands out next is borrowed
+	bool front_borrowed() const
+	{
+		return not chunks_.empty() and chunks_.front().borrowed != NULL;
+	}
+
+	// the descriptors to pass with the next send, NULL if there are none
+	std::vector<int> const* front_fds() const
+	{
+		if(chunks_.empty() or chunks_.front().fds.empty())
+		{
+			return NULL;
+		}
+
+		return &chunks_.front().fds;
+	}
+
+	// closes the duplicates once a send carried them to the peer
+	void sent_front_fds()
+	{
+		close_all_(chunks_.front().fds);
+	}
+
+	// the file range to send next, NULL if data comes first
+	FileRange * front_file()
+	{
+		if(chunks_.empty() or chunks_.front().file.fd == -1)
+		{
+			return NULL;
+		}
+
+		return &chunks_.front().file;
+	}
+
+	// count 0 consumes an empty message at the front
+	void consume(uint64_t count)
+	{
+		size_ -= count;
+
+		if(count == 0 and
+		   not chunks_.empty() and
+		   chunks_.front().file.fd == -1 and
+		   length_(chunks_.front()) == 0)
+		{
+			pop_();
+			return;
+		}
+
+		while(count != 0)
+		{
+			Chunk & front = chunks_.front();
+
+			if(front.file.fd != -1)
+			{
+				uint64_t sent = std::min(count, front.file.length);
+				front.file.offset += sent;
+				front.file.length -= sent;
+				count -= sent;
+
+				if(front.file.length == 0)
+				{
+					pop_();
+				}
+				continue;
+			}
+
+			uint32_t left = length_(front) - offset_;
+
+			if(count < left)
+			{
+				offset_ += count;
+				return;
+			}
+
+			count -= left;
+			offset_ = 0;
+			pop_();
+		}
+	}
+
+	void clear()
+	{
+		while(not chunks_.empty())
+		{
+			pop_();
+		}
+
+		size_ = 0;
+		offset_ = 0;
+	}
+
+private:
+	static const uint32_t MERGE_LIMIT = 16 * 1024;
+
+	struct Chunk
+	{
+		Chunk()
+		: borrowed(NULL)
+		, borrowed_size(0)
+		{
+			file.fd = -1;
+			file.offset = 0;
+			file.length = 0;
+		}
+
+		std::vector<uint8_t> data;
+		std::vector<int>     fds;
+		uint8_t const      * borrowed;
+		uint32_t             borrowed_size;
+		FileRange            file;
+		Delegate<void()>     release;
+	};
+
+	std::deque<Chunk> chunks_;
+	uint64_t          size_;
+	uint32_t          offset_;
+	bool              messages_;
+
+	static bool is_data_(Chunk const& chunk)
+	{
+		return chunk.file.fd == -1 and chunk.borrowed == NULL;
+	}
+
+	static uint8_t const* start_(Chunk const& chunk)
+	{
+		if(chunk.borrowed != NULL)
+		{
+			return chunk.borrowed;
+		}
+		return chunk.data.empty() ? NULL : &chunk.data[0];
+	}
+
+	static uint32_t length_(Chunk const& chunk)
+	{
+		return chunk.borrowed != NULL ? chunk.borrowed_size : chunk.data.size();
+	}
+
+	static void close_all_(std::vector<int> & fds)
+	{
+		for(uint32_t i=0; i<fds.size(); ++i)
+		{
+			::close(fds[i]);
+		}
+		fds.clear();
+	}
+
+	void pop_()
+	{
+		close_all_(chunks_.front().fds);
+
+		Delegate<void()> release(chunks_.front().release);
+		chunks_.pop_front();
+
+		if(release)
+		{
+			release();
+		}
+	}
+};
+
+
+} //namespace linux_epoll
@@ -1,5 +1,6 @@
 #pragma once
 #include <memory>
+#include <stdint.h>
 
 namespace linux_epoll
 {
@@ -80,4 +81,171 @@ private:
 };
 
 
+//----------------------------------------------------------------------------//
+
+
+// Fills the unused entries of a StaticPollable handler list.
+struct NoHandler
+{
+	void added()
+	{}
+
+	void removed()
+	{}
+
+	void process_events(int)
+	{}
+
+	int get_fd() const
+	{
+		return -1;
+	}
+};
+
+
+template<
+	class T,
+	class H0, class H1, class H2, class H3,
+	class H4, class H5, class H6, class H7>
+struct HandlerIndex
+{
+	enum
+	{
+		value = 1 + HandlerIndex<
+			T, H1, H2, H3, H4, H5, H6, H7, NoHandler>::value
+	};
+};
+
+template<
+	class T,
+	class H1, class H2, class H3,
+	class H4, class H5, class H6, class H7>
+struct HandlerIndex<T, T, H1, H2, H3, H4, H5, H6, H7>
+{
+	enum { value = 0 };
+};
+
+// left undefined: T is not part of the handler list
+template<class T>
+struct HandlerIndex<
+	T,
+	NoHandler, NoHandler, NoHandler, NoHandler,
+	NoHandler, NoHandler, NoHandler, NoHandler>;
+
+
+// Drop-in replacement for Pollable when every handler type that will be added
+// to an Epoll is known at compile time, e.g.
+//   Epoll<64, StaticPollable<Listener_t, Connection_t> >
+// Instead of a vtable it stores the object pointer and the index of its type
+// in the handler list, and dispatches through a switch over direct calls,
+// which the compiler can inline.
+template<
+	class H0,
+	class H1 = NoHandler, class H2 = NoHandler, class H3 = NoHandler,
+	class H4 = NoHandler, class H5 = NoHandler, class H6 = NoHandler,
+	class H7 = NoHandler>
+class StaticPollable
+{
+public:
+	template<class T>
+	StaticPollable(T & t)
+	: object_(&t)
+	, tag_(HandlerIndex<T, H0, H1, H2, H3, H4, H5, H6, H7>::value)
+	{}
+
+	void added()
+	{
+		Added op;
+		visit_(op);
+	}
+
+	void removed()
+	{
+		Removed op;
+		visit_(op);
+	}
+
+	void process_events(int event_mask)
+	{
+		ProcessEvents op(event_mask);
+		visit_(op);
+	}
+
+	int get_fd() const
+	{
+		GetFd op;
+		visit_(op);
+		return op.fd;
+	}
+
+private:
+	void    * object_;
+	uint8_t   tag_;
+
+	struct Added
+	{
+		template<class T>
+		void operator()(T * t)
+		{
+			t->added();
+		}
+	};
+
+	struct Removed
+	{
+		template<class T>
+		void operator()(T * t)
+		{
+			t->removed();
+		}
+	};
+
+	struct ProcessEvents
+	{
+		int event_mask;
+
+		ProcessEvents(int mask)
+		: event_mask(mask)
+		{}
+
+		template<class T>
+		void operator()(T * t)
+		{
+			t->process_events(event_mask);
+		}
+	};
+
+	struct GetFd
+	{
+		int fd;
+
+		GetFd()
+		: fd(-1)
+		{}
+
+		template<class T>
+		void operator()(T * t)
+		{
+			fd = t->get_fd();
+		}
+	};
+
+	template<class OP>
+	void visit_(OP & op) const
+	{
+		switch(tag_)
+		{
+			case 0: op(static_cast<H0*>(object_)); break;
+			case 1: op(static_cast<H1*>(object_)); break;
+			case 2: op(static_cast<H2*>(object_)); break;
+			case 3: op(static_cast<H3*>(object_)); break;
+			case 4: op(static_cast<H4*>(object_)); break;
+			case 5: op(static_cast<H5*>(object_)); break;
+			case 6: op(static_cast<H6*>(object_)); break;
+			case 7: op(static_cast<H7*>(object_)); break;
+		}
+	}
+};
+
+
 } //namespace linux_epoll
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+
+namespace linux_epoll
+{
+
+
+// Receive buffer of a TcpSocket. head_ and tail_ run freely and are masked on
+// access, so the free space is at most two iovecs and a single readv can fill
+// the whole ring no matter where the last read stopped. Once everything was
+// consumed both go back to the start, so the next read is not split at the
+// wrap.
+class ReadRing
+{
+public:
+	ReadRing()
+	: mask_(0)
+	, head_(0)
+	, tail_(0)
+	{}
+
+	// capacity is rounded up to a power of two
+	void reset(uint32_t capacity)
+	{
+		uint32_t size = 1;
+		while(size < capacity)
+		{
+			size <<= 1;
+		}
+
+		data_.assign(size, 0);
+		mask_ = size - 1;
+		head_ = 0;
+		tail_ = 0;
+	}
+
+	uint32_t capacity() const
+	{
+		return data_.size();
+	}
+
+	uint32_t size() const
+	{
+		return tail_ - head_;
+	}
+
+	uint32_t free_space() const
+	{
+		return capacity() - size();
+	}
+
+	// describes the free space in at most two iovecs, returns their number
+	int fill(struct iovec * iov)
+	{
+		uint32_t free = free_space();
+		uint32_t begin = tail_ & mask_;
+		uint32_t first = std::min(free, capacity() - begin);
+
+		iov[0].iov_base = &data_[begin];
+		iov[0].iov_len = first;
+
+		if(first == free)
+		{
+			return 1;
+		}
+
+		iov[1].iov_base = &data_[0];
+		iov[1].iov_len = free - first;
+		return 2;
+	}
+
+	void produce(uint32_t count)
+	{
+		tail_ += count;
+	}
+
+	// returns the size of the contiguous data at the head, 0 if empty
+	uint32_t span(uint8_t const*& data) const
+	{
+		uint32_t begin = head_ & mask_;
+		data = &data_[begin];
+		return std::min(size(), capacity() - begin);
+	}
+
+	void consume(uint32_t count)
+	{
+		head_ += count;
+
+		if(head_ == tail_)
+		{
+			head_ = 0;
+			tail_ = 0;
+		}
+	}
+
+private:
+	std::vector<uint8_t> data_;
+	uint32_t             mask_;
+	uint32_t             head_;
+	uint32_t             tail_;
+};
+
+
+} //namespace linux_epoll
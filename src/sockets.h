@@ -1,14 +1,24 @@
 #pragma once
 #include "linux_epoll/util.h"
+#include "linux_epoll/log.h"
 #include "linux_epoll/list.h"
+#include "linux_epoll/output_queue.h"
+#include "linux_epoll/read_ring.h"
+#include "linux_epoll/buffer_pool.h"
+#include "linux_epoll/delegate.h"
+#include "linux_epoll/file_cache.h"
 
 #include <tr1/functional>
 #include <algorithm>
 #include <string>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <utility>
 #include <stdexcept>
 
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
@@ -19,13 +29,38 @@
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
 
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <linux/errqueue.h>
+
+// not known to older C library headers
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
 
 
-#include <iostream>
-
 
 namespace linux_epoll
 {
@@ -40,23 +75,92 @@ struct LocalEndpoint
 	void connected() = 0;
 	void process_read_data(uint8_t const* data, uint32_t size) = 0;
 	void disconnected() = 0;
-	void set_write_function(std::tr1::function<void(uint8_t const*, uint32_t)> write_)
+	void set_write_function(Delegate<void(uint8_t const*, uint32_t)> const& write_)
 	{
 		write = write_;
 	}
 
-	std::tr1::function<void(uint8_t const*, uint32_t)> write;
+	Delegate<void(uint8_t const*, uint32_t)> write;
+
+	// optional, receives a function that queues length bytes of the file at
+	// path from offset to be sent with sendfile(2), after everything written
+	// before; length may be WHOLE_FILE. It returns false if the file can not
+	// be opened or is shorter than the range.
+	void set_send_file_function(SendFileFunction_t const& send_file_)
+	{
+		send_file = send_file_;
+	}
+
+	SendFileFunction_t send_file;
+
+	// optional, receives a function that sends size bytes of data without
+	// copying them once zero copy is enabled on the TcpSocket and size
+	// reaches its threshold. data has to stay unmodified until release is
+	// called, which happens once the kernel no longer reads it.
+	void set_zero_copy_write_function(ZeroCopyWriteFunction_t const& write_zero_copy_)
+	{
+		write_zero_copy = write_zero_copy_;
+	}
+
+	ZeroCopyWriteFunction_t write_zero_copy;
+
+	// optional, for AF_UNIX sockets: receives a function that sends size
+	// bytes of data with duplicates of count descriptors attached, the caller
+	// keeps its own. size has to be at least 1.
+	void set_send_fds_function(SendFdsFunction_t const& send_fds_)
+	{
+		send_fds = send_fds_;
+	}
+
+	SendFdsFunction_t send_fds;
+
+	// optional, for AF_UNIX sockets: called with the descriptors the peer
+	// passed, before the data they came with; the endpoint owns them
+	void process_received_fds(int const* fds, uint32_t count);
+
+	// optional, called when the data queued by write crosses the high
+	// watermark of its TcpSocket and once it has drained below the low one
+	void output_high_watermark();
+	void output_low_watermark();
+
+	// optional, makes the TcpSocket read into a ring of its own of this size
+	// instead of get_buffer(), process_read_data then receives spans of it
+	static const uint32_t READ_RING_SIZE = 256 * 1024;
+
+	// optional, makes the TcpSocket borrow a slab of the loop's BufferPool
+	// while it reads instead of using get_buffer(). process_read_data then
+	// returns how many bytes it consumed, the rest is kept and handed over
+	// again with the next data; the slab goes back once nothing is left.
+	static const bool READ_BUFFER_POOL = true;
+	uint32_t process_read_data(uint8_t const* data, uint32_t size);
 };*/
 
 
-// void register_timeout(
+// TimeoutHandle register_timeout(
 // 		DurationMs duration,
-// 		std::tr1::function<void()> callback,
-// 		T const* dependencies)
+// 		Delegate<void()> const& callback,
+// 		T const* dependencies,
+// 		DurationNs slack = DurationNs(0))
+// bool cancel_timeout(TimeoutHandle const& handle)
+// bool rearm_timeout(TimeoutHandle const& handle, DurationMs duration)
 // void remove_timeouts(T const* dependency)
 // bool add(T & t, int event_mask = EPOLLIN|EPOLLHUP|EPOLLET)
 // void remove(T & t)
+// void schedule(T & t, int event_mask)
 // bool is_full() const
+// FileCache & file_cache()
+// BufferPool & buffer_pool()
+
+
+
+// Connect deadlines and retries do not need to fire on the millisecond, an
+// eighth of the interval late is fine and lets the loop batch them with other
+// timers.
+inline
+DurationNs retry_slack(DurationMs interval)
+{
+	return DurationMs(interval.value / 8);
+}
 
 
 
@@ -74,9 +178,9 @@ struct SystemFunctions
 			return result_ != -1;
 		}
 
-		char const* error_description const
+		char const* error_description() const
 		{
-			return strerr(error_);
+			return strerror(error_);
 		}
 
 		int value() const
@@ -89,8 +193,8 @@ struct SystemFunctions
 			return error_;
 		}
 	private:
-		int error_;
 		int result_;
+		int error_;
 	};
 
 
@@ -124,12 +228,82 @@ struct SystemFunctions
 		return ::write(fd, buf, count);
 	}
 
+	inline
+	Result readv_(int fd, const struct iovec *iov, int iovcnt)
+	{
+		return ::readv(fd, iov, iovcnt);
+	}
+
+	inline
+	Result writev_(int fd, const struct iovec *iov, int iovcnt)
+	{
+		return ::writev(fd, iov, iovcnt);
+	}
+
+	inline
+	Result sendfile_(int out_fd, int in_fd, off_t * offset, size_t count)
+	{
+		return ::sendfile(out_fd, in_fd, offset, count);
+	}
+
+	inline
+	Result sendmsg_(int fd, const struct msghdr *msg, int flags)
+	{
+		return ::sendmsg(fd, msg, flags);
+	}
+
+	inline
+	Result recvmsg_(int fd, struct msghdr *msg, int flags)
+	{
+		return ::recvmsg(fd, msg, flags);
+	}
+
+	inline
+	Result sendmmsg_(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)
+	{
+		return ::sendmmsg(fd, msgs, vlen, flags);
+	}
+
+	inline
+	Result recvmmsg_(
+		int fd,
+		struct mmsghdr *msgs,
+		unsigned int vlen,
+		int flags,
+		struct timespec *timeout)
+	{
+		return ::recvmmsg(fd, msgs, vlen, flags, timeout);
+	}
+
+	inline
+	Result unlink_(char const* path)
+	{
+		return ::unlink(path);
+	}
+
+	inline
+	Result fcntl_(int fd, int cmd, int arg)
+	{
+		return ::fcntl(fd, cmd, arg);
+	}
+
 	inline
 	Result connect_(int fd, const sockaddr *addr, socklen_t addrlen)
 	{
 		return connect(fd, addr, addrlen);
 	}
 
+	inline
+	Result getsockopt_(
+		int fd,
+		int level,
+		int optname,
+		void *optval,
+		socklen_t *optlen)
+	{
+		return getsockopt(fd, level, optname, optval, optlen);
+	}
+
 	inline
 	Result setsockopt_(
 		int fd,
@@ -159,6 +333,12 @@ struct SystemFunctions
 		return accept(fd, addr, addrlen);
 	}
 
+	inline
+	Result accept4_(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+	{
+		return accept4(fd, addr, addrlen, flags);
+	}
+
 	inline
 	char * strerror_()
 	{
@@ -168,27 +348,398 @@ struct SystemFunctions
 
 
 
+// Defines NAME<T>::value, true if T has a member function MEMBER whose type
+// is the pointer given last, spelled with U for T: void (U::*)(int).
+#define LINUX_EPOLL_HAS_MEMBER(NAME, MEMBER, ...)                          \
+template<class T>                                                          \
+struct NAME                                                                \
+{                                                                          \
+	typedef char Yes;                                                      \
+	typedef long No;                                                       \
+                                                                           \
+	template<class U, __VA_ARGS__>                                         \
+	struct Check;                                                          \
+                                                                           \
+	template<class U>                                                      \
+	static Yes test(Check<U, &U::MEMBER> *);                               \
+                                                                           \
+	template<class U>                                                      \
+	static No test(...);                                                   \
+                                                                           \
+	enum { value = sizeof(test<T>(0)) == sizeof(Yes) };                    \
+}
+
+
+// Detects whether an endpoint implements the optional watermark callbacks.
+LINUX_EPOLL_HAS_MEMBER(
+	HasWatermarkCallbacks,
+	output_high_watermark,
+	void (U::*)());
+
+
+template<class T, bool = HasWatermarkCallbacks<T>::value>
+struct WatermarkCallbacks
+{
+	static void high(T *)
+	{}
+
+	static void low(T *)
+	{}
+};
+
+
+template<class T>
+struct WatermarkCallbacks<T, true>
+{
+	static void high(T * t)
+	{
+		t->output_high_watermark();
+	}
+
+	static void low(T * t)
+	{
+		t->output_low_watermark();
+	}
+};
+
+
+typedef Delegate<bool(std::string const&, uint64_t, uint64_t)> SendFileFunction_t;
+
+
+// Detects whether an endpoint wants to send files.
+LINUX_EPOLL_HAS_MEMBER(
+	HasSendFileFunction,
+	set_send_file_function,
+	void (U::*)(SendFileFunction_t const&));
+
+
+template<class T, bool = HasSendFileFunction<T>::value>
+struct SendFileFunction
+{
+	static void set(T *, SendFileFunction_t const&)
+	{}
+};
+
+
+template<class T>
+struct SendFileFunction<T, true>
+{
+	static void set(T * t, SendFileFunction_t const& send_file)
+	{
+		t->set_send_file_function(send_file);
+	}
+};
+
+
+typedef Delegate<void(uint8_t const*, uint32_t, Delegate<void()> const&)>
+	ZeroCopyWriteFunction_t;
+
+
+// Detects whether an endpoint wants to send without copying.
+LINUX_EPOLL_HAS_MEMBER(
+	HasZeroCopyWriteFunction,
+	set_zero_copy_write_function,
+	void (U::*)(ZeroCopyWriteFunction_t const&));
+
+
+template<class T, bool = HasZeroCopyWriteFunction<T>::value>
+struct ZeroCopyWriteFunction
+{
+	static void set(T *, ZeroCopyWriteFunction_t const&)
+	{}
+};
+
+
+template<class T>
+struct ZeroCopyWriteFunction<T, true>
+{
+	static void set(T * t, ZeroCopyWriteFunction_t const& write_zero_copy)
+	{
+		t->set_zero_copy_write_function(write_zero_copy);
+	}
+};
+
+
+typedef Delegate<bool(int const*, uint32_t, uint8_t const*, uint32_t)>
+	SendFdsFunction_t;
+
+
+// Detects whether an endpoint wants to pass descriptors.
+LINUX_EPOLL_HAS_MEMBER(
+	HasSendFdsFunction,
+	set_send_fds_function,
+	void (U::*)(SendFdsFunction_t const&));
+
+
+template<class T, bool = HasSendFdsFunction<T>::value>
+struct SendFdsFunction
+{
+	static void set(T *, SendFdsFunction_t const&)
+	{}
+};
+
+
+template<class T>
+struct SendFdsFunction<T, true>
+{
+	static void set(T * t, SendFdsFunction_t const& send_fds)
+	{
+		t->set_send_fds_function(send_fds);
+	}
+};
+
+
+// Detects whether an endpoint accepts descriptors passed by the peer, its
+// socket then reads with recvmsg.
+LINUX_EPOLL_HAS_MEMBER(
+	HasReceivedFds,
+	process_received_fds,
+	void (U::*)(int const*, uint32_t));
+
+
+template<class T, bool = HasReceivedFds<T>::value>
+struct ReceivedFds
+{
+	// descriptors nobody takes are not leaked
+	static void pass(T *, int const* fds, uint32_t count)
+	{
+		for(uint32_t i=0; i<count; ++i)
+		{
+			::close(fds[i]);
+		}
+	}
+};
+
+
+template<class T>
+struct ReceivedFds<T, true>
+{
+	static void pass(T * t, int const* fds, uint32_t count)
+	{
+		t->process_received_fds(fds, count);
+	}
+};
+
+
+// Where a socket connects or binds to: an IPv4 address and port, or for
+// AF_UNIX a path in the file system or a name in the abstract namespace,
+// which needs no file and is gone with the last socket bound to it.
+class SocketAddress
+{
+public:
+	static SocketAddress inet(std::string const& ip, uint16_t port)
+	{
+		SocketAddress address;
+		sockaddr_in & addr = address.as_<sockaddr_in>();
+
+		addr.sin_addr.s_addr = inet_addr(ip.c_str());
+		addr.sin_port        = htons(port);
+		addr.sin_family      = AF_INET;
+
+		address.length_ = sizeof(sockaddr_in);
+		return address;
+	}
+
+	static SocketAddress unix_path(std::string const& path)
+	{
+		SocketAddress address;
+		sockaddr_un & addr = address.as_<sockaddr_un>();
+
+		// the path needs its terminating zero
+		if(path.empty() or path.size() >= sizeof(addr.sun_path))
+		{
+			throw std::runtime_error("invalid unix socket path: " + path);
+		}
+
+		addr.sun_family = AF_UNIX;
+		memcpy(addr.sun_path, path.data(), path.size());
+
+		address.length_ = offsetof(sockaddr_un, sun_path) + path.size() + 1;
+		return address;
+	}
+
+	// the name is everything up to length_, a leading zero byte marks the
+	// abstract namespace
+	static SocketAddress unix_abstract(std::string const& name)
+	{
+		SocketAddress address;
+		sockaddr_un & addr = address.as_<sockaddr_un>();
+
+		if(name.size() >= sizeof(addr.sun_path))
+		{
+			throw std::runtime_error("invalid abstract socket name: " + name);
+		}
+
+		addr.sun_family = AF_UNIX;
+		memcpy(addr.sun_path + 1, name.data(), name.size());
+
+		address.length_ = offsetof(sockaddr_un, sun_path) + name.size() + 1;
+		return address;
+	}
+
+	int domain() const
+	{
+		return storage_.ss_family;
+	}
+
+	sockaddr const* get() const
+	{
+		return reinterpret_cast<sockaddr const*>(&storage_);
+	}
+
+	socklen_t length() const
+	{
+		return length_;
+	}
+
+	// the file a socket bound to this address creates, empty if none
+	std::string path() const
+	{
+		if(domain() != AF_UNIX)
+		{
+			return std::string();
+		}
+
+		sockaddr_un const& addr = reinterpret_cast<sockaddr_un const&>(storage_);
+		return std::string(addr.sun_path);
+	}
+
+private:
+	sockaddr_storage storage_;
+	socklen_t        length_;
+
+	SocketAddress()
+	: length_(0)
+	{
+		memset(&storage_, 0, sizeof(storage_));
+	}
+
+	template<class T>
+	T & as_()
+	{
+		return reinterpret_cast<T&>(storage_);
+	}
+};
+
+
+// Detects whether an endpoint asks for a read ring.
+template<class T>
+struct HasReadRing
+{
+	typedef char Yes;
+	typedef long No;
+
+	template<class U>
+	static Yes test(char (*)[U::READ_RING_SIZE]);
+
+	template<class U>
+	static No test(...);
+
+	enum { value = sizeof(test<T>(0)) == sizeof(Yes) };
+};
+
+
+// Detects whether an endpoint reads from slabs of the loop's BufferPool.
+template<class T>
+struct HasBufferPool
+{
+	typedef char Yes;
+	typedef long No;
+
+	template<class U>
+	static Yes test(char (*)[U::READ_BUFFER_POOL]);
+
+	template<class U>
+	static No test(...);
+
+	enum { value = sizeof(test<T>(0)) == sizeof(Yes) };
+};
+
+
+enum ReadMode
+{
+	EndpointBuffer,
+	RingBuffer,
+	PooledBuffer
+};
+
+
+template<class T>
+struct ReadModeOf
+{
+	enum
+	{
+		value =
+			HasBufferPool<T>::value ? PooledBuffer :
+			HasReadRing<T>::value ? RingBuffer :
+			EndpointBuffer
+	};
+};
+
+
+template<int MODE>
+struct ReadModeTag
+{};
+
 
+// The connection of a stream socket, AF_UNIX ones included.
 template<class LOCAL_ENDPOINT, class SYS = SystemFunctions>
 class TcpSocket : private SYS
 {
 public:
 	typedef TcpSocket<LOCAL_ENDPOINT, SYS> Self_t;
 
+	static const uint32_t DEFAULT_LOW_WATERMARK  = 256 * 1024;
+	static const uint32_t DEFAULT_HIGH_WATERMARK = 1024 * 1024;
+	static const uint32_t DEFAULT_READ_BUDGET    = 256 * 1024;
+
 	TcpSocket()
 	: endpoint_(NULL)
 	, fd_(-1)
 	, connected_(false)
+	, low_watermark_(DEFAULT_LOW_WATERMARK)
+	, high_watermark_(DEFAULT_HIGH_WATERMARK)
+	, above_high_watermark_(false)
+	, pool_(NULL)
+	, buffer_(NULL)
+	, buffered_(0)
+	, read_budget_(DEFAULT_READ_BUDGET)
+	, read_left_(0)
+	, file_cache_(NULL)
+	, zero_copy_(false)
+	, zero_copy_threshold_(0)
+	, zero_copy_unsent_(0)
+	, zero_copy_next_id_(0)
+	, zero_copy_done_(0)
+	, message_mode_(false)
+	, alive_(NULL)
 	{}
 
 	TcpSocket(int fd)
 	: endpoint_(NULL)
 	, fd_(fd)
 	, connected_(false)
+	, low_watermark_(DEFAULT_LOW_WATERMARK)
+	, high_watermark_(DEFAULT_HIGH_WATERMARK)
+	, above_high_watermark_(false)
+	, pool_(NULL)
+	, buffer_(NULL)
+	, buffered_(0)
+	, read_budget_(DEFAULT_READ_BUDGET)
+	, read_left_(0)
+	, file_cache_(NULL)
+	, zero_copy_(false)
+	, zero_copy_threshold_(0)
+	, zero_copy_unsent_(0)
+	, zero_copy_next_id_(0)
+	, zero_copy_done_(0)
+	, message_mode_(false)
+	, alive_(NULL)
 	{}
 
 	~TcpSocket()
 	{
+		leave_read_();
 		close();
 	}
 
@@ -212,10 +763,18 @@ public:
 	}
 
 	void open()
+	{
+		open(AF_INET, SOCK_STREAM);
+	}
+
+	// type is SOCK_STREAM, or SOCK_SEQPACKET for AF_UNIX
+	void open(int domain, int type)
 	{
 		if(fd_ == -1 )
 		{
-			open_(SYS::socket_(AF_INET, SOCK_STREAM, 0));
+			open_(SYS::socket_(
+				domain, type|SOCK_NONBLOCK|SOCK_CLOEXEC, 0));
+			set_message_mode(type == SOCK_SEQPACKET);
 		}
 	}
 
@@ -226,6 +785,9 @@ public:
 			SYS::close_(fd_);
 			fd_ = -1;
 		}
+
+		reset_output_();
+		release_buffer_();
 	}
 
 	void reopen()
@@ -243,13 +805,73 @@ public:
 				this,
 				std::tr1::placeholders::_1,
 				std::tr1::placeholders::_2));
+		SendFileFunction<LOCAL_ENDPOINT>::set(
+			endpoint_,
+			std::tr1::bind(
+				&Self_t::send_file,
+				this,
+				std::tr1::placeholders::_1,
+				std::tr1::placeholders::_2,
+				std::tr1::placeholders::_3));
+		ZeroCopyWriteFunction<LOCAL_ENDPOINT>::set(
+			endpoint_,
+			std::tr1::bind(
+				&Self_t::write_zero_copy,
+				this,
+				std::tr1::placeholders::_1,
+				std::tr1::placeholders::_2,
+				std::tr1::placeholders::_3));
+		SendFdsFunction<LOCAL_ENDPOINT>::set(
+			endpoint_,
+			std::tr1::bind(
+				&Self_t::send_fds,
+				this,
+				std::tr1::placeholders::_1,
+				std::tr1::placeholders::_2,
+				std::tr1::placeholders::_3,
+				std::tr1::placeholders::_4));
+	}
+
+	// for SOCK_SEQPACKET: every write is one message and reads continue
+	// after short reads, which only mean the message was short
+	void set_message_mode(bool messages)
+	{
+		message_mode_ = messages;
+		output_.set_message_mode(messages);
+	}
+
+	// slabs are only taken from the pool if the endpoint sets READ_BUFFER_POOL
+	void set(BufferPool * pool)
+	{
+		pool_ = pool;
+	}
+
+	// files sent by path are opened through the cache
+	void set(FileCache * file_cache)
+	{
+		file_cache_ = file_cache;
 	}
 
-	void set(std::tr1::function<void(Self_t*)> handle_terminated_connection)
+	void set(Delegate<void(Self_t*)> const& handle_terminated_connection)
 	{
 		handle_terminated_connection_ = handle_terminated_connection;
 	}
 
+	// called when a read stops at the budget with data left; the owner has
+	// the loop dispatch the socket again, e.g. with schedule(), since under
+	// EPOLLET no further event will come for that data. Without it reads
+	// are not limited.
+	void set_reschedule_function(Delegate<void(Self_t*)> const& reschedule)
+	{
+		reschedule_ = reschedule;
+	}
+
+	// bytes read per dispatch before the socket yields to other handlers
+	void set_read_budget(uint32_t bytes)
+	{
+		read_budget_ = std::max(bytes, uint32_t(1));
+	}
+
 	void set(sockaddr_in const& addr)
 	{
 		std::copy(&addr, &addr+1, &addr_);
@@ -263,17 +885,95 @@ public:
 		addr_.sin_family      = AF_INET;
 	}
 
-	void set_connected()
+	// disables Nagle's algorithm, small writes then leave without waiting for
+	// the ACK of earlier ones
+	void set_no_delay(bool no_delay)
 	{
-		if( not connected_)
-		{
-			connected_ = true;
-			endpoint_->connected();
-		}
+		int on = no_delay;
+		SYS::setsockopt_(fd_, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
 	}
 
+	// blocking reads and the loop's epoll_wait poll the device queue of this
+	// socket for up to usec before sleeping; values above net.core.busy_read
+	// need CAP_NET_ADMIN. prefer keeps the queue's interrupts deferred while
+	// the application polls it.
+	void set_busy_poll(uint32_t usec, bool prefer)
+	{
+		int value = usec;
+		int on = prefer;
+
+		typename SYS::Result result =
+			SYS::setsockopt_(fd_, SOL_SOCKET, SO_BUSY_POLL, (char*)&value, sizeof(value));
+		if(result)
+		{
+			result = SYS::setsockopt_(
+				fd_, SOL_SOCKET, SO_PREFER_BUSY_POLL, (char*)&on, sizeof(on));
+		}
+
+		if(not result)
+		{
+			LINUX_EPOLL_LOG_WARNING(
+				"fd:%d enabling busy polling failed with: %s",
+				fd_,
+				result.error_description());
+		}
+	}
+
+	// makes write_zero_copy send buffers of at least threshold bytes with
+	// MSG_ZEROCOPY, smaller ones are cheaper to copy; 0 copies everything.
+	// Returns false if the kernel does not support SO_ZEROCOPY.
+	bool set_zero_copy(uint32_t threshold)
+	{
+		if(threshold != 0 and not zero_copy_)
+		{
+			int on = 1;
+			typename SYS::Result result =
+				SYS::setsockopt_(fd_, SOL_SOCKET, SO_ZEROCOPY, (char*)&on, sizeof(on));
+
+			if(not result)
+			{
+				LINUX_EPOLL_LOG_WARNING(
+					"fd:%d enabling zero copy failed with: %s",
+					fd_,
+					result.error_description());
+				zero_copy_threshold_ = 0;
+				return false;
+			}
+			zero_copy_ = true;
+		}
+
+		zero_copy_threshold_ = threshold;
+		return true;
+	}
+
+	void set_watermarks(uint32_t low, uint32_t high)
+	{
+		low_watermark_ = low;
+		high_watermark_ = high;
+	}
+
+	uint64_t queued_output() const
+	{
+		return output_.size();
+	}
+
+	void set_connected()
+	{
+		if( not connected_)
+		{
+			connected_ = true;
+			endpoint_->connected();
+		}
+	}
+
+	// the terminated connection handler may destroy this socket, so callers
+	// must not touch any member afterwards
 	void set_disconnected()
 	{
+		leave_read_();
+		reset_output_();
+		release_buffer_();
+
 		if(connected_)
 		{
 			connected_ = false;
@@ -301,6 +1001,19 @@ public:
 		}
 		else
 		{
+			if(event_mask & EPOLLERR)
+			{
+				process_error_queue();
+			}
+
+			if(event_mask & EPOLLOUT)
+			{
+				if(not process_write())
+				{
+					return;
+				}
+			}
+
 			if(event_mask & EPOLLIN)
 			{
 				process_read();
@@ -308,37 +1021,317 @@ public:
 		}
 	}
 
-	void process_read()
+	// flushes queued output with writev and sendfile until the kernel stops
+	// taking data, returns false if the connection was terminated
+	bool process_write()
 	{
-		if(available_data() == 0)
+		while(not output_.is_empty())
 		{
-			set_disconnected();
+			bool file = output_.front_file() != NULL;
+			typename SYS::Result result = write_front_();
+
+			if(not result)
+			{
+				if(would_block_(result))
+				{
+					break;
+				}
+
+				set_disconnected();
+				return false;
+			}
+
+			// only a file that shrank since it was queued ends early, the
+			// peer would wait for the missing bytes forever. Otherwise 0 is
+			// an empty message that was sent
+			if(result.value() == 0 and file)
+			{
+				LINUX_EPOLL_LOG_WARNING(
+					"fd:%d file ended before its range was sent",
+					fd_);
+				set_disconnected();
+				return false;
+			}
+
+			output_.consume(result.value());
 		}
-		else
+
+		release_zero_copy_();
+
+		if(above_high_watermark_ and output_.size() <= low_watermark_)
+		{
+			above_high_watermark_ = false;
+			WatermarkCallbacks<LOCAL_ENDPOINT>::low(endpoint_);
+		}
+
+		return true;
+	}
+
+	// reads the completions of zero-copy sends, which the kernel queues on
+	// the error queue and signals with EPOLLERR, and releases the buffers it
+	// is done with
+	void process_error_queue()
+	{
+		if(not zero_copy_)
+		{
+			return;
+		}
+
+		while(true)
 		{
-			while(available_data() != 0)
+			union
+			{
+				struct cmsghdr align;
+				char           buffer[128];
+			} control;
+
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_control = control.buffer;
+			msg.msg_controllen = sizeof(control.buffer);
+
+			if(not SYS::recvmsg_(fd_, &msg, MSG_ERRQUEUE))
+			{
+				break;
+			}
+
+			for(struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+				cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&msg, cmsg))
 			{
-				process_read_(
-					SYS::read_(
+				if(not ((cmsg->cmsg_level == SOL_IP and cmsg->cmsg_type == IP_RECVERR) or
+				        (cmsg->cmsg_level == SOL_IPV6 and cmsg->cmsg_type == IPV6_RECVERR)))
+				{
+					continue;
+				}
+
+				struct sock_extended_err const* error =
+					(struct sock_extended_err const*)CMSG_DATA(cmsg);
+
+				if(error->ee_errno != 0 or error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				{
+					continue;
+				}
+
+				// e.g. on loopback, where zero copy only adds overhead
+				if(error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				{
+					LINUX_EPOLL_LOG_DEBUG(
+						"fd:%d zero copy sends %u to %u were copied",
 						fd_,
-						endpoint_->get_buffer(),
-						std::min(
-							available_data(),
-							endpoint_->get_buffer_size())));
+						error->ee_info,
+						error->ee_data);
+				}
+
+				complete_zero_copy_(error->ee_info, error->ee_data);
 			}
 		}
+
+		release_zero_copy_();
 	}
 
+	// reads until the kernel has no more data, EOF is a read returning 0. A
+	// read shorter than requested already means the socket is drained, which
+	// saves the read failing with EAGAIN; data arriving later raises a new edge
+	void process_read()
+	{
+		bool alive = true;
+		alive_ = &alive;
+		read_left_ = read_budget_;
+
+		process_read_(
+			ReadModeTag<ReadModeOf<LOCAL_ENDPOINT>::value>(),
+			endpoint_,
+			alive);
+
+		if(alive)
+		{
+			alive_ = NULL;
+		}
+	}
+
+	// writes inline while nothing is queued, whatever the kernel does not
+	// take is queued and flushed on the next EPOLLOUT. In message mode size 0
+	// sends an empty message, on a stream it does nothing
 	void write(uint8_t const* data, uint32_t size)
 	{
-		if(connected_)
+		if(not connected_ or (size == 0 and not message_mode_))
 		{
-			write_(SYS::write_(fd_, data, size));
-			// if(SYS::write_(fd_, data, size) == -1)
-			// {
-			// 	set_disconnected();
-			// }
+			return;
 		}
+
+		if(output_.is_empty())
+		{
+			typename SYS::Result result = SYS::write_(fd_, data, size);
+
+			if(result)
+			{
+				data += result.value();
+				size -= result.value();
+			}
+			else if(not would_block_(result))
+			{
+				set_disconnected();
+				return;
+			}
+
+			if(size == 0)
+			{
+				return;
+			}
+		}
+
+		output_.push(data, size);
+		check_high_watermark_();
+	}
+
+	// sends data with duplicates of fds attached over an AF_UNIX socket, the
+	// peer receives them before data; the caller keeps its descriptors. False
+	// if they can not be sent or size is 0, stream sockets pass descriptors
+	// only along with data.
+	bool send_fds(int const* fds, uint32_t count, uint8_t const* data, uint32_t size)
+	{
+		if(not connected_ or size == 0 or count > MAX_FDS)
+		{
+			return false;
+		}
+
+		if(output_.is_empty())
+		{
+			struct iovec iov;
+			iov.iov_base = const_cast<uint8_t*>(data);
+			iov.iov_len = size;
+
+			typename SYS::Result result = send_with_fds_(&iov, 1, fds, count);
+
+			if(result)
+			{
+				// the descriptors went with the first part
+				if(uint32_t(result.value()) < size)
+				{
+					output_.push(data + result.value(), size - result.value());
+					check_high_watermark_();
+				}
+				return true;
+			}
+
+			if(not would_block_(result))
+			{
+				LINUX_EPOLL_LOG_DEBUG(
+					"fd:%d sending descriptors failed: %s",
+					fd_,
+					result.error_description());
+
+				// EBADF and ETOOMANYREFS concern the descriptors only
+				if(result.error_code() != EBADF and
+				   result.error_code() != ETOOMANYREFS)
+				{
+					set_disconnected();
+				}
+				return false;
+			}
+		}
+
+		if(not output_.push_fds(fds, count, data, size))
+		{
+			return false;
+		}
+		check_high_watermark_();
+		return true;
+	}
+
+	// sends data without copying it if zero copy is enabled and size reaches
+	// the threshold, otherwise like write. data has to stay unmodified until
+	// release is called, which is once the kernel completed every send of it
+	// or the connection closed, and at once when data was copied.
+	void write_zero_copy(
+		uint8_t const* data,
+		uint32_t size,
+		Delegate<void()> const& release)
+	{
+		if(not connected_ or zero_copy_threshold_ == 0 or size < zero_copy_threshold_)
+		{
+			write(data, size);
+			if(release)
+			{
+				release();
+			}
+			return;
+		}
+
+		ZeroCopyBuffer buffer;
+		buffer.release = release;
+		buffer.unsent = size;
+		buffer.pending = false;
+		buffer.last_id = 0;
+		zero_copy_buffers_.push_back(buffer);
+
+		bool idle = output_.is_empty();
+		output_.push_borrowed(data, size);
+
+		if(idle and not process_write())
+		{
+			return;
+		}
+		check_high_watermark_();
+	}
+
+	// queues length bytes of the file at path from offset, taken from the
+	// FileCache and kept open until sent; false if it can not be opened or
+	// is shorter than the range
+	bool send_file(std::string const& path, uint64_t offset, uint64_t length)
+	{
+		if(not connected_ or file_cache_ == NULL)
+		{
+			return false;
+		}
+
+		FileCache::Handle file = file_cache_->acquire(path);
+		if(file == FileCache::NONE)
+		{
+			return false;
+		}
+
+		uint64_t size = file_cache_->stat(file).st_size;
+		if(offset > size or (length != WHOLE_FILE and length > size - offset))
+		{
+			file_cache_->release(file);
+			return false;
+		}
+
+		send_fd(
+			file_cache_->fd(file),
+			offset,
+			length == WHOLE_FILE ? size - offset : length,
+			std::tr1::bind(&FileCache::release, file_cache_, file));
+		return true;
+	}
+
+	// queues length bytes of fd from offset, the caller keeps fd open until
+	// release is called once they were sent or the connection closed
+	void send_fd(
+		int fd,
+		uint64_t offset,
+		uint64_t length,
+		Delegate<void()> const& release)
+	{
+		if(not connected_ or length == 0)
+		{
+			if(release)
+			{
+				release();
+			}
+			return;
+		}
+
+		bool idle = output_.is_empty();
+		output_.push_file(fd, offset, length, release);
+
+		if(idle and not process_write())
+		{
+			return;
+		}
+		check_high_watermark_();
 	}
 
 	LOCAL_ENDPOINT * endpoint() const
@@ -357,18 +1350,67 @@ public:
 	}
 
 protected:
+	// a buffer of write_zero_copy; unsent counts its bytes still queued and
+	// last_id is the MSG_ZEROCOPY send that took its last bytes, if pending
+	struct ZeroCopyBuffer
+	{
+		Delegate<void()> release;
+		uint32_t         unsent;
+		bool             pending;
+		uint32_t         last_id;
+	};
+
+	// ids of completed sends, first to last
+	typedef std::vector<std::pair<uint32_t, uint32_t> > IdRanges_t;
+
 	LOCAL_ENDPOINT                  * endpoint_;
 	int                               fd_;
 	bool                              connected_;
 	sockaddr_in                       addr_;
-	std::tr1::function<void(Self_t*)> handle_terminated_connection_;
+	Delegate<void(Self_t*)>           handle_terminated_connection_;
+	OutputQueue                       output_;
+	ReadRing                          input_;
+	uint32_t                          low_watermark_;
+	uint32_t                          high_watermark_;
+	bool                              above_high_watermark_;
+	BufferPool                      * pool_;
+	uint8_t                         * buffer_;
+	uint32_t                          buffered_;
+	uint32_t                          read_budget_;
+	uint32_t                          read_left_;
+	Delegate<void(Self_t*)>           reschedule_;
+	FileCache                       * file_cache_;
+	bool                              zero_copy_;
+	uint32_t                          zero_copy_threshold_;
+	std::deque<ZeroCopyBuffer>        zero_copy_buffers_;
+	uint32_t                          zero_copy_unsent_;
+	uint32_t                          zero_copy_next_id_;
+	uint32_t                          zero_copy_done_;
+	IdRanges_t                        zero_copy_early_;
+	bool                              message_mode_;
+	bool                            * alive_;
 
 private:
-	void open_(SYS::Result const& result)
+	// descriptors passed with one message at most, SCM_MAX_FD of the kernel
+	static const uint32_t MAX_FDS = 253;
+
+	// sendfile(2) transfers at most this much per call
+	static const uint32_t MAX_SENDFILE = 0x7ffff000;
+
+	static const int MAX_IOV = 64;
+
+	static bool would_block_(typename SYS::Result const& result)
+	{
+		return (
+			result.error_code() == EAGAIN or
+			result.error_code() == EWOULDBLOCK);
+	}
+
+	void open_(typename SYS::Result const& result)
 	{
 		if(result)
 		{
-			fd_ = result.value;
+			fd_ = result.value();
 		}
 		else
 		{
@@ -379,61 +1421,570 @@ private:
 		}
 	}
 
-	void process_read_(SYS::Result const& result)
+	// returns false once reading has to stop
+	bool check_read_(typename SYS::Result const& result)
+	{
+		if(not result)
+		{
+			if(not would_block_(result))
+			{
+				set_disconnected();
+			}
+			return false;
+		}
+
+		if(result.value() == 0)
+		{
+			set_disconnected();
+			return false;
+		}
+
+		return true;
+	}
+
+	void check_high_watermark_()
+	{
+		if(not above_high_watermark_ and output_.size() >= high_watermark_)
+		{
+			above_high_watermark_ = true;
+			WatermarkCallbacks<LOCAL_ENDPOINT>::high(endpoint_);
+		}
+	}
+
+	// sends from the front of the queue, with writev up to the next file and
+	// with sendfile when a file is next
+	typename SYS::Result write_front_()
+	{
+		OutputQueue::FileRange * file = output_.front_file();
+
+		if(file == NULL)
+		{
+			struct iovec iov[MAX_IOV];
+			int count = output_.fill(iov, MAX_IOV);
+
+			if(output_.front_borrowed())
+			{
+				return send_borrowed_(iov, count);
+			}
+
+			std::vector<int> const* fds = output_.front_fds();
+			if(fds != NULL)
+			{
+				typename SYS::Result result =
+					send_with_fds_(iov, count, &(*fds)[0], fds->size());
+				if(result)
+				{
+					output_.sent_front_fds();
+				}
+				return result;
+			}
+
+			// writev of nothing sends nothing, write sends an empty message
+			if(count == 1)
+			{
+				return SYS::write_(fd_, iov[0].iov_base, iov[0].iov_len);
+			}
+			return SYS::writev_(fd_, iov, count);
+		}
+
+		// consume() advances the range, the copy only satisfies sendfile
+		off_t offset = file->offset;
+		return SYS::sendfile_(
+			fd_,
+			file->fd,
+			&offset,
+			std::min(file->length, uint64_t(MAX_SENDFILE)));
+	}
+
+	typename SYS::Result send_with_fds_(
+		struct iovec * iov,
+		int count,
+		int const* fds,
+		uint32_t fd_count)
+	{
+		union
+		{
+			struct cmsghdr align;
+			char           buffer[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+		} control;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+		struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+
+		return SYS::sendmsg_(fd_, &msg, 0);
+	}
+
+	// reads with read or readv, or with recvmsg if the endpoint accepts
+	// descriptors, which are handed over before the data is
+	typename SYS::Result receive_(struct iovec * iov, int count)
+	{
+		if(not HasReceivedFds<LOCAL_ENDPOINT>::value)
+		{
+			if(count == 1)
+			{
+				return SYS::read_(fd_, iov[0].iov_base, iov[0].iov_len);
+			}
+			return SYS::readv_(fd_, iov, count);
+		}
+
+		union
+		{
+			struct cmsghdr align;
+			char           buffer[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+		} control;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+
+		typename SYS::Result result = SYS::recvmsg_(fd_, &msg, MSG_CMSG_CLOEXEC);
+
+		if(result and msg.msg_controllen != 0)
+		{
+			pass_fds_(msg);
+		}
+		return result;
+	}
+
+	typename SYS::Result receive_(void * buffer, uint32_t size)
+	{
+		struct iovec iov;
+		iov.iov_base = buffer;
+		iov.iov_len = size;
+		return receive_(&iov, 1);
+	}
+
+	void pass_fds_(struct msghdr & msg)
+	{
+		if(msg.msg_flags & MSG_CTRUNC)
+		{
+			LINUX_EPOLL_LOG_WARNING(
+				"fd:%d the peer passed more than %u descriptors, the rest was closed",
+				fd_,
+				MAX_FDS);
+		}
+
+		for(struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if(cmsg->cmsg_level != SOL_SOCKET or cmsg->cmsg_type != SCM_RIGHTS)
+			{
+				continue;
+			}
+
+			int fds[MAX_FDS];
+			uint32_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+
+			ReceivedFds<LOCAL_ENDPOINT>::pass(endpoint_, fds, count);
+		}
+	}
+
+	// a read shorter than requested means the socket is drained, except in
+	// message mode where every read returns one message
+	bool drained_(uint32_t size, uint32_t requested) const
+	{
+		return not message_mode_ and size < requested;
+	}
+
+	// every successful send with MSG_ZEROCOPY takes the next id of the socket,
+	// completions report ranges of these ids
+	typename SYS::Result send_borrowed_(struct iovec * iov, int count)
 	{
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		bool zero_copy = zero_copy_;
+		typename SYS::Result result =
+			SYS::sendmsg_(fd_, &msg, zero_copy ? MSG_ZEROCOPY : 0);
+
+		// the socket has no option memory left for further notifications
+		// until earlier ones were read, this part is copied instead
+		if(zero_copy and not result and result.error_code() == ENOBUFS)
+		{
+			zero_copy = false;
+			result = SYS::sendmsg_(fd_, &msg, 0);
+		}
+
 		if(result)
 		{
-			endpoint_->process_read_data(endpoint_->get_buffer(), result.value);
+			account_borrowed_(result.value(), zero_copy);
 		}
+		return result;
 	}
 
-	void write_(SYS::Result const& result)
+	// marks sent bytes of the borrowed buffers in queue order
+	void account_borrowed_(uint32_t sent, bool zero_copy)
 	{
-		if(not result)
+		uint32_t id = zero_copy_next_id_;
+		if(zero_copy)
 		{
-			set_disconnected();
+			++zero_copy_next_id_;
+		}
+
+		while(sent != 0)
+		{
+			ZeroCopyBuffer & buffer = zero_copy_buffers_[zero_copy_unsent_];
+			uint32_t part = std::min(sent, buffer.unsent);
+
+			buffer.unsent -= part;
+			sent -= part;
+
+			if(zero_copy)
+			{
+				buffer.pending = true;
+				buffer.last_id = id;
+			}
+
+			if(buffer.unsent == 0)
+			{
+				++zero_copy_unsent_;
+			}
 		}
 	}
+
+	// TCP completes sends in order as a rule, ranges arriving early are kept
+	// until the gap in front of them is closed
+	void complete_zero_copy_(uint32_t first, uint32_t last)
+	{
+		zero_copy_early_.push_back(std::make_pair(first, last));
+
+		for(uint32_t i=0; i<zero_copy_early_.size(); )
+		{
+			if(int32_t(zero_copy_early_[i].first - zero_copy_done_) > 0)
+			{
+				++i;
+				continue;
+			}
+
+			uint32_t next = zero_copy_early_[i].second + 1;
+			if(int32_t(next - zero_copy_done_) > 0)
+			{
+				zero_copy_done_ = next;
+			}
+
+			zero_copy_early_[i] = zero_copy_early_.back();
+			zero_copy_early_.pop_back();
+			i = 0;
+		}
+	}
+
+	// releases the borrowed buffers that were sent completely and whose last
+	// zero-copy send has completed, in the order they were written
+	void release_zero_copy_()
+	{
+		while(zero_copy_unsent_ != 0)
+		{
+			ZeroCopyBuffer & front = zero_copy_buffers_.front();
+
+			if(front.pending and int32_t(front.last_id - zero_copy_done_) >= 0)
+			{
+				return;
+			}
+
+			Delegate<void()> release(front.release);
+			zero_copy_buffers_.pop_front();
+			--zero_copy_unsent_;
+
+			if(release)
+			{
+				release();
+			}
+		}
+	}
+
+	// the kernel keeps the pages of unfinished zero-copy sends pinned by
+	// itself, so their buffers are released at once when the connection ends
+	void reset_output_()
+	{
+		output_.clear();
+		above_high_watermark_ = false;
+
+		std::deque<ZeroCopyBuffer> buffers;
+		buffers.swap(zero_copy_buffers_);
+		zero_copy_unsent_ = 0;
+		zero_copy_next_id_ = 0;
+		zero_copy_done_ = 0;
+		zero_copy_early_.clear();
+
+		for(uint32_t i=0; i<buffers.size(); ++i)
+		{
+			if(buffers[i].release)
+			{
+				buffers[i].release();
+			}
+		}
+	}
+
+	// charges a full read against the budget of this dispatch, once it is
+	// used up the socket is rescheduled and reading stops
+	bool charge_read_(uint32_t size)
+	{
+		if(size < read_left_ or not reschedule_)
+		{
+			read_left_ -= std::min(size, read_left_);
+			return true;
+		}
+
+		if(connected_)
+		{
+			reschedule_(this);
+		}
+		return false;
+	}
+
+	// the read paths are member templates, so only the one the endpoint
+	// selects is ever instantiated
+	template<class ENDPOINT>
+	void process_read_(
+		ReadModeTag<EndpointBuffer>,
+		ENDPOINT * endpoint,
+		bool const& alive)
+	{
+		uint32_t requested;
+		do
+		{
+			uint8_t * buffer = endpoint->get_buffer();
+			requested = endpoint->get_buffer_size();
+
+			typename SYS::Result result = receive_(buffer, requested);
+			if(not check_read_(result))
+			{
+				return;
+			}
+
+			endpoint->process_read_data(buffer, result.value());
+			if(not alive)
+			{
+				return;
+			}
+
+			if(drained_(result.value(), requested) or
+			   not charge_read_(result.value()))
+			{
+				return;
+			}
+		} while(connected_);
+	}
+
+	template<class ENDPOINT>
+	void process_read_(
+		ReadModeTag<RingBuffer>,
+		ENDPOINT * endpoint,
+		bool const& alive)
+	{
+		if(input_.capacity() == 0)
+		{
+			input_.reset(ENDPOINT::READ_RING_SIZE);
+		}
+
+		do
+		{
+			struct iovec iov[2];
+			int count = input_.fill(iov);
+			uint32_t requested = input_.free_space();
+
+			typename SYS::Result result = receive_(iov, count);
+			if(not check_read_(result))
+			{
+				return;
+			}
+
+			input_.produce(result.value());
+
+			uint8_t const* data;
+			uint32_t size;
+			while((size = input_.span(data)) != 0)
+			{
+				endpoint->process_read_data(data, size);
+				if(not alive)
+				{
+					return;
+				}
+				input_.consume(size);
+			}
+
+			if(drained_(result.value(), requested) or
+			   not charge_read_(result.value()))
+			{
+				return;
+			}
+		} while(connected_);
+	}
+
+	// the endpoint returns how much it consumed, the rest is moved to the
+	// front of the slab and handed over again together with the next data
+	template<class ENDPOINT>
+	void process_read_(
+		ReadModeTag<PooledBuffer>,
+		ENDPOINT * endpoint,
+		bool const& alive)
+	{
+		do
+		{
+			if(buffer_ == NULL)
+			{
+				buffer_ = pool_->acquire();
+			}
+
+			uint32_t requested = pool_->slab_size() - buffered_;
+			if(requested == 0)
+			{
+				LINUX_EPOLL_LOG_WARNING(
+					"fd:%d message does not fit into a %u byte slab",
+					fd_,
+					pool_->slab_size());
+				set_disconnected();
+				return;
+			}
+
+			typename SYS::Result result =
+				receive_(buffer_ + buffered_, requested);
+
+			if(not result and would_block_(result))
+			{
+				release_idle_buffer_();
+				return;
+			}
+
+			if(not check_read_(result))
+			{
+				return;
+			}
+
+			buffered_ += result.value();
+			uint32_t consumed = endpoint->process_read_data(buffer_, buffered_);
+			if(not alive)
+			{
+				return;
+			}
+
+			buffered_ -= consumed;
+
+			if(buffered_ != 0 and consumed != 0)
+			{
+				memmove(buffer_, buffer_ + consumed, buffered_);
+			}
+
+			if(drained_(result.value(), requested))
+			{
+				release_idle_buffer_();
+				return;
+			}
+
+			if(not charge_read_(result.value()))
+			{
+				return;
+			}
+		} while(connected_);
+	}
+
+	// tells a read path running further up the stack that the endpoint
+	// disconnected or destroyed this socket, it must return without touching
+	// any member
+	void leave_read_()
+	{
+		if(alive_ != NULL)
+		{
+			*alive_ = false;
+			alive_ = NULL;
+		}
+	}
+
+	void release_idle_buffer_()
+	{
+		if(buffer_ != NULL and buffered_ == 0)
+		{
+			pool_->release(buffer_);
+			buffer_ = NULL;
+		}
+	}
+
+	void release_buffer_()
+	{
+		buffered_ = 0;
+		release_idle_buffer_();
+	}
 };
 
 
 //----------------------------------------------------------------------------//
 
 
-template<
-	class POLL_INTERFACE,
-	class LOCAL_ENDPOINT,
-	class SYS = SystemFunctions>
-class ActiveSocket : private SYS
-{
-public:
+template<
+	class POLL_INTERFACE,
+	class LOCAL_ENDPOINT,
+	class SYS = SystemFunctions>
+class ActiveSocket : private SYS
+{
+public:
+	ActiveSocket(
+		POLL_INTERFACE * poll_interface,
+		LOCAL_ENDPOINT * endpoint,
+		DurationMs retry_interval,
+		std::string const& ip,
+ 		uint16_t port,
+		DurationMs connect_timeout = DurationMs(3000))
+	: retry_interval_(retry_interval)
+	, connect_timeout_(connect_timeout)
+	, poll_interface_(poll_interface)
+	, socket_()
+	, remote_(SocketAddress::inet(ip, port))
+	, type_(SOCK_STREAM)
+	, connecting_(false)
+	, no_delay_(false)
+	, busy_poll_usec_(0)
+	, prefer_busy_poll_(false)
+	, zero_copy_threshold_(0)
+	{
+		socket_.set(ip, port);
+		setup_(endpoint);
+	}
+
+	// connects to any address, e.g. an AF_UNIX one with type SOCK_STREAM or
+	// SOCK_SEQPACKET
 	ActiveSocket(
 		POLL_INTERFACE * poll_interface,
 		LOCAL_ENDPOINT * endpoint,
 		DurationMs retry_interval,
-		std::string const& ip,
- 		uint16_t port)
+		SocketAddress const& remote,
+		int type = SOCK_STREAM,
+		DurationMs connect_timeout = DurationMs(3000))
 	: retry_interval_(retry_interval)
+	, connect_timeout_(connect_timeout)
 	, poll_interface_(poll_interface)
 	, socket_()
+	, remote_(remote)
+	, type_(type)
+	, connecting_(false)
+	, no_delay_(false)
+	, busy_poll_usec_(0)
+	, prefer_busy_poll_(false)
+	, zero_copy_threshold_(0)
 	{
-		if(poll_interface_->is_full())
-		{
-			throw std::runtime_error(
-				"ActiveSocket can not be added to poll_interface");
-		}
-
-		socket_.set(endpoint);
-		socket_.set(ip, port);
-		socket_.set(
-			std::tr1::bind(
-				&Self_t::handle_terminated_connection_,
-				this,
-				std::tr1::placeholders::_1));
-		socket_.open();
+		setup_(endpoint);
+	}
 
-		poll_interface_->add(*this);
-		connect();
+	~ActiveSocket()
+	{
+		close_();
+		poll_interface_->remove_timeouts(this);
 	}
 
 	void added()
@@ -442,27 +1993,104 @@ public:
 	void removed()
 	{}
 
+	// starts a non-blocking connect, completion is reported by EPOLLOUT
 	void connect()
 	{
-		std::cout << "ActiveSocket connect" << std::endl;
-		if(not socket_.is_connected())
+		if(socket_.is_connected() or connecting_)
+		{
+			return;
+		}
+
+		if(socket_.get_fd() == -1)
 		{
-			if(SYS::connect_(
-				socket_.get_fd(),
-				(sockaddr*) socket_.addr(),
-				sizeof(*socket_.addr())) != 0)
+			socket_.open(remote_.domain(), type_);
+			if(no_delay_ and remote_.domain() == AF_INET)
+			{
+				socket_.set_no_delay(true);
+			}
+			if(busy_poll_usec_ != 0)
+			{
+				socket_.set_busy_poll(busy_poll_usec_, prefer_busy_poll_);
+			}
+			if(zero_copy_threshold_ != 0)
 			{
-				std::cout << "connect_ failed" << std::endl;
-				poll_interface_->remove(*this);
-				socket_.reopen();
-				poll_interface_->add(*this);
+				socket_.set_zero_copy(zero_copy_threshold_);
+			}
 
-				poll_interface_->register_timeout(
-					retry_interval_,
-					std::tr1::bind(&Self_t::connect, this),
-					this);
+			// the completion could never be seen, so not even connecting
+			// helps while the loop is full
+			if(not poll_interface_->add(*this))
+			{
+				LINUX_EPOLL_LOG_WARNING(
+					"ActiveSocket fd:%d loop is full, retrying",
+					socket_.get_fd());
+				retry_();
+				return;
 			}
 		}
+
+		LINUX_EPOLL_LOG_DEBUG("ActiveSocket connect fd:%d", socket_.get_fd());
+
+		typename SYS::Result result = SYS::connect_(
+			socket_.get_fd(),
+			remote_.get(),
+			remote_.length());
+
+		if(result)
+		{
+			socket_.set_connected();
+		}
+		else if(result.error_code() == EINPROGRESS)
+		{
+			connecting_ = true;
+			deadline_ = poll_interface_->register_timeout(
+				connect_timeout_,
+				std::tr1::bind(&Self_t::retry_, this),
+				this,
+				retry_slack(connect_timeout_));
+		}
+		else
+		{
+			LINUX_EPOLL_LOG_INFO(
+				"ActiveSocket connect failed: %s",
+				strerror(result.error_code()));
+			retry_();
+		}
+	}
+
+	// applied to the current and every later connection attempt
+	void set_no_delay(bool no_delay)
+	{
+		no_delay_ = no_delay;
+
+		if(socket_.get_fd() != -1 and remote_.domain() == AF_INET)
+		{
+			socket_.set_no_delay(no_delay);
+		}
+	}
+
+	// kept across reconnects, see TcpSocket::set_busy_poll
+	void set_busy_poll(uint32_t usec, bool prefer = false)
+	{
+		busy_poll_usec_ = usec;
+		prefer_busy_poll_ = prefer;
+
+		if(socket_.get_fd() != -1)
+		{
+			socket_.set_busy_poll(usec, prefer);
+		}
+	}
+
+	// kept across reconnects, see TcpSocket::set_zero_copy
+	bool set_zero_copy(uint32_t threshold)
+	{
+		zero_copy_threshold_ = threshold;
+
+		if(socket_.get_fd() != -1)
+		{
+			return socket_.set_zero_copy(threshold);
+		}
+		return true;
 	}
 
 	int get_fd() const
@@ -472,48 +2100,136 @@ public:
 
 	void process_events(int event_mask)
 	{
+		if(connecting_)
+		{
+			if(not (event_mask & (EPOLLOUT|EPOLLERR|EPOLLHUP)) or
+			   not finish_connect_())
+			{
+				return;
+			}
+		}
+
 		if(event_mask & EPOLLHUP)
 		{
-			std::cout << "HUP" << std::endl;
+			LINUX_EPOLL_LOG_DEBUG("ActiveSocket HUP fd:%d", socket_.get_fd());
 			socket_.set_disconnected();
 			return;
 		}
 		else
 		{
+			if((event_mask & EPOLLERR) and socket_.is_connected())
+			{
+				socket_.process_error_queue();
+			}
 			if(event_mask & EPOLLIN)
 			{
-				if(not socket_.is_connected())
-				{
-					socket_.set_connected();
-				}
-
 				socket_.process_read();
 			}
-			if(event_mask & EPOLLOUT)
+			if((event_mask & EPOLLOUT) and socket_.is_connected())
 			{
-				if(not socket_.is_connected())
-				{
-					socket_.set_connected();
-				}
+				socket_.process_write();
 			}
 		}
 	}
 
 
 private:
-	typedef TcpSocket<LOCAL_ENDPOINT> Socket_t;
+	typedef TcpSocket<LOCAL_ENDPOINT, SYS> Socket_t;
 	typedef ActiveSocket<POLL_INTERFACE, LOCAL_ENDPOINT, SYS> Self_t;
 
 	DurationMs       retry_interval_;
+	DurationMs       connect_timeout_;
 	POLL_INTERFACE * poll_interface_;
-	Socket_t socket_;
+	Socket_t         socket_;
+	SocketAddress    remote_;
+	int              type_;
+	bool             connecting_;
+	bool             no_delay_;
+	uint32_t         busy_poll_usec_;
+	bool             prefer_busy_poll_;
+	uint32_t         zero_copy_threshold_;
+	TimeoutHandle    deadline_;
+
+	void setup_(LOCAL_ENDPOINT * endpoint)
+	{
+		if(poll_interface_->is_full())
+		{
+			throw std::runtime_error(
+				"ActiveSocket can not be added to poll_interface");
+		}
+
+		socket_.set(endpoint);
+		socket_.set(&poll_interface_->buffer_pool());
+		socket_.set(&poll_interface_->file_cache());
+		socket_.set(
+			std::tr1::bind(
+				&Self_t::handle_terminated_connection_,
+				this,
+				std::tr1::placeholders::_1));
+		socket_.set_reschedule_function(
+			std::tr1::bind(
+				&Self_t::reschedule_,
+				this,
+				std::tr1::placeholders::_1));
+
+		connect();
+	}
+
+	// returns true if the pending connect succeeded
+	bool finish_connect_()
+	{
+		int error = 0;
+		socklen_t len = sizeof(error);
+
+		if(not SYS::getsockopt_(
+				socket_.get_fd(), SOL_SOCKET, SO_ERROR, &error, &len) or
+		   error != 0)
+		{
+			LINUX_EPOLL_LOG_INFO(
+				"ActiveSocket connect failed: %s",
+				strerror(error));
+			retry_();
+			return false;
+		}
+
+		connecting_ = false;
+		poll_interface_->cancel_timeout(deadline_);
+		socket_.set_connected();
+		return true;
+	}
 
-	void handle_terminated_connection_(TcpSocket<LOCAL_ENDPOINT> *)
+	// a socket whose connect failed can not be connected again, so it is
+	// closed and a fresh one is opened by the next attempt
+	void close_()
 	{
+		connecting_ = false;
+
+		if(socket_.get_fd() != -1)
+		{
+			poll_interface_->remove(*this);
+			socket_.close();
+		}
+	}
+
+	void retry_()
+	{
+		close_();
+
 		poll_interface_->register_timeout(
 			retry_interval_,
 			std::tr1::bind(&Self_t::connect, this),
-			this);
+			this,
+			retry_slack(retry_interval_));
+	}
+
+	void handle_terminated_connection_(Socket_t *)
+	{
+		retry_();
+	}
+
+	void reschedule_(Socket_t *)
+	{
+		poll_interface_->schedule(*this, EPOLLIN);
 	}
 };
 
@@ -530,43 +2246,56 @@ template<
 class PassiveSocket : private SYS
 {
 public:
+	static const uint32_t DEFAULT_ACCEPT_BUDGET = 64;
+
 	PassiveSocket(
 		POLL_INTERFACE * poll_interface,
-		std::tr1::function<LOCAL_ENDPOINT *()> connect_callback,
+		Delegate<LOCAL_ENDPOINT *()> const& connect_callback,
 		uint32_t port,
 		std::string const& ip = "0.0.0.0",
-		DurationMs retry_interval = DurationMs(3000))
+		DurationMs retry_interval = DurationMs(3000),
+		bool reuse_port = false)
 	: listening_(false)
 	, poll_interface_(poll_interface)
 	, connect_callback_(connect_callback)
+	, address_(SocketAddress::inet(ip, port))
+	, type_(SOCK_STREAM)
 	, retry_interval_(retry_interval)
+	, accept_budget_(DEFAULT_ACCEPT_BUDGET)
+	, no_delay_(false)
+	, busy_poll_usec_(0)
+	, prefer_busy_poll_(false)
+	, zero_copy_threshold_(0)
+	, accept_blocked_(false)
+	, accept_retry_()
 	{
-		if(poll_interface_->is_full())
-		{
-			throw std::runtime_error(
-				"PassiveSocket can not be added to poll_interface");
-		}
-
-		memset(&addr_, 0, sizeof(struct sockaddr_in));
-		addr_.sin_addr.s_addr = inet_addr(ip.c_str());
-		addr_.sin_port        = htons(port);
-		addr_.sin_family      = AF_INET;
-
-		fd_ = socket_(AF_INET, SOCK_STREAM, 0);
-		if(fd_ == -1)
-		{
-			throw std::runtime_error(
-				std::string("acquire socket fd failed with: ") + SYS::strerror_());
-		}
-
-		int on = 1;
-		if(SYS::setsockopt_(fd_, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on)) < 0)
-		{
-			throw std::runtime_error(
-				std::string("set socket options failed with: ") + SYS::strerror_());
-		}
+		open_(reuse_port);
+	}
 
-		poll_interface_->add(*this);
+	// listens on any address, e.g. an AF_UNIX one with type SOCK_STREAM or
+	// SOCK_SEQPACKET. The listener removes its path again when it closes, a
+	// path left behind by a crashed process has to be removed beforehand.
+	PassiveSocket(
+		POLL_INTERFACE * poll_interface,
+		Delegate<LOCAL_ENDPOINT *()> const& connect_callback,
+		SocketAddress const& address,
+		int type = SOCK_STREAM,
+		DurationMs retry_interval = DurationMs(3000))
+	: listening_(false)
+	, poll_interface_(poll_interface)
+	, connect_callback_(connect_callback)
+	, address_(address)
+	, type_(type)
+	, retry_interval_(retry_interval)
+	, accept_budget_(DEFAULT_ACCEPT_BUDGET)
+	, no_delay_(false)
+	, busy_poll_usec_(0)
+	, prefer_busy_poll_(false)
+	, zero_copy_threshold_(0)
+	, accept_blocked_(false)
+	, accept_retry_()
+	{
+		open_(false);
 	}
 
 	~PassiveSocket()
@@ -593,7 +2322,7 @@ public:
 		if(not listening_)
 		{
 			process_bind_(
-				SYS::bind_(fd_, (struct sockaddr *)&addr_, sizeof(addr_)));
+				SYS::bind_(fd_, address_.get(), address_.length()));
 		}
 	}
 
@@ -602,6 +2331,12 @@ public:
 		if(listening_)
 		{
 			listening_ = false;
+
+			std::string path = address_.path();
+			if(not path.empty())
+			{
+				SYS::unlink_(path.c_str());
+			}
 		}
 
 		RemoveFunc r(poll_interface_);
@@ -609,57 +2344,52 @@ public:
 		connected_sockets_.clear();
 
 		poll_interface_->remove(*this);
-		close(fd_);
+		close();
 	}
 
 	void process_events(int event_mask)
 	{
-		if(listening_)
+		if(event_mask & EPOLLIN)
 		{
-			if(event_mask & EPOLLIN)
-			{
-				if(not connected_sockets_.is_full() and
-				   not poll_interface_->is_full())
-				{
-					struct sockaddr_in addr;
-					socklen_t len = sizeof(addr);
-					memset(&addr, 0, len);
-
-					process_accept_(
-						SYS::accept_(fd_, (struct sockaddr *) &addr, &len),
-						addr);
-
-					// int cfd = SYS::accept_(fd_, (struct sockaddr *) &addr, &len);
-
-					// if(cfd != -1)
-					// {
-					// 	Socket_t * s = connected_sockets_.add(cfd);
-					// 	poll_interface_->add(*s);
-
-					// 	s->set(addr);
-					// 	s->set(connect_callback_());
-					// 	s->set(
-					// 		std::tr1::bind(
-					// 			&Self_t::handle_terminated_connection_,
-					// 			this,
-					// 			std::tr1::placeholders::_1));
-					// 	s->set_connected();
-					// }
-					// else
-					// {
-					// 	perror("PassiveSocket accept");
-					// }
-				}
-			}
+			accept_connections_();
 		}
 	}
 
+	// connections accepted per wakeup at most, the rest is accepted after
+	// the other handlers had their turn
+	void set_accept_budget(uint32_t budget)
+	{
+		accept_budget_ = budget;
+	}
+
+	// applied to every connection accepted from now on
+	void set_no_delay(bool no_delay)
+	{
+		no_delay_ = no_delay;
+	}
+
+	// applied to every connection accepted from now on, see
+	// TcpSocket::set_busy_poll
+	void set_busy_poll(uint32_t usec, bool prefer = false)
+	{
+		busy_poll_usec_ = usec;
+		prefer_busy_poll_ = prefer;
+	}
+
+	// applied to every connection accepted from now on, see
+	// TcpSocket::set_zero_copy
+	void set_zero_copy(uint32_t threshold)
+	{
+		zero_copy_threshold_ = threshold;
+	}
+
 private:
 	using SYS::setsockopt_;
 	using SYS::bind_;
 	using SYS::listen_;
 	using SYS::socket_;
 	using SYS::accept_;
+	using SYS::accept4_;
 	using SYS::close_;
 	using SYS::strerror_;
 
@@ -668,17 +2398,24 @@ private:
 		LOCAL_ENDPOINT,
 		MAX_CONNECTIONS,
 		SYS> Self_t;
-	typedef TcpSocket<LOCAL_ENDPOINT> Socket_t;
+	typedef TcpSocket<LOCAL_ENDPOINT, SYS> Socket_t;
 
 	bool                                    listening_;
 	POLL_INTERFACE                        * poll_interface_;
-	std::tr1::function<LOCAL_ENDPOINT *()>  connect_callback_;
+	Delegate<LOCAL_ENDPOINT *()>            connect_callback_;
 	int                                     fd_;
-	sockaddr_in                             addr_;
+	SocketAddress                           address_;
+	int                                     type_;
 	DurationMs                              retry_interval_;
-	Socket_t                                socket_;
+	uint32_t                                accept_budget_;
+	bool                                    no_delay_;
+	uint32_t                                busy_poll_usec_;
+	bool                                    prefer_busy_poll_;
+	uint32_t                                zero_copy_threshold_;
+	bool                                    accept_blocked_;
+	TimeoutHandle                           accept_retry_;
 
-	List<TcpSocket<LOCAL_ENDPOINT>, MAX_CONNECTIONS>  connected_sockets_;
+	List<Socket_t, MAX_CONNECTIONS>                   connected_sockets_;
 
 
 	struct RemoveFunc
@@ -699,20 +2436,144 @@ private:
 
 	friend class RemoveFunc;
 
-	void handle_terminated_connection_(TcpSocket<LOCAL_ENDPOINT> * s)
+	void handle_terminated_connection_(Socket_t * s)
 	{
 		poll_interface_->remove(*s);
 		connected_sockets_.remove(s);
+		resume_accept_();
+	}
+
+	void open_(bool reuse_port)
+	{
+		if(poll_interface_->is_full())
+		{
+			throw std::runtime_error(
+				"PassiveSocket can not be added to poll_interface");
+		}
+
+		// non-blocking, the listener accepts until the backlog is empty
+		fd_ = socket_(address_.domain(), type_|SOCK_NONBLOCK|SOCK_CLOEXEC, 0).value();
+		if(fd_ == -1)
+		{
+			throw std::runtime_error(
+				std::string("acquire socket fd failed with: ") + SYS::strerror_());
+		}
+
+		int on = 1;
+		if(not SYS::setsockopt_(fd_, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on)))
+		{
+			throw std::runtime_error(
+				std::string("set socket options failed with: ") + SYS::strerror_());
+		}
+
+		// lets every loop of a LoopGroup bind its own listener to the same
+		// port, the kernel then distributes incoming connections among them
+		if(reuse_port and
+		   not SYS::setsockopt_(fd_, SOL_SOCKET, SO_REUSEPORT, (char*)&on, sizeof(on)))
+		{
+			throw std::runtime_error(
+				std::string("set SO_REUSEPORT failed with: ") + SYS::strerror_());
+		}
+
+		poll_interface_->add(*this);
+	}
+
+	// the listener is edge-triggered, connections left in the backlog raise
+	// no new edge, so the listener is dispatched again in the next iteration
+	void defer_accept_()
+	{
+		poll_interface_->schedule(*this, EPOLLIN);
+	}
+
+	void resume_accept_()
+	{
+		if(accept_blocked_)
+		{
+			accept_blocked_ = false;
+			defer_accept_();
+		}
+	}
+
+	// the handlers filling the loop need not be connections of this
+	// listener, so none of its own terminating may ever resume it
+	void retry_accept_()
+	{
+		poll_interface_->cancel_timeout(accept_retry_);
+		accept_retry_ = poll_interface_->register_timeout(
+			retry_interval_,
+			std::tr1::bind(&Self_t::resume_accept_, this),
+			this,
+			retry_slack(retry_interval_));
+	}
+
+	void reschedule_(Socket_t * s)
+	{
+		poll_interface_->schedule(*s, EPOLLIN);
+	}
+
+	void accept_connections_()
+	{
+		if(not listening_)
+		{
+			return;
+		}
+
+		for(uint32_t i=0; i<accept_budget_; ++i)
+		{
+			if(connected_sockets_.is_full() or poll_interface_->is_full())
+			{
+				// resumed once a connection terminates, a full loop is
+				// also checked again after retry_interval_
+				accept_blocked_ = true;
+				if(not connected_sockets_.is_full())
+				{
+					retry_accept_();
+				}
+				return;
+			}
+
+			struct sockaddr_storage addr;
+			socklen_t len = sizeof(addr);
+
+			typename SYS::Result result = SYS::accept4_(
+				fd_,
+				(struct sockaddr *) &addr,
+				&len,
+				SOCK_NONBLOCK|SOCK_CLOEXEC);
+
+			if(not result)
+			{
+				if(result.error_code() == EINTR or
+				   result.error_code() == ECONNABORTED)
+				{
+					continue;
+				}
+
+				if(result.error_code() != EAGAIN and
+				   result.error_code() != EWOULDBLOCK)
+				{
+					LINUX_EPOLL_LOG_ERROR(
+						"PassiveSocket accept failed: %s",
+						strerror(result.error_code()));
+				}
+				return;
+			}
+
+			process_accept_(result.value(), addr);
+		}
+
+		defer_accept_();
 	}
 
-	void process_bind_(SYS::Result const& result)
+	void process_bind_(typename SYS::Result const& result)
 	{
 		if(not result)
 		{
 			poll_interface_->register_timeout(
 				retry_interval_,
 				std::tr1::bind(&Self_t::added, this),
-				this);
+				this,
+				retry_slack(retry_interval_));
 			return;
 		}
 
@@ -721,26 +2582,43 @@ private:
 		listening_ = true;
 	}
 
-	void process_accept_(SYS::Result const& result, sockaddr_in const& addr)
+	void process_accept_(int fd, sockaddr_storage const& addr)
 	{
-		if(result)
-		{
-			Socket_t * s = connected_sockets_.add(result.value);
-			poll_interface_->add(*s);
+		Socket_t * s = connected_sockets_.add(fd);
+		poll_interface_->add(*s);
 
-			s->set(addr);
-			s->set(connect_callback_());
-			s->set(
-				std::tr1::bind(
-					&Self_t::handle_terminated_connection_,
-					this,
-					std::tr1::placeholders::_1));
-			s->set_connected();
+		if(addr.ss_family == AF_INET)
+		{
+			s->set(reinterpret_cast<sockaddr_in const&>(addr));
 		}
-		else
+		s->set_message_mode(type_ == SOCK_SEQPACKET);
+		s->set(&poll_interface_->buffer_pool());
+		s->set(&poll_interface_->file_cache());
+		s->set(connect_callback_());
+		s->set(
+			std::tr1::bind(
+				&Self_t::handle_terminated_connection_,
+				this,
+				std::tr1::placeholders::_1));
+		s->set_reschedule_function(
+			std::tr1::bind(
+				&Self_t::reschedule_,
+				this,
+				std::tr1::placeholders::_1));
+		if(no_delay_ and addr.ss_family == AF_INET)
+		{
+			s->set_no_delay(true);
+		}
+		if(busy_poll_usec_ != 0)
+		{
+			s->set_busy_poll(busy_poll_usec_, prefer_busy_poll_);
+		}
+		if(zero_copy_threshold_ != 0)
 		{
-			perror("PassiveSocket accept");
+			s->set_zero_copy(zero_copy_threshold_);
 		}
+
+		s->set_connected();
 	}
 };
 
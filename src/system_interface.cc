@@ -1,5 +1,6 @@
 #include "e37/system_interface.h"
 #include "util.h"
+#include "log.h"
 
 #include <deque>
 #include <vector>
@@ -21,7 +22,6 @@
 
 #include <arpa/inet.h>
 
-#include <iostream>
 
 
 namespace e37
@@ -102,7 +102,7 @@ struct Socket
 			{
 				if(errno == EINPROGRESS)
 				{
-					std::cout << "CONNECT IN PROGRESS\n";
+					LINUX_EPOLL_LOG_DEBUG("CONNECT IN PROGRESS");
 					return true;
 				}
 			}
@@ -306,24 +306,12 @@ void SystemInterface::process()
 
 	for (int n = 0; n < impl_->event_count; ++n)
 	{
-		std::cout << "process socket(" << impl_->events[n].data.fd << ") events ";
-		if((impl_->events[n].events & EPOLLHUP) != 0)
-		{
-			std::cout << "hup ";
-		}
-		else
-		{
-			if((impl_->events[n].events & EPOLLIN) != 0)
-			{
-				std::cout << "readable ";
-			}
-			if((impl_->events[n].events & EPOLLOUT) != 0)
-			{
-				std::cout << "writeable ";
-			}
-		}
-
-		std::cout << std::endl;
+		LINUX_EPOLL_LOG_TRACE(
+			"process socket(%d) events %s%s%s",
+			impl_->events[n].data.fd,
+			(impl_->events[n].events & EPOLLHUP) ? "hup " : "",
+			(impl_->events[n].events & EPOLLIN) ? "readable " : "",
+			(impl_->events[n].events & EPOLLOUT) ? "writeable " : "");
 		/*TODO: process read/write-able fds*/
 	}
 
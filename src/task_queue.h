@@ -0,0 +1,134 @@
+#pragma once
+
+#include <tr1/functional>
+
+#include <stddef.h>
+
+
+namespace linux_epoll
+{
+
+
+// Intrusive multi-producer single-consumer queue after Dmitry Vyukov. push()
+// is wait-free and may be called from any thread, run() must only be called
+// by the thread owning the loop.
+//
+// pending_ coalesces wakeups: only the push that finds it cleared reports
+// that the consumer has to be notified, so a burst of posts between two runs
+// costs a single notification.
+class TaskQueue
+{
+public:
+	TaskQueue()
+	: head_(&stub_)
+	, tail_(&stub_)
+	, pending_(false)
+	{
+		stub_.next = NULL;
+	}
+
+	~TaskQueue()
+	{
+		Node * node;
+		while((node = pop_()) != NULL)
+		{
+			delete node;
+		}
+	}
+
+	// returns true if the consumer has to be woken up
+	bool push(std::tr1::function<void()> const& task)
+	{
+		push_(new Node(task));
+		return not __atomic_exchange_n(&pending_, true, __ATOMIC_SEQ_CST);
+	}
+
+	void run()
+	{
+		// cleared before draining, a push racing with the drain either is
+		// popped below or sees the flag clear and wakes the consumer again
+		__atomic_store_n(&pending_, false, __ATOMIC_SEQ_CST);
+
+		Node * node;
+		while((node = pop_()) != NULL)
+		{
+			node->task();
+			delete node;
+		}
+	}
+
+private:
+	struct Node
+	{
+		Node()
+		: next(NULL)
+		{}
+
+		Node(std::tr1::function<void()> const& t)
+		: next(NULL)
+		, task(t)
+		{}
+
+		Node                     * next;
+		std::tr1::function<void()> task;
+	};
+
+	Node   stub_;
+	Node * head_;
+	Node * tail_;
+	bool   pending_;
+
+	void push_(Node * node)
+	{
+		__atomic_store_n(&node->next, (Node*)NULL, __ATOMIC_RELAXED);
+		Node * prev = __atomic_exchange_n(&head_, node, __ATOMIC_ACQ_REL);
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	}
+
+	// a producer that swapped head_ but has not linked its node yet is
+	// waited for, that window is only a few instructions long
+	Node * next_of_(Node * node)
+	{
+		Node * next;
+		while((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+		{}
+		return next;
+	}
+
+	Node * pop_()
+	{
+		Node * tail = tail_;
+		Node * next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+		if(tail == &stub_)
+		{
+			if(next == NULL)
+			{
+				return NULL;
+			}
+
+			tail_ = next;
+			tail = next;
+			next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+		}
+
+		if(next == NULL)
+		{
+			if(tail != __atomic_load_n(&head_, __ATOMIC_ACQUIRE))
+			{
+				next = next_of_(tail);
+			}
+			else
+			{
+				push_(&stub_);
+				next = next_of_(tail);
+			}
+		}
+
+		tail_ = next;
+		return tail;
+	}
+};
+
+
+} //namespace linux_epoll
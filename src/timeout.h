@@ -1,13 +1,14 @@
 #pragma once
 
 #include "linux_epoll/util.h"
+#include "linux_epoll/log.h"
+#include "linux_epoll/delegate.h"
 
-#include <deque>
 #include <vector>
 #include <algorithm>
-#include <tr1/functional>
 
-#include <tr1/functional>
+#include <stdint.h>
+#include <limits.h>
 #include <time.h>
 
 
@@ -29,94 +30,655 @@ struct timespec now()
 }
 
 
-struct Timeout_t
+inline
+uint64_t to_ns(struct timespec const& t)
 {
-	struct timespec deadline;
-	std::tr1::function<void()> callback;
-	void const* dependency;
-
-	Timeout_t(struct timespec const& t, std::tr1::function<void()> c, void const* d)
-	: deadline(t)
-	, callback(c)
-	, dependency(d)
+	return uint64_t(t.tv_sec) * 1000000000ull + t.tv_nsec;
+}
+
+
+// Refers to a single pending timeout. The generation is bumped every time the
+// slot is released, so a handle whose timeout has fired or was removed simply
+// stops matching and can still be passed to cancel or rearm.
+struct TimeoutHandle
+{
+	uint32_t index;
+	uint32_t generation;
+
+	TimeoutHandle()
+	: index(0xffffffff)
+	, generation(0)
 	{}
 
-	bool operator<(Timeout_t const& other) const
-	{
-		return deadline < other.deadline;
-	}
+	TimeoutHandle(uint32_t i, uint32_t g)
+	: index(i)
+	, generation(g)
+	{}
 };
 
-struct TimeoutPred
-{
-	void const* dependency;
 
-	TimeoutPred(void const* d)
-	: dependency(d)
+// Maps the dependency of a timer to the first of the timers depending on it.
+// Open addressing with linear probing and backward shift deletion, so entries
+// live in one table that only grows and adding or erasing one does not
+// allocate the way a node based map does.
+class DependencyMap
+{
+public:
+	DependencyMap()
+	: table_(16)
+	, size_(0)
 	{}
 
-	bool operator()(Timeout_t const& t)
+	uint32_t * find(void const* key)
+	{
+		uint32_t slot = locate_(key);
+		return table_[slot].used ? &table_[slot].value : NULL;
+	}
+
+	// value of key, set to initial if key was not present yet
+	uint32_t & insert(void const* key, uint32_t initial)
+	{
+		if((size_ + 1) * 2 > table_.size())
+		{
+			grow_();
+		}
+
+		uint32_t slot = locate_(key);
+		if(not table_[slot].used)
+		{
+			table_[slot].key = key;
+			table_[slot].value = initial;
+			table_[slot].used = true;
+			++size_;
+		}
+		return table_[slot].value;
+	}
+
+	void erase(void const* key)
+	{
+		uint32_t hole = locate_(key);
+		if(not table_[hole].used)
+		{
+			return;
+		}
+
+		table_[hole].used = false;
+		--size_;
+
+		// pull every entry of the following run back into the hole unless
+		// its home slot lies between the hole and where it is now
+		uint32_t mask = table_.size() - 1;
+		for(uint32_t slot = (hole + 1) & mask;
+			table_[slot].used;
+			slot = (slot + 1) & mask)
+		{
+			uint32_t home = home_of_(table_[slot].key);
+			if(((slot - home) & mask) >= ((slot - hole) & mask))
+			{
+				table_[hole] = table_[slot];
+				table_[slot].used = false;
+				hole = slot;
+			}
+		}
+	}
+
+private:
+	struct Entry
+	{
+		Entry()
+		: key(NULL)
+		, value(0)
+		, used(false)
+		{}
+
+		void const* key;
+		uint32_t    value;
+		bool        used;
+	};
+
+	std::vector<Entry> table_;
+	uint32_t           size_;
+
+	uint32_t home_of_(void const* key) const
 	{
-		if(t.dependency == dependency)
+		uint64_t hash = uint64_t(uintptr_t(key)) * 0x9e3779b97f4a7c15ull;
+		return uint32_t(hash >> 32) & (table_.size() - 1);
+	}
+
+	// slot holding key or the empty slot where it would go
+	uint32_t locate_(void const* key) const
+	{
+		uint32_t mask = table_.size() - 1;
+		uint32_t slot = home_of_(key);
+
+		while(table_[slot].used and table_[slot].key != key)
 		{
-			printf("remove timeout for %p\n", dependency);
-			return true;
+			slot = (slot + 1) & mask;
 		}
+		return slot;
+	}
 
-		return false;
+	void grow_()
+	{
+		std::vector<Entry> old(table_.size() * 2);
+		old.swap(table_);
+
+		for(uint32_t i=0; i<old.size(); ++i)
+		{
+			if(old[i].used)
+			{
+				table_[locate_(old[i].key)] = old[i];
+			}
+		}
 	}
 };
 
 
+// Hierarchical timing wheel as described by Varghese and Lauck. Level 0 has
+// one slot per tick, every further level has 64 slots which each span all
+// slots of the level below. Timers are kept in intrusive lists of a node pool,
+// so add and remove are O(1) and expiring costs O(1) per tick plus one
+// re-insert for every level a timer cascades through. Callbacks are stored
+// inline in the nodes, so once the pool has grown adding and firing a timer
+// does not allocate.
+//
+// A timer added with slack may fire up to that much later than asked for.
+// Like the kernel's timer slack its tick is moved to the most aligned tick
+// within the allowed window, so tolerant timers of different deadlines end
+// up sharing ticks and the loop wakes up less often.
 class TimeoutList
 {
 public:
+	typedef Delegate<void()> Callback_t;
+
+	TimeoutList(DurationNs resolution = DurationMs(1))
+	: tick_ns_(std::max(resolution.value, uint64_t(1)))
+	, base_ns_(to_ns(now()))
+	, current_(0)
+	, count_(0)
+	, free_(NIL)
+	{
+		for(uint32_t i=0; i<BUCKETS+1; ++i)
+		{
+			heads_[i] = NIL;
+		}
+
+		for(uint32_t i=0; i<BITMAP_WORDS; ++i)
+		{
+			occupied_[i] = 0;
+		}
+	}
 
 	template<class T>
-	void add(
-		DurationMs duration,
-		std::tr1::function<void()> callback,
-		T const* dependency)
+	TimeoutHandle add(
+		DurationNs duration,
+		Callback_t const& callback,
+		T const* dependency,
+		DurationNs slack = DurationNs(0))
+	{
+		LINUX_EPOLL_LOG_TRACE(
+			"add timeout for %p, %lluns, slack %lluns",
+			dependency,
+			duration.value,
+			slack.value);
+
+		uint32_t index = acquire_();
+		Node & node = nodes_[index];
+		node.slack = slack.value / tick_ns_;
+		node.expires = expires_(duration, node.slack);
+		node.callback = callback;
+		node.dependency = static_cast<const void*>(dependency);
+
+		link_dependency_(index);
+		link_(index, bucket_of_(node.expires));
+		++count_;
+
+		return TimeoutHandle(index, node.generation);
+	}
+
+	bool cancel(TimeoutHandle const& handle)
+	{
+		if(not is_pending(handle))
+		{
+			return false;
+		}
+
+		unlink_dependency_(handle.index);
+		unlink_(handle.index);
+		release_(handle.index);
+		return true;
+	}
+
+	bool rearm(TimeoutHandle const& handle, DurationNs duration)
+	{
+		if(not is_pending(handle))
+		{
+			return false;
+		}
+
+		unlink_(handle.index);
+		nodes_[handle.index].expires =
+			expires_(duration, nodes_[handle.index].slack);
+		link_(handle.index, bucket_of_(nodes_[handle.index].expires));
+		return true;
+	}
+
+	bool is_pending(TimeoutHandle const& handle) const
 	{
-		printf("add timeout for %p, %d\n", dependency, duration.value);
-		timeouts_.push_back(
-			Timeout_t(now()+duration, callback, static_cast<const void*>(dependency)));
-		std::sort(timeouts_.begin(), timeouts_.end());
+		return (
+			handle.index < nodes_.size() and
+			nodes_[handle.index].generation == handle.generation and
+			nodes_[handle.index].bucket != FREE);
 	}
 
 	template<class T>
 	void remove(T const* dependency)
 	{
-		timeouts_.erase(
-			std::remove_if(
-				timeouts_.begin(),
-				timeouts_.end(),
-				TimeoutPred(static_cast<const void*>(dependency))),
-			timeouts_.end());
-		std::sort(timeouts_.begin(), timeouts_.end());
+		uint32_t * head = dependencies_.find(static_cast<const void*>(dependency));
+
+		if(head == NULL)
+		{
+			return;
+		}
+
+		uint32_t index = *head;
+		dependencies_.erase(static_cast<const void*>(dependency));
+
+		while(index != NIL)
+		{
+			uint32_t next = nodes_[index].dep_next;
+			nodes_[index].dep_prev = NIL;
+			nodes_[index].dep_next = NIL;
+			unlink_(index);
+			release_(index);
+			index = next;
+		}
+	}
+
+	// absolute CLOCK_MONOTONIC time of the next tick that has work to do
+	bool next_deadline(struct timespec & deadline) const
+	{
+		if(count_ == 0)
+		{
+			return false;
+		}
+
+		deadline = make_ts(DurationNs(base_ns_ + next_event_tick_() * tick_ns_));
+		return true;
 	}
 
 	int wait_interval()
 	{
-		if(not timeouts_.empty())
+		if(count_ == 0)
 		{
-			return (timeouts_.front().deadline - now()).value;
+			return -1;
 		}
 
-		return -1;
+		uint64_t deadline = base_ns_ + next_event_tick_() * tick_ns_;
+		uint64_t current = to_ns(now());
+
+		if(deadline <= current)
+		{
+			return 0;
+		}
+
+		return std::min(
+			(deadline - current + 999999) / 1000000,
+			uint64_t(INT_MAX));
 	}
 
 	void process()
 	{
-		while(wait_interval() == 0)
+		IgnoreFired ignore;
+		process(ignore);
+	}
+
+	// OBSERVER::timer_fired(deadline_ns) is called before every callback
+	template<class OBSERVER>
+	void process(OBSERVER & observer)
+	{
+		uint64_t target = (to_ns(now()) - base_ns_) / tick_ns_;
+
+		while(count_ != 0)
 		{
-			timeouts_.front().callback();
-			timeouts_.pop_front();
+			uint64_t next = next_event_tick_();
+
+			if(next > target)
+			{
+				break;
+			}
+
+			current_ = next;
+			run_tick_(observer);
 		}
+
+		current_ = std::max(current_, target + 1);
+	}
+
+	uint32_t count() const
+	{
+		return count_;
 	}
 
 private:
-	std::deque<Timeout_t> timeouts_;
+	struct IgnoreFired
+	{
+		void timer_fired(uint64_t)
+		{}
+	};
+
+	static const uint32_t NIL          = 0xffffffff;
+	static const uint32_t LEVELS       = 5;
+	static const uint32_t ROOT_BITS    = 8;
+	static const uint32_t LEVEL_BITS   = 6;
+	static const uint32_t ROOT_SLOTS   = 1 << ROOT_BITS;
+	static const uint32_t LEVEL_SLOTS  = 1 << LEVEL_BITS;
+	static const uint32_t BUCKETS      = ROOT_SLOTS + (LEVELS-1) * LEVEL_SLOTS;
+	static const uint32_t EXPIRING     = BUCKETS;
+	static const uint32_t FREE         = BUCKETS + 1;
+	static const uint32_t BITMAP_WORDS = BUCKETS / 64;
+
+	struct Node
+	{
+		uint64_t                   expires;
+		uint64_t                   slack;
+		Callback_t                 callback;
+		void const*                dependency;
+		uint32_t                   generation;
+		uint32_t                   bucket;
+		uint32_t                   prev;
+		uint32_t                   next;
+		uint32_t                   dep_prev;
+		uint32_t                   dep_next;
+	};
+
+	uint64_t          tick_ns_;
+	uint64_t          base_ns_;
+	uint64_t          current_;
+	uint32_t          count_;
+	uint32_t          free_;
+	uint32_t          heads_[BUCKETS+1];
+	uint64_t          occupied_[BITMAP_WORDS];
+	std::vector<Node> nodes_;
+	DependencyMap     dependencies_;
+
+	static uint32_t shift_of_(uint32_t level)
+	{
+		return ROOT_BITS + (level-1) * LEVEL_BITS;
+	}
+
+	static uint32_t level_bucket_(uint32_t level, uint32_t slot)
+	{
+		return ROOT_SLOTS + (level-1) * LEVEL_SLOTS + slot;
+	}
+
+	uint64_t expires_(DurationNs duration, uint64_t slack) const
+	{
+		uint64_t ticks =
+			(to_ns(now()) - base_ns_ + duration.value + tick_ns_ - 1) / tick_ns_;
+		ticks = std::max(ticks, current_);
+
+		if(slack == 0)
+		{
+			return ticks;
+		}
+
+		// clear every bit below the highest one that differs between the
+		// earliest and the latest tick, which yields the tick in the window
+		// with the most trailing zeros
+		uint64_t latest = ticks + slack;
+		uint64_t mask = (uint64_t(1) << (63 - __builtin_clzll(ticks ^ latest))) - 1;
+		return latest & ~mask;
+	}
+
+	uint32_t bucket_of_(uint64_t expires) const
+	{
+		uint64_t delta = expires - current_;
+
+		if(delta < ROOT_SLOTS)
+		{
+			return expires & (ROOT_SLOTS-1);
+		}
+
+		for(uint32_t level=1; level<LEVELS-1; ++level)
+		{
+			if(delta < (uint64_t(1) << shift_of_(level+1)))
+			{
+				return level_bucket_(
+					level,
+					(expires >> shift_of_(level)) & (LEVEL_SLOTS-1));
+			}
+		}
+
+		// timers beyond the range of the top level park in its last slot
+		// relative to now and get re-sorted every time it cascades
+		uint64_t limit = (uint64_t(1) << shift_of_(LEVELS)) - 1;
+
+		return level_bucket_(
+			LEVELS-1,
+			((current_ + std::min(delta, limit)) >> shift_of_(LEVELS-1)) &
+				(LEVEL_SLOTS-1));
+	}
+
+	// distance from pos to the next set bit in a circular bitmap of size bits
+	static int next_set_(uint64_t const* words, uint32_t bits, uint32_t pos)
+	{
+		for(uint32_t n=0; n<bits; )
+		{
+			uint32_t i = (pos + n) & (bits-1);
+			uint64_t w = words[i >> 6] >> (i & 63);
+
+			if(w)
+			{
+				uint32_t d = n + __builtin_ctzll(w);
+				if(d < bits)
+				{
+					return d;
+				}
+			}
+
+			n += 64 - (i & 63);
+		}
+
+		return -1;
+	}
+
+	// first tick at which either a level 0 slot expires or a non empty slot
+	// of a higher level cascades; all ticks before it are no-ops
+	uint64_t next_event_tick_() const
+	{
+		uint64_t result = ~uint64_t(0);
+
+		int d = next_set_(
+			occupied_,
+			ROOT_SLOTS,
+			current_ & (ROOT_SLOTS-1));
+
+		if(d != -1)
+		{
+			result = current_ + d;
+		}
+
+		for(uint32_t level=1; level<LEVELS; ++level)
+		{
+			uint32_t shift = shift_of_(level);
+			uint64_t first = ((current_ + (uint64_t(1) << shift) - 1) >> shift) << shift;
+
+			d = next_set_(
+				&occupied_[level_bucket_(level, 0) / 64],
+				LEVEL_SLOTS,
+				(first >> shift) & (LEVEL_SLOTS-1));
+
+			if(d != -1)
+			{
+				result = std::min(result, first + (uint64_t(d) << shift));
+			}
+		}
+
+		return result;
+	}
+
+	template<class OBSERVER>
+	void run_tick_(OBSERVER & observer)
+	{
+		for(uint32_t level=1; level<LEVELS; ++level)
+		{
+			uint32_t shift = shift_of_(level);
+
+			if(current_ & ((uint64_t(1) << shift) - 1))
+			{
+				break;
+			}
+
+			cascade_(level_bucket_(level, (current_ >> shift) & (LEVEL_SLOTS-1)));
+		}
+
+		uint32_t bucket = current_ & (ROOT_SLOTS-1);
+		while(heads_[bucket] != NIL)
+		{
+			uint32_t index = heads_[bucket];
+			unlink_(index);
+			link_(index, EXPIRING);
+		}
+
+		++current_;
+
+		// callbacks may add or remove timers, so the expiring list is popped
+		// one by one instead of being walked
+		while(heads_[EXPIRING] != NIL)
+		{
+			uint32_t index = heads_[EXPIRING];
+			uint64_t deadline = base_ns_ + nodes_[index].expires * tick_ns_;
+			Callback_t callback(nodes_[index].callback);
+
+			unlink_dependency_(index);
+			unlink_(index);
+			release_(index);
+
+			observer.timer_fired(deadline);
+			callback();
+		}
+	}
+
+	void cascade_(uint32_t bucket)
+	{
+		uint32_t index = heads_[bucket];
+		heads_[bucket] = NIL;
+		occupied_[bucket / 64] &= ~(uint64_t(1) << (bucket % 64));
+
+		while(index != NIL)
+		{
+			uint32_t next = nodes_[index].next;
+			link_(index, bucket_of_(nodes_[index].expires));
+			index = next;
+		}
+	}
+
+	void link_(uint32_t index, uint32_t bucket)
+	{
+		Node & node = nodes_[index];
+		node.bucket = bucket;
+		node.prev = NIL;
+		node.next = heads_[bucket];
+
+		if(node.next != NIL)
+		{
+			nodes_[node.next].prev = index;
+		}
+
+		heads_[bucket] = index;
+
+		if(bucket != EXPIRING)
+		{
+			occupied_[bucket / 64] |= uint64_t(1) << (bucket % 64);
+		}
+	}
+
+	void unlink_(uint32_t index)
+	{
+		Node & node = nodes_[index];
+
+		if(node.prev != NIL)
+		{
+			nodes_[node.prev].next = node.next;
+		}
+		else
+		{
+			heads_[node.bucket] = node.next;
+
+			if(node.next == NIL and node.bucket != EXPIRING)
+			{
+				occupied_[node.bucket / 64] &= ~(uint64_t(1) << (node.bucket % 64));
+			}
+		}
+
+		if(node.next != NIL)
+		{
+			nodes_[node.next].prev = node.prev;
+		}
+	}
+
+	void link_dependency_(uint32_t index)
+	{
+		Node & node = nodes_[index];
+		uint32_t & head = dependencies_.insert(node.dependency, NIL);
+
+		node.dep_prev = NIL;
+		node.dep_next = head;
+
+		if(head != NIL)
+		{
+			nodes_[head].dep_prev = index;
+		}
+		head = index;
+	}
+
+	void unlink_dependency_(uint32_t index)
+	{
+		Node & node = nodes_[index];
+
+		if(node.dep_prev != NIL)
+		{
+			nodes_[node.dep_prev].dep_next = node.dep_next;
+		}
+		else if(node.dep_next != NIL)
+		{
+			*dependencies_.find(node.dependency) = node.dep_next;
+		}
+		else
+		{
+			dependencies_.erase(node.dependency);
+		}
+
+		if(node.dep_next != NIL)
+		{
+			nodes_[node.dep_next].dep_prev = node.dep_prev;
+		}
+	}
+
+	uint32_t acquire_()
+	{
+		if(free_ == NIL)
+		{
+			nodes_.push_back(Node());
+			nodes_.back().generation = 0;
+			return nodes_.size() - 1;
+		}
+
+		uint32_t index = free_;
+		free_ = nodes_[index].next;
+		return index;
+	}
+
+	void release_(uint32_t index)
+	{
+		nodes_[index].callback.reset();
+		nodes_[index].bucket = FREE;
+		++nodes_[index].generation;
+		nodes_[index].next = free_;
+		free_ = index;
+		--count_;
+	}
 };
 
 
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "linux_epoll/util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/timerfd.h>
+
+
+namespace linux_epoll
+{
+
+
+enum TimerMode
+{
+	// timeouts are passed to epoll_wait in whole milliseconds
+	CoarseTimers,
+	// the next deadline is armed on a timerfd and epoll_wait blocks on it
+	PreciseTimers
+};
+
+
+class TimerFd
+{
+public:
+	TimerFd()
+	: fd_(-1)
+	, armed_(false)
+	{}
+
+	~TimerFd()
+	{
+		close();
+	}
+
+	void open()
+	{
+		if(fd_ == -1)
+		{
+			fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+			if(fd_ == -1)
+			{
+				perror("timerfd_create");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	void close()
+	{
+		if(fd_ != -1)
+		{
+			::close(fd_);
+			fd_ = -1;
+			armed_ = false;
+		}
+	}
+
+	// deadline is an absolute CLOCK_MONOTONIC time; re-arming with the
+	// deadline that is already set costs no syscall
+	void arm(struct timespec const& deadline)
+	{
+		if(armed_ and deadline == deadline_)
+		{
+			return;
+		}
+
+		struct itimerspec its = make_its(deadline);
+
+		if(timerfd_settime(fd_, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+		{
+			perror("timerfd_settime");
+			exit(EXIT_FAILURE);
+		}
+
+		deadline_ = deadline;
+		armed_ = true;
+	}
+
+	int get_fd() const
+	{
+		return fd_;
+	}
+
+	void added()
+	{}
+
+	void removed()
+	{}
+
+	void process_events(int /*event_mask*/)
+	{
+		uint64_t expirations = 0;
+
+		if(::read(fd_, &expirations, sizeof(expirations)) == sizeof(expirations))
+		{
+			armed_ = false;
+		}
+	}
+
+private:
+	int             fd_;
+	bool            armed_;
+	struct timespec deadline_;
+};
+
+
+} //namespace linux_epoll
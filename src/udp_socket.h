@@ -0,0 +1,638 @@
+#pragma once
+#include "linux_epoll/util.h"
+#include "linux_epoll/log.h"
+#include "linux_epoll/delegate.h"
+#include "linux_epoll/sockets.h"
+
+#include <tr1/functional>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+// not known to older C library headers
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+
+
+
+namespace linux_epoll
+{
+
+
+
+/* EXAMPLE:
+struct LocalEndpoint
+{
+	// one batch of received datagrams, valid during the call only
+	void process_datagrams(Datagram const* datagrams, uint32_t count) = 0;
+
+	void set_send_function(DatagramSendFunction_t const& send_)
+	{
+		send = send_;
+	}
+
+	// queues a datagram to be sent with the next sendmmsg, false if it was
+	// dropped because the send queue is full or it is too large
+	DatagramSendFunction_t send;
+};*/
+
+
+struct Datagram
+{
+	sockaddr_in const* from;
+	uint8_t const*     data;
+	uint32_t           size;
+};
+
+
+typedef Delegate<bool(sockaddr_in const&, uint8_t const*, uint32_t)>
+	DatagramSendFunction_t;
+
+
+// Datagram socket that receives with recvmmsg(2) and sends with sendmmsg(2),
+// batch_size messages per call, and hands every received batch to the
+// endpoint in a single call.
+//
+// Sent datagrams are queued and flushed once batch_size are queued or at the
+// end of the loop iteration, when the socket is dispatched from the loop's
+// ready-list. A datagram the kernel does not take waits for EPOLLOUT, while
+// the queue is full further datagrams are dropped.
+//
+// With GRO the kernel coalesces datagrams of a flow into one receive buffer,
+// they are split up again before delivery. With GSO queued datagrams of the
+// same size to the same destination leave as one message carrying
+// UDP_SEGMENT and are split up by the kernel or the device.
+template<
+	class POLL_INTERFACE,
+	class LOCAL_ENDPOINT,
+	class SYS = SystemFunctions>
+class UdpSocket : private SYS
+{
+public:
+	typedef UdpSocket<POLL_INTERFACE, LOCAL_ENDPOINT, SYS> Self_t;
+
+	static const uint32_t DEFAULT_BATCH_SIZE    = 64;
+	static const uint32_t DEFAULT_DATAGRAM_SIZE = 2048;
+	static const uint32_t DEFAULT_READ_BUDGET   = 1024;
+	static const uint32_t DEFAULT_QUEUE_LIMIT   = 4096;
+
+	// largest UDP payload over IPv4, also what one GRO buffer may carry
+	static const uint32_t MAX_DATAGRAM_SIZE = 65507;
+
+	// port 0 binds an ephemeral port, e.g. for a socket that only sends
+	UdpSocket(
+		POLL_INTERFACE * poll_interface,
+		LOCAL_ENDPOINT * endpoint,
+		uint16_t port,
+		std::string const& ip = "0.0.0.0",
+		uint32_t batch_size = DEFAULT_BATCH_SIZE)
+	: poll_interface_(poll_interface)
+	, endpoint_(endpoint)
+	, datagram_size_(DEFAULT_DATAGRAM_SIZE)
+	, read_budget_(DEFAULT_READ_BUDGET)
+	, queue_limit_(DEFAULT_QUEUE_LIMIT)
+	, gro_(false)
+	, gso_(false)
+	, send_head_(0)
+	{
+		if(poll_interface_->is_full())
+		{
+			throw std::runtime_error(
+				"UdpSocket can not be added to poll_interface");
+		}
+
+		memset(&addr_, 0, sizeof(addr_));
+		addr_.sin_addr.s_addr = inet_addr(ip.c_str());
+		addr_.sin_port        = htons(port);
+		addr_.sin_family      = AF_INET;
+
+		fd_ = SYS::socket_(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0).value();
+		if(fd_ == -1)
+		{
+			throw std::runtime_error(
+				std::string("acquire socket fd failed with: ") + SYS::strerror_());
+		}
+
+		if(not SYS::bind_(fd_, (struct sockaddr *)&addr_, sizeof(addr_)))
+		{
+			std::string error(SYS::strerror_());
+			SYS::close_(fd_);
+			throw std::runtime_error("bind failed with: " + error);
+		}
+
+		set_batch_size(batch_size);
+
+		endpoint_->set_send_function(
+			std::tr1::bind(
+				&Self_t::send,
+				this,
+				std::tr1::placeholders::_1,
+				std::tr1::placeholders::_2,
+				std::tr1::placeholders::_3));
+
+		poll_interface_->add(*this);
+	}
+
+	~UdpSocket()
+	{
+		poll_interface_->remove(*this);
+		SYS::close_(fd_);
+	}
+
+	int get_fd() const
+	{
+		return fd_;
+	}
+
+	void added()
+	{}
+
+	void removed()
+	{}
+
+	// messages per recvmmsg and sendmmsg call
+	void set_batch_size(uint32_t batch_size)
+	{
+		batch_size_ = std::max(batch_size, uint32_t(1));
+		resize_receive_();
+	}
+
+	// receive buffer per message, larger datagrams are dropped
+	void set_datagram_size(uint32_t size)
+	{
+		datagram_size_ = std::min(std::max(size, uint32_t(1)), MAX_DATAGRAM_SIZE);
+		resize_receive_();
+	}
+
+	// datagrams received per dispatch before the socket yields to the other
+	// handlers, the rest is read when the loop dispatches it again
+	void set_read_budget(uint32_t datagrams)
+	{
+		read_budget_ = std::max(datagrams, uint32_t(1));
+	}
+
+	// datagrams queued for sending at most
+	void set_queue_limit(uint32_t datagrams)
+	{
+		queue_limit_ = datagrams;
+	}
+
+	// lets the kernel coalesce received datagrams of a flow, every receive
+	// buffer then has room for MAX_DATAGRAM_SIZE; false if not supported
+	bool set_gro(bool gro)
+	{
+		int on = gro;
+		typename SYS::Result result =
+			SYS::setsockopt_(fd_, SOL_UDP, UDP_GRO, (char*)&on, sizeof(on));
+
+		if(not result)
+		{
+			LINUX_EPOLL_LOG_WARNING(
+				"fd:%d setting UDP_GRO failed with: %s",
+				fd_,
+				result.error_description());
+			return false;
+		}
+
+		gro_ = gro;
+		resize_receive_();
+		return true;
+	}
+
+	// sends runs of queued datagrams of equal size to the same destination
+	// as one message with UDP_SEGMENT
+	void set_gso(bool gso)
+	{
+		gso_ = gso;
+	}
+
+	void process_events(int event_mask)
+	{
+		if(event_mask & EPOLLIN)
+		{
+			receive_();
+		}
+
+		if(event_mask & EPOLLOUT)
+		{
+			flush();
+		}
+	}
+
+	// queues a datagram, it is sent with the next flush; false if it was
+	// dropped
+	bool send(sockaddr_in const& to, uint8_t const* data, uint32_t size)
+	{
+		if(size > MAX_DATAGRAM_SIZE or
+		   send_queue_.size() - send_head_ >= queue_limit_)
+		{
+			return false;
+		}
+
+		if(send_queue_.size() == send_head_)
+		{
+			// flushed from the ready-list at the end of this iteration
+			poll_interface_->schedule(*this, EPOLLOUT);
+		}
+
+		Outgoing outgoing;
+		outgoing.to = to;
+		outgoing.offset = send_data_.size();
+		outgoing.size = size;
+		send_queue_.push_back(outgoing);
+		send_data_.insert(send_data_.end(), data, data + size);
+
+		// while the kernel takes nothing, EPOLLOUT resumes the flush
+		if((send_queue_.size() - send_head_) % batch_size_ == 0)
+		{
+			flush();
+		}
+		return true;
+	}
+
+	// sends the queued datagrams until the kernel stops taking them
+	void flush()
+	{
+		while(send_head_ < send_queue_.size())
+		{
+			uint32_t count = prepare_send_();
+
+			typename SYS::Result result =
+				SYS::sendmmsg_(fd_, &send_msgs_[0], count, 0);
+
+			if(result)
+			{
+				for(int i=0; i<result.value(); ++i)
+				{
+					send_head_ += segments_[i];
+				}
+				continue;
+			}
+
+			if(would_block_(result))
+			{
+				compact_();
+				return;
+			}
+
+			// without checksum offload the device can not segment
+			if(gso_ and result.error_code() == EIO)
+			{
+				LINUX_EPOLL_LOG_WARNING(
+					"fd:%d UDP_SEGMENT not supported, sending unsegmented",
+					fd_);
+				gso_ = false;
+				continue;
+			}
+
+			// the error concerns the first message only, e.g. an ICMP error
+			// reported for an earlier datagram or EMSGSIZE
+			LINUX_EPOLL_LOG_DEBUG(
+				"fd:%d sendmmsg failed, dropping a message: %s",
+				fd_,
+				result.error_description());
+			send_head_ += segments_[0];
+		}
+
+		compact_();
+	}
+
+private:
+	// GSO limit of segments per message
+	static const uint32_t MAX_SEGMENTS = 64;
+
+	struct Outgoing
+	{
+		sockaddr_in to;
+		uint32_t    offset;
+		uint32_t    size;
+	};
+
+	// room for the UDP_GRO and UDP_SEGMENT control messages
+	union Control
+	{
+		struct cmsghdr align;
+		char           buffer[CMSG_SPACE(sizeof(int))];
+	};
+
+	POLL_INTERFACE          * poll_interface_;
+	LOCAL_ENDPOINT          * endpoint_;
+	int                       fd_;
+	sockaddr_in               addr_;
+	uint32_t                  batch_size_;
+	uint32_t                  datagram_size_;
+	uint32_t                  read_budget_;
+	uint32_t                  queue_limit_;
+	bool                      gro_;
+	bool                      gso_;
+
+	std::vector<uint8_t>      recv_data_;
+	std::vector<mmsghdr>      recv_msgs_;
+	std::vector<iovec>        recv_iov_;
+	std::vector<sockaddr_in>  recv_names_;
+	std::vector<Control>      recv_control_;
+	std::vector<Datagram>     datagrams_;
+
+	std::vector<uint8_t>      send_data_;
+	std::vector<Outgoing>     send_queue_;
+	uint32_t                  send_head_;
+	std::vector<mmsghdr>      send_msgs_;
+	std::vector<iovec>        send_iov_;
+	std::vector<Control>      send_control_;
+	std::vector<uint32_t>     segments_;
+
+	static bool would_block_(typename SYS::Result const& result)
+	{
+		return (
+			result.error_code() == EAGAIN or
+			result.error_code() == EWOULDBLOCK);
+	}
+
+	// drops the sent datagrams so a queue that never fully drains does
+	// not keep growing, the rest moves to the front
+	void compact_()
+	{
+		if(send_head_ == send_queue_.size())
+		{
+			send_queue_.clear();
+			send_data_.clear();
+			send_head_ = 0;
+			return;
+		}
+
+		if(send_head_ == 0)
+		{
+			return;
+		}
+
+		uint32_t base = send_queue_[send_head_].offset;
+		send_data_.erase(send_data_.begin(), send_data_.begin() + base);
+		send_queue_.erase(
+			send_queue_.begin(),
+			send_queue_.begin() + send_head_);
+		send_head_ = 0;
+
+		for(size_t i=0; i<send_queue_.size(); ++i)
+		{
+			send_queue_[i].offset -= base;
+		}
+	}
+
+	uint32_t buffer_size_() const
+	{
+		return gro_ ? MAX_DATAGRAM_SIZE : datagram_size_;
+	}
+
+	void resize_receive_()
+	{
+		recv_data_.resize(batch_size_ * buffer_size_());
+		recv_msgs_.resize(batch_size_);
+		recv_iov_.resize(batch_size_);
+		recv_names_.resize(batch_size_);
+		recv_control_.resize(batch_size_);
+
+		send_msgs_.resize(batch_size_);
+		send_control_.resize(batch_size_);
+		segments_.resize(batch_size_);
+	}
+
+	// recvmmsg overwrites the lengths, so they are reset before every call
+	void prepare_receive_()
+	{
+		uint32_t size = buffer_size_();
+
+		for(uint32_t i=0; i<batch_size_; ++i)
+		{
+			recv_iov_[i].iov_base = &recv_data_[i * size];
+			recv_iov_[i].iov_len = size;
+
+			msghdr & msg = recv_msgs_[i].msg_hdr;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_name = &recv_names_[i];
+			msg.msg_namelen = sizeof(sockaddr_in);
+			msg.msg_iov = &recv_iov_[i];
+			msg.msg_iovlen = 1;
+
+			if(gro_)
+			{
+				msg.msg_control = recv_control_[i].buffer;
+				msg.msg_controllen = sizeof(recv_control_[i].buffer);
+			}
+		}
+	}
+
+	// a batch shorter than requested means the socket is drained, data
+	// arriving later raises a new edge
+	void receive_()
+	{
+		uint32_t left = read_budget_;
+
+		while(true)
+		{
+			prepare_receive_();
+
+			typename SYS::Result result =
+				SYS::recvmmsg_(fd_, &recv_msgs_[0], batch_size_, 0, NULL);
+
+			if(not result)
+			{
+				if(not would_block_(result))
+				{
+					// a pending socket error is reported once, what was
+					// queued behind it is read in the next iteration
+					LINUX_EPOLL_LOG_DEBUG(
+						"fd:%d recvmmsg failed: %s",
+						fd_,
+						result.error_description());
+					poll_interface_->schedule(*this, EPOLLIN);
+				}
+				return;
+			}
+
+			deliver_(result.value());
+
+			if(uint32_t(result.value()) < batch_size_)
+			{
+				return;
+			}
+
+			if(uint32_t(result.value()) >= left)
+			{
+				poll_interface_->schedule(*this, EPOLLIN);
+				return;
+			}
+			left -= result.value();
+		}
+	}
+
+	void deliver_(uint32_t count)
+	{
+		datagrams_.clear();
+
+		for(uint32_t i=0; i<count; ++i)
+		{
+			msghdr & msg = recv_msgs_[i].msg_hdr;
+			uint32_t length = recv_msgs_[i].msg_len;
+
+			if(msg.msg_flags & MSG_TRUNC)
+			{
+				LINUX_EPOLL_LOG_DEBUG(
+					"fd:%d dropped a datagram larger than %u bytes",
+					fd_,
+					buffer_size_());
+				continue;
+			}
+
+			uint32_t segment = gro_ ? gro_segment_(msg) : 0;
+			if(segment == 0 or segment > length)
+			{
+				segment = length;
+			}
+
+			uint8_t const* data = (uint8_t const*)recv_iov_[i].iov_base;
+			uint32_t offset = 0;
+
+			do
+			{
+				Datagram datagram;
+				datagram.from = &recv_names_[i];
+				datagram.data = data + offset;
+				datagram.size = std::min(segment, length - offset);
+				datagrams_.push_back(datagram);
+
+				offset += datagram.size;
+			} while(offset < length);
+		}
+
+		if(not datagrams_.empty())
+		{
+			endpoint_->process_datagrams(&datagrams_[0], datagrams_.size());
+		}
+	}
+
+	// size of the datagrams the kernel coalesced into msg, 0 if it did not
+	static uint32_t gro_segment_(msghdr & msg)
+	{
+		for(struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if(cmsg->cmsg_level == SOL_UDP and cmsg->cmsg_type == UDP_GRO)
+			{
+				int size;
+				memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+				return size;
+			}
+		}
+		return 0;
+	}
+
+	// fills up to batch_size messages from the front of the queue, returns
+	// their count; segments_ records how many datagrams each one carries
+	uint32_t prepare_send_()
+	{
+		send_iov_.resize(send_queue_.size() - send_head_);
+
+		uint32_t count = 0;
+		uint32_t next = send_head_;
+
+		while(count < batch_size_ and next < send_queue_.size())
+		{
+			Outgoing const& first = send_queue_[next];
+			uint32_t segments = gso_ ? run_length_(next) : 1;
+
+			for(uint32_t i=0; i<segments; ++i)
+			{
+				Outgoing const& outgoing = send_queue_[next + i];
+				iovec & iov = send_iov_[next + i - send_head_];
+				iov.iov_base = &send_data_[0] + outgoing.offset;
+				iov.iov_len = outgoing.size;
+			}
+
+			msghdr & msg = send_msgs_[count].msg_hdr;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_name = const_cast<sockaddr_in*>(&first.to);
+			msg.msg_namelen = sizeof(sockaddr_in);
+			msg.msg_iov = &send_iov_[next - send_head_];
+			msg.msg_iovlen = segments;
+
+			if(segments > 1)
+			{
+				msg.msg_control = send_control_[count].buffer;
+				msg.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+				struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+				uint16_t size = first.size;
+				memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+			}
+
+			segments_[count] = segments;
+			next += segments;
+			++count;
+		}
+
+		return count;
+	}
+
+	// datagrams from first on that can leave as one segmented message: all
+	// of the same size and destination, only the last may be shorter
+	uint32_t run_length_(uint32_t first) const
+	{
+		Outgoing const& head = send_queue_[first];
+		uint32_t total = head.size;
+		uint32_t count = 1;
+
+		while(count < MAX_SEGMENTS and first + count < send_queue_.size())
+		{
+			Outgoing const& outgoing = send_queue_[first + count];
+
+			if(outgoing.size > head.size or
+			   outgoing.size == 0 or
+			   total + outgoing.size > MAX_DATAGRAM_SIZE or
+			   outgoing.to.sin_addr.s_addr != head.to.sin_addr.s_addr or
+			   outgoing.to.sin_port != head.to.sin_port)
+			{
+				break;
+			}
+
+			total += outgoing.size;
+			++count;
+
+			if(outgoing.size < head.size)
+			{
+				break;
+			}
+		}
+
+		return count;
+	}
+};
+
+
+} //namespace linux_epoll
@@ -0,0 +1,987 @@
+#pragma once
+
+#include <list>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#ifndef IORING_SETUP_CLAMP
+#define IORING_SETUP_CLAMP (1U << 4)
+#endif
+
+namespace linux_epoll
+{
+
+
+// Backend of Epoll on top of io_uring, drop-in for EpollPoller.
+//
+// Registrations are multishot IORING_OP_POLL_ADD requests and removals are
+// IORING_OP_POLL_REMOVE requests. Both are only queued in the submission ring
+// and go to the kernel together with the next wait(), so registering,
+// unregistering and waiting for events costs a single io_uring_enter. The
+// timeout is passed along with that call (IORING_ENTER_EXT_ARG) or, on
+// kernels without it, as a linked IORING_OP_TIMEOUT request.
+//
+// io_uring polls are edge-triggered, EPOLLET is implied. EPOLLONESHOT arms a
+// single-shot poll, and as with epoll nothing more is reported for the fd
+// until it is removed and added again.
+//
+// A handler added with an event mask of 0 gets no poll. It submits its I/O
+// itself with recv(), send(), accept() and connect(), the completions are
+// queued for it and it takes them with next() when it is dispatched, see
+// UringTcpSocket. Received data lands in buffers the kernel picks from a
+// group provided by the poller, registered as a buffer ring or before 5.19
+// with IORING_OP_PROVIDE_BUFFERS. Receives and accepts are multishot where
+// the kernel supports it, one request then completes for every message or
+// connection. These requests go to the kernel with the same io_uring_enter.
+class UringPoller
+{
+public:
+	// the requests of a handler, see next()
+	enum Op
+	{
+		POLL,
+		RECV,
+		ACCEPT,
+		SEND,
+		CONNECT
+	};
+
+	// result is what the syscall would have returned, or -errno: the bytes
+	// received or sent, the accepted fd, 0 for a connect. The bytes received
+	// are at data, which stays valid until the next wait().
+	struct Completion
+	{
+		Op              op;
+		int32_t         result;
+		uint8_t const * data;
+	};
+
+	static const uint32_t DEFAULT_BUFFER_COUNT = 256;
+	static const uint32_t DEFAULT_BUFFER_SIZE  = 16 * 1024;
+
+	UringPoller()
+	: fd_(-1)
+	, sq_ring_(MAP_FAILED)
+	, cq_ring_(MAP_FAILED)
+	, sqes_(MAP_FAILED)
+	, to_submit_(0)
+	, batch_(0)
+	, buffer_ring_(MAP_FAILED)
+	, buffer_count_(DEFAULT_BUFFER_COUNT)
+	, buffer_size_(DEFAULT_BUFFER_SIZE)
+	, buffer_tail_(0)
+	, multishot_recv_(true)
+	, multishot_accept_(true)
+	{}
+
+	~UringPoller()
+	{
+		if(buffer_ring_ != MAP_FAILED)
+		{
+			munmap(buffer_ring_, buffer_count_ * sizeof(io_uring_buf));
+		}
+
+		if(sqes_ != MAP_FAILED)
+		{
+			munmap(sqes_, sqes_size_);
+		}
+
+		if(cq_ring_ != MAP_FAILED and cq_ring_ != sq_ring_)
+		{
+			munmap(cq_ring_, cq_ring_size_);
+		}
+
+		if(sq_ring_ != MAP_FAILED)
+		{
+			munmap(sq_ring_, sq_ring_size_);
+		}
+
+		if(fd_ != -1)
+		{
+			::close(fd_);
+		}
+	}
+
+	void open(uint32_t size)
+	{
+		memset(&params_, 0, sizeof(params_));
+
+		// large loops get the biggest ring the kernel allows instead of
+		// EINVAL, get_sqe_() submits early whenever the ring runs full
+		params_.flags |= IORING_SETUP_CLAMP;
+
+		// every registration needs at most one request per iteration
+		fd_ = syscall(__NR_io_uring_setup, size + 2, &params_);
+		if(fd_ == -1)
+		{
+			perror("io_uring_setup");
+			exit(EXIT_FAILURE);
+		}
+
+		sq_ring_size_ =
+			params_.sq_off.array + params_.sq_entries * sizeof(uint32_t);
+		cq_ring_size_ =
+			params_.cq_off.cqes + params_.cq_entries * sizeof(io_uring_cqe);
+
+		if(params_.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			sq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+			cq_ring_size_ = sq_ring_size_;
+		}
+
+		sq_ring_ = map_(sq_ring_size_, IORING_OFF_SQ_RING);
+		cq_ring_ = (params_.features & IORING_FEAT_SINGLE_MMAP) ?
+			sq_ring_ :
+			map_(cq_ring_size_, IORING_OFF_CQ_RING);
+
+		sqes_size_ = params_.sq_entries * sizeof(io_uring_sqe);
+		sqes_ = map_(sqes_size_, IORING_OFF_SQES);
+
+		char * sq = static_cast<char*>(sq_ring_);
+		sq_head_  = reinterpret_cast<uint32_t*>(sq + params_.sq_off.head);
+		sq_tail_  = reinterpret_cast<uint32_t*>(sq + params_.sq_off.tail);
+		sq_mask_  = *reinterpret_cast<uint32_t*>(sq + params_.sq_off.ring_mask);
+		sq_array_ = reinterpret_cast<uint32_t*>(sq + params_.sq_off.array);
+
+		char * cq = static_cast<char*>(cq_ring_);
+		cq_head_  = reinterpret_cast<uint32_t*>(cq + params_.cq_off.head);
+		cq_tail_  = reinterpret_cast<uint32_t*>(cq + params_.cq_off.tail);
+		cq_mask_  = *reinterpret_cast<uint32_t*>(cq + params_.cq_off.ring_mask);
+		cqes_     = reinterpret_cast<io_uring_cqe*>(cq + params_.cq_off.cqes);
+	}
+
+	int get_fd() const
+	{
+		return fd_;
+	}
+
+	// the receive buffers shared by all recv(), count is rounded down to a
+	// power of 2 of at most 32768; only taken before the first recv()
+	void configure_buffers(uint32_t count, uint32_t size)
+	{
+		if(buffers_.empty())
+		{
+			buffer_count_ = std::max(std::min(count, uint32_t(32768)), uint32_t(1));
+			while(buffer_count_ & (buffer_count_ - 1))
+			{
+				buffer_count_ &= buffer_count_ - 1;
+			}
+			buffer_size_ = std::max(size, uint32_t(1));
+		}
+	}
+
+	// an event_mask of 0 registers fd for the requests of its handler only
+	void add(int fd, int event_mask, uint64_t data)
+	{
+		if(fd >= int(entries_.size()))
+		{
+			entries_.resize(fd + 1);
+		}
+
+		Entry & entry = entries_[fd];
+		entry.data = data;
+		entry.mask = event_mask & ~(EPOLLET|EPOLLONESHOT);
+		entry.oneshot = event_mask & EPOLLONESHOT;
+		entry.active = true;
+
+		if(event_mask != 0)
+		{
+			arm_(fd);
+		}
+	}
+
+	// cancels every request of fd, their completions are dropped
+	void remove(int fd)
+	{
+		if(fd < 0 or fd >= int(entries_.size()) or not entries_[fd].active)
+		{
+			return;
+		}
+
+		Entry & entry = entries_[fd];
+
+		for(uint32_t op = POLL; op <= CONNECT; ++op)
+		{
+			if(entry.armed & (1u << op))
+			{
+				cancel_(fd, Op(op));
+			}
+		}
+
+		// the kernel may still read from a send that is cancelled
+		if(entry.armed & (1u << SEND))
+		{
+			orphans_.push_back(Orphan());
+			orphans_.back().user_data = user_data_(fd, SEND);
+			orphans_.back().data.swap(entry.sending);
+		}
+
+		// completions of the cancelled requests no longer match
+		entry.active = false;
+		entry.armed = 0;
+		entry.receiving = false;
+		entry.sending.clear();
+		entry.queued.clear();
+		entry.sent = 0;
+		entry.completions.clear();
+		entry.next = 0;
+		++entry.generation;
+	}
+
+	// receives into the provided buffers until the peer closes or an error
+	// occurs, each completion carries one buffer
+	void recv(int fd)
+	{
+		if(buffers_.empty())
+		{
+			setup_buffers_();
+		}
+
+		Entry & entry = entries_[fd];
+		entry.receiving = true;
+
+		if(not (entry.armed & (1u << RECV)))
+		{
+			arm_recv_(fd);
+		}
+	}
+
+	// queues a copy of data behind everything sent before, there is one send
+	// in flight per fd and a completion for each
+	void send(int fd, uint8_t const* data, uint32_t size)
+	{
+		Entry & entry = entries_[fd];
+
+		if(size == 0)
+		{
+			return;
+		}
+
+		if(entry.armed & (1u << SEND))
+		{
+			entry.queued.insert(entry.queued.end(), data, data + size);
+			return;
+		}
+
+		entry.sending.assign(data, data + size);
+		entry.sent = 0;
+		arm_send_(fd);
+	}
+
+	// bytes given to send() the kernel has not taken yet
+	uint64_t queued(int fd) const
+	{
+		Entry const& entry = entries_[fd];
+		return entry.sending.size() - entry.sent + entry.queued.size();
+	}
+
+	// accepts connections on the listening fd until it fails or is cancelled
+	void accept(int fd)
+	{
+		if(not (entries_[fd].armed & (1u << ACCEPT)))
+		{
+			arm_accept_(fd);
+		}
+	}
+
+	// addr has to stay valid until the connect completed
+	void connect(int fd, sockaddr const* addr, socklen_t length)
+	{
+		io_uring_sqe * sqe = get_sqe_();
+		sqe->opcode = IORING_OP_CONNECT;
+		sqe->fd = fd;
+		sqe->addr = reinterpret_cast<uint64_t>(addr);
+		sqe->off = length;
+		submitted_(sqe, fd, CONNECT);
+	}
+
+	// stops the receive or the accept of fd, their later completions are
+	// dropped; sends always run to completion
+	void cancel(int fd, Op op)
+	{
+		Entry & entry = entries_[fd];
+
+		if(op == RECV)
+		{
+			entry.receiving = false;
+		}
+
+		if(entry.armed & (1u << op) and op != SEND)
+		{
+			cancel_(fd, op);
+			entry.armed &= ~(1u << op);
+			++entry.sequence[op];
+		}
+	}
+
+	// hands out the completions of fd one by one, they are gone with the
+	// next wait()
+	bool next(int fd, Completion & completion)
+	{
+		Entry & entry = entries_[fd];
+
+		if(entry.next == entry.completions.size())
+		{
+			return false;
+		}
+
+		completion = entry.completions[entry.next++];
+		return true;
+	}
+
+	// timeout in milliseconds, -1 blocks until an event arrives
+	int wait(struct epoll_event * events, int max_events, int timeout)
+	{
+		restart_();
+
+		if(cq_ready_() == 0)
+		{
+			enter_(timeout);
+		}
+		else if(to_submit_ != 0)
+		{
+			enter_(0);
+		}
+
+		int count = 0;
+		uint32_t head = *cq_head_;
+		uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+		++batch_;
+
+		for(; head != tail and count < max_events; ++head)
+		{
+			io_uring_cqe const& cqe = cqes_[head & cq_mask_];
+			count += harvest_(cqe, events, count);
+		}
+
+		__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+		return count;
+	}
+
+private:
+	static const uint64_t IGNORED      = ~uint64_t(0);
+	static const uint16_t BUFFER_GROUP = 0;
+
+	struct Entry
+	{
+		Entry()
+		: data(0)
+		, mask(0)
+		, generation(0)
+		, batch(0)
+		, event(0)
+		, active(false)
+		, oneshot(false)
+		, receiving(false)
+		, armed(0)
+		, sent(0)
+		, next(0)
+		{
+			memset(sequence, 0, sizeof(sequence));
+		}
+
+		uint64_t                data;
+		uint32_t                mask;
+		uint32_t                generation;
+		uint32_t                batch;
+		int                     event;
+		bool                    active;
+		bool                    oneshot;
+		bool                    receiving;
+		// a bit per Op with a request in flight
+		uint32_t                armed;
+		// counts the cancel() of each Op, which leaves the entry active
+		uint8_t                 sequence[CONNECT + 1];
+		std::vector<uint8_t>    sending;
+		uint32_t                sent;
+		std::vector<uint8_t>    queued;
+		std::vector<Completion> completions;
+		uint32_t                next;
+	};
+
+	// the data of a send cancelled by remove(), kept until it completes
+	struct Orphan
+	{
+		uint64_t             user_data;
+		std::vector<uint8_t> data;
+	};
+
+	int                     fd_;
+	io_uring_params         params_;
+	void                  * sq_ring_;
+	void                  * cq_ring_;
+	void                  * sqes_;
+	size_t                  sq_ring_size_;
+	size_t                  cq_ring_size_;
+	size_t                  sqes_size_;
+	uint32_t              * sq_head_;
+	uint32_t              * sq_tail_;
+	uint32_t                sq_mask_;
+	uint32_t              * sq_array_;
+	uint32_t              * cq_head_;
+	uint32_t              * cq_tail_;
+	uint32_t                cq_mask_;
+	io_uring_cqe          * cqes_;
+	uint32_t                to_submit_;
+	uint32_t                batch_;
+	struct __kernel_timespec timeout_;
+	// a deque, entries keep their address while a send reads from them
+	std::deque<Entry>       entries_;
+	std::list<Orphan>       orphans_;
+	std::vector<int>        pending_;
+	std::vector<int>        starved_;
+	std::vector<uint8_t>    buffers_;
+	std::vector<uint16_t>   lent_;
+	void                  * buffer_ring_;
+	uint32_t                buffer_count_;
+	uint32_t                buffer_size_;
+	uint16_t                buffer_tail_;
+	bool                    multishot_recv_;
+	bool                    multishot_accept_;
+
+	void * map_(size_t size, off_t offset)
+	{
+		void * result = mmap(
+			NULL,
+			size,
+			PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE,
+			fd_,
+			offset);
+
+		if(result == MAP_FAILED)
+		{
+			perror("io_uring mmap");
+			exit(EXIT_FAILURE);
+		}
+
+		return result;
+	}
+
+	// op, the cancel() count of op, generation and fd
+	uint64_t user_data_(int fd, Op op) const
+	{
+		Entry const& entry = entries_[fd];
+		return
+			(uint64_t(op) << 56) |
+			(uint64_t(entry.sequence[op]) << 48) |
+			(uint64_t(entry.generation & 0xffff) << 32) |
+			uint32_t(fd);
+	}
+
+	void submitted_(io_uring_sqe * sqe, int fd, Op op)
+	{
+		sqe->user_data = user_data_(fd, op);
+		entries_[fd].armed |= 1u << op;
+	}
+
+	void arm_(int fd)
+	{
+		io_uring_sqe * sqe = get_sqe_();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = entries_[fd].mask;
+		sqe->len = entries_[fd].oneshot ? 0 : IORING_POLL_ADD_MULTI;
+		submitted_(sqe, fd, POLL);
+	}
+
+	void arm_recv_(int fd)
+	{
+		io_uring_sqe * sqe = get_sqe_();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BUFFER_GROUP;
+		sqe->ioprio = multishot_recv_ ? IORING_RECV_MULTISHOT : 0;
+		submitted_(sqe, fd, RECV);
+	}
+
+	void arm_send_(int fd)
+	{
+		Entry & entry = entries_[fd];
+
+		io_uring_sqe * sqe = get_sqe_();
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = fd;
+		sqe->addr = reinterpret_cast<uint64_t>(&entry.sending[entry.sent]);
+		sqe->len = entry.sending.size() - entry.sent;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		submitted_(sqe, fd, SEND);
+	}
+
+	void arm_accept_(int fd)
+	{
+		io_uring_sqe * sqe = get_sqe_();
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = fd;
+		sqe->accept_flags = SOCK_CLOEXEC;
+		sqe->ioprio = multishot_accept_ ? IORING_ACCEPT_MULTISHOT : 0;
+		submitted_(sqe, fd, ACCEPT);
+	}
+
+	void cancel_(int fd, Op op)
+	{
+		io_uring_sqe * sqe = get_sqe_();
+		sqe->opcode = op == POLL ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = user_data_(fd, op);
+		sqe->user_data = IGNORED;
+	}
+
+	void setup_buffers_()
+	{
+		buffers_.resize(size_t(buffer_count_) * buffer_size_);
+
+		buffer_ring_ = mmap(
+			NULL,
+			buffer_count_ * sizeof(io_uring_buf),
+			PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS,
+			-1,
+			0);
+
+		if(buffer_ring_ != MAP_FAILED)
+		{
+			io_uring_buf_reg reg;
+			memset(&reg, 0, sizeof(reg));
+			reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+			reg.ring_entries = buffer_count_;
+			reg.bgid = BUFFER_GROUP;
+
+			if(syscall(
+				__NR_io_uring_register,
+				fd_,
+				IORING_REGISTER_PBUF_RING,
+				&reg,
+				1) != 0)
+			{
+				munmap(buffer_ring_, buffer_count_ * sizeof(io_uring_buf));
+				buffer_ring_ = MAP_FAILED;
+			}
+		}
+
+		for(uint32_t i=0; i<buffer_count_; ++i)
+		{
+			provide_(i);
+		}
+		publish_buffers_();
+	}
+
+	// a ring entry is only seen by the kernel once publish_buffers_() moved
+	// the tail past it, without a ring every buffer is a request of its own
+	void provide_(uint16_t id)
+	{
+		uint8_t * buffer = &buffers_[size_t(id) * buffer_size_];
+
+		if(buffer_ring_ != MAP_FAILED)
+		{
+			// not ring->bufs, C++ puts the flexible array 8 bytes too far
+			io_uring_buf & entry = static_cast<io_uring_buf*>(buffer_ring_)[
+				buffer_tail_ & (buffer_count_ - 1)];
+			entry.addr = reinterpret_cast<uint64_t>(buffer);
+			entry.len = buffer_size_;
+			entry.bid = id;
+			++buffer_tail_;
+			return;
+		}
+
+		io_uring_sqe * sqe = get_sqe_();
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd = 1;
+		sqe->addr = reinterpret_cast<uint64_t>(buffer);
+		sqe->len = buffer_size_;
+		sqe->off = id;
+		sqe->buf_group = BUFFER_GROUP;
+		sqe->user_data = IGNORED;
+	}
+
+	void publish_buffers_()
+	{
+		if(buffer_ring_ != MAP_FAILED)
+		{
+			io_uring_buf_ring * ring = static_cast<io_uring_buf_ring*>(buffer_ring_);
+			__atomic_store_n(&ring->tail, buffer_tail_, __ATOMIC_RELEASE);
+		}
+	}
+
+	// drops the completions handed out since the last wait(), returns their
+	// buffers and resumes the receives that ran out of them
+	void restart_()
+	{
+		for(uint32_t i=0; i<pending_.size(); ++i)
+		{
+			Entry & entry = entries_[pending_[i]];
+			entry.completions.clear();
+			entry.next = 0;
+		}
+		pending_.clear();
+
+		if(not lent_.empty())
+		{
+			for(uint32_t i=0; i<lent_.size(); ++i)
+			{
+				provide_(lent_[i]);
+			}
+			publish_buffers_();
+			lent_.clear();
+		}
+
+		for(uint32_t i=0; i<starved_.size(); ++i)
+		{
+			Entry & entry = entries_[starved_[i]];
+
+			if(entry.active and entry.receiving and
+			   not (entry.armed & (1u << RECV)))
+			{
+				arm_recv_(starved_[i]);
+			}
+		}
+		starved_.clear();
+	}
+
+	io_uring_sqe * get_sqe_()
+	{
+		uint32_t tail = *sq_tail_;
+
+		if(tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= params_.sq_entries)
+		{
+			enter_(0);
+			tail = *sq_tail_;
+		}
+
+		uint32_t index = tail & sq_mask_;
+		io_uring_sqe * sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+		memset(sqe, 0, sizeof(*sqe));
+		sq_array_[index] = index;
+
+		__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+		++to_submit_;
+
+		return sqe;
+	}
+
+	uint32_t cq_ready_() const
+	{
+		return __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) - *cq_head_;
+	}
+
+	void enter_(int timeout)
+	{
+		uint32_t flags = 0;
+		uint32_t min_complete = 0;
+		void * arg = NULL;
+		size_t arg_size = 0;
+		io_uring_getevents_arg ext;
+
+		if(timeout != 0)
+		{
+			flags |= IORING_ENTER_GETEVENTS;
+			min_complete = 1;
+
+			if(timeout > 0)
+			{
+				timeout_.tv_sec = timeout / 1000;
+				timeout_.tv_nsec = (timeout % 1000) * 1000000;
+
+				if(params_.features & IORING_FEAT_EXT_ARG)
+				{
+					memset(&ext, 0, sizeof(ext));
+					ext.ts = reinterpret_cast<uint64_t>(&timeout_);
+					flags |= IORING_ENTER_EXT_ARG;
+					arg = &ext;
+					arg_size = sizeof(ext);
+				}
+				else
+				{
+					// completes with the first other completion at the latest
+					io_uring_sqe * sqe = get_sqe_();
+					sqe->opcode = IORING_OP_TIMEOUT;
+					sqe->fd = -1;
+					sqe->addr = reinterpret_cast<uint64_t>(&timeout_);
+					sqe->len = 1;
+					sqe->off = 1;
+					sqe->user_data = IGNORED;
+				}
+			}
+		}
+
+		int result = syscall(
+			__NR_io_uring_enter,
+			fd_,
+			to_submit_,
+			min_complete,
+			flags,
+			arg,
+			arg_size);
+
+		if(result == -1)
+		{
+			if(errno == EINTR or errno == ETIME or errno == EBUSY)
+			{
+				return;
+			}
+
+			perror("io_uring_enter");
+			exit(EXIT_FAILURE);
+		}
+
+		to_submit_ -= result;
+	}
+
+	// returns the number of events added, see event_()
+	int harvest_(io_uring_cqe const& cqe, struct epoll_event * events, int count)
+	{
+		if(cqe.user_data == IGNORED)
+		{
+			return 0;
+		}
+
+		// given back with the next wait(), the handler is done with it by then
+		if(cqe.flags & IORING_CQE_F_BUFFER)
+		{
+			lent_.push_back(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+
+		int fd = uint32_t(cqe.user_data);
+		Op op = Op(cqe.user_data >> 56);
+		Entry & entry = entries_[fd];
+		uint64_t expected = user_data_(fd, op);
+
+		if(not entry.active or expected != cqe.user_data)
+		{
+			if(op == SEND)
+			{
+				release_orphan_(cqe.user_data);
+			}
+
+			if(op == ACCEPT and cqe.res >= 0)
+			{
+				// accepted while cancel() was on its way, the listener still
+				// takes the connection
+				if(entry.active and
+				   ((expected ^ cqe.user_data) & (uint64_t(0xffff) << 32)) == 0)
+				{
+					return event_(fd, queue_(fd, ACCEPT, cqe.res, NULL, EPOLLIN), events, count);
+				}
+				::close(cqe.res);
+			}
+			return 0;
+		}
+
+		if(not (cqe.flags & IORING_CQE_F_MORE))
+		{
+			entry.armed &= ~(1u << op);
+		}
+
+		uint32_t mask = 0;
+		switch(op)
+		{
+			case POLL:
+				mask = complete_poll_(fd, cqe);
+				break;
+
+			case RECV:
+				mask = complete_recv_(fd, cqe);
+				break;
+
+			case ACCEPT:
+				mask = complete_accept_(fd, cqe);
+				break;
+
+			case SEND:
+				mask = complete_send_(fd, cqe);
+				break;
+
+			case CONNECT:
+				mask = queue_(fd, CONNECT, cqe.res, NULL, EPOLLOUT);
+				break;
+		}
+
+		return event_(fd, mask, events, count);
+	}
+
+	// completions for the same fd within a batch are merged into one event
+	// like epoll does
+	int event_(int fd, uint32_t mask, struct epoll_event * events, int count)
+	{
+		Entry & entry = entries_[fd];
+
+		if(mask == 0)
+		{
+			return 0;
+		}
+
+		if(entry.batch == batch_)
+		{
+			events[entry.event].events |= mask;
+			return 0;
+		}
+
+		entry.batch = batch_;
+		entry.event = count;
+		events[count].events = mask;
+		events[count].data.u64 = entry.data;
+		return 1;
+	}
+
+	uint32_t complete_poll_(int fd, io_uring_cqe const& cqe)
+	{
+		Entry & entry = entries_[fd];
+
+		if(cqe.res < 0)
+		{
+			// the poll itself failed, let the handler deal with its fd
+			entry.active = false;
+			return EPOLLERR;
+		}
+
+		// the kernel may end a multishot poll at any time, e.g. on overflow
+		if(not (entry.armed & (1u << POLL)) and not entry.oneshot)
+		{
+			arm_(fd);
+		}
+
+		return cqe.res;
+	}
+
+	uint32_t complete_recv_(int fd, io_uring_cqe const& cqe)
+	{
+		Entry & entry = entries_[fd];
+		bool ended = not (entry.armed & (1u << RECV));
+
+		// every buffer is lent out, the receive goes on once they are back
+		if(cqe.res == -ENOBUFS)
+		{
+			starved_.push_back(fd);
+			return 0;
+		}
+
+		// before 6.0 a receive completes once
+		if(cqe.res == -EINVAL and multishot_recv_)
+		{
+			multishot_recv_ = false;
+			arm_recv_(fd);
+			return 0;
+		}
+
+		uint8_t const* data = NULL;
+
+		if(cqe.res > 0)
+		{
+			data = &buffers_[
+				size_t(cqe.flags >> IORING_CQE_BUFFER_SHIFT) * buffer_size_];
+
+			if(ended)
+			{
+				arm_recv_(fd);
+			}
+		}
+		else
+		{
+			entry.receiving = false;
+		}
+
+		return queue_(fd, RECV, cqe.res, data, EPOLLIN);
+	}
+
+	uint32_t complete_accept_(int fd, io_uring_cqe const& cqe)
+	{
+		bool ended = not (entries_[fd].armed & (1u << ACCEPT));
+
+		// before 5.19 an accept completes once
+		if(cqe.res == -EINVAL and multishot_accept_)
+		{
+			multishot_accept_ = false;
+			arm_accept_(fd);
+			return 0;
+		}
+
+		// failed accepts are repeated by the handler
+		if(cqe.res >= 0 and ended)
+		{
+			arm_accept_(fd);
+		}
+
+		return queue_(fd, ACCEPT, cqe.res, NULL, EPOLLIN);
+	}
+
+	// sends the rest of a short send, then what was queued meanwhile
+	uint32_t complete_send_(int fd, io_uring_cqe const& cqe)
+	{
+		Entry & entry = entries_[fd];
+
+		if(cqe.res < 0)
+		{
+			entry.sending.clear();
+			entry.queued.clear();
+			entry.sent = 0;
+			return queue_(fd, SEND, cqe.res, NULL, EPOLLERR);
+		}
+
+		entry.sent += cqe.res;
+
+		if(entry.sent == entry.sending.size())
+		{
+			entry.sending.clear();
+			entry.sending.swap(entry.queued);
+			entry.sent = 0;
+		}
+
+		if(not entry.sending.empty())
+		{
+			arm_send_(fd);
+		}
+
+		return queue_(fd, SEND, cqe.res, NULL, EPOLLOUT);
+	}
+
+	uint32_t queue_(int fd, Op op, int32_t result, uint8_t const* data, uint32_t mask)
+	{
+		Entry & entry = entries_[fd];
+
+		if(entry.completions.empty())
+		{
+			pending_.push_back(fd);
+		}
+
+		Completion completion;
+		completion.op = op;
+		completion.result = result;
+		completion.data = data;
+		entry.completions.push_back(completion);
+
+		return mask;
+	}
+
+	void release_orphan_(uint64_t user_data)
+	{
+		for(std::list<Orphan>::iterator i = orphans_.begin(); i != orphans_.end(); ++i)
+		{
+			if(i->user_data == user_data)
+			{
+				orphans_.erase(i);
+				return;
+			}
+		}
+	}
+};
+
+
+} //namespace linux_epoll
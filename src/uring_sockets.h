@@ -0,0 +1,833 @@
+#pragma once
+
+#include "linux_epoll/util.h"
+#include "linux_epoll/log.h"
+#include "linux_epoll/list.h"
+#include "linux_epoll/delegate.h"
+#include "linux_epoll/sockets.h"
+#include "linux_epoll/uring_poller.h"
+
+#include <tr1/functional>
+#include <deque>
+#include <string>
+#include <stdexcept>
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+namespace linux_epoll
+{
+
+
+/* EXAMPLE:
+struct UringEndpoint
+{
+	void connected() = 0;
+
+	// data lies in a receive buffer of the UringPoller and is only valid
+	// during the call
+	void process_read_data(uint8_t const* data, uint32_t size) = 0;
+
+	void disconnected() = 0;
+
+	void set_write_function(Delegate<void(uint8_t const*, uint32_t)> const& write_)
+	{
+		write = write_;
+	}
+
+	Delegate<void(uint8_t const*, uint32_t)> write;
+
+	// optional, see LocalEndpoint
+	void output_high_watermark();
+	void output_low_watermark();
+};*/
+
+
+// The sockets in this file run their I/O as io_uring requests instead of
+// syscalls, so they need a loop on a UringPoller, Epoll<SIZE, POLLABLE,
+// UringPoller>. Besides the loop interface of the other sockets they use
+// poller(). They are added with an event mask of 0 and take the completions
+// of their requests when they are dispatched. Their descriptors stay
+// blocking, io_uring does the waiting.
+
+
+// The connection of a stream socket. A multishot recv hands the data to the
+// endpoint straight from the poller's buffers, write() queues a send.
+template<class LOCAL_ENDPOINT, class SYS = SystemFunctions>
+class UringTcpSocket : private SYS
+{
+public:
+	typedef UringTcpSocket<LOCAL_ENDPOINT, SYS> Self_t;
+
+	static const uint32_t DEFAULT_LOW_WATERMARK  = 256 * 1024;
+	static const uint32_t DEFAULT_HIGH_WATERMARK = 1024 * 1024;
+
+	UringTcpSocket()
+	: endpoint_(NULL)
+	, poller_(NULL)
+	, fd_(-1)
+	, connected_(false)
+	, low_watermark_(DEFAULT_LOW_WATERMARK)
+	, high_watermark_(DEFAULT_HIGH_WATERMARK)
+	, above_high_watermark_(false)
+	{}
+
+	UringTcpSocket(int fd)
+	: endpoint_(NULL)
+	, poller_(NULL)
+	, fd_(fd)
+	, connected_(false)
+	, low_watermark_(DEFAULT_LOW_WATERMARK)
+	, high_watermark_(DEFAULT_HIGH_WATERMARK)
+	, above_high_watermark_(false)
+	{}
+
+	~UringTcpSocket()
+	{
+		close();
+	}
+
+	int get_fd() const
+	{
+		return fd_;
+	}
+
+	void open(int domain, int type)
+	{
+		if(fd_ == -1)
+		{
+			fd_ = SYS::socket_(domain, type|SOCK_CLOEXEC, 0).value();
+		}
+	}
+
+	// the owner removes the socket from the loop first, which cancels its
+	// requests
+	void close()
+	{
+		if(fd_ != -1)
+		{
+			SYS::close_(fd_);
+			fd_ = -1;
+		}
+		above_high_watermark_ = false;
+	}
+
+	void set(LOCAL_ENDPOINT * endpoint)
+	{
+		endpoint_ = endpoint;
+		endpoint_->set_write_function(
+			std::tr1::bind(
+				&Self_t::write,
+				this,
+				std::tr1::placeholders::_1,
+				std::tr1::placeholders::_2));
+	}
+
+	void set(UringPoller * poller)
+	{
+		poller_ = poller;
+	}
+
+	void set(Delegate<void(Self_t*)> const& handle_terminated_connection)
+	{
+		handle_terminated_connection_ = handle_terminated_connection;
+	}
+
+	void set_no_delay(bool no_delay)
+	{
+		int on = no_delay;
+		SYS::setsockopt_(fd_, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
+	}
+
+	void set_watermarks(uint32_t low, uint32_t high)
+	{
+		low_watermark_ = low;
+		high_watermark_ = high;
+	}
+
+	uint64_t queued_output() const
+	{
+		return connected_ ? poller_->queued(fd_) : 0;
+	}
+
+	// starts receiving, the socket has to be added to the loop
+	void set_connected()
+	{
+		if(not connected_)
+		{
+			connected_ = true;
+			poller_->recv(fd_);
+			endpoint_->connected();
+		}
+	}
+
+	// the terminated connection handler may destroy this socket, so callers
+	// must not touch any member afterwards
+	void set_disconnected()
+	{
+		if(connected_)
+		{
+			connected_ = false;
+			endpoint_->disconnected();
+		}
+		handle_terminated_connection_(this);
+	}
+
+	LOCAL_ENDPOINT * endpoint() const
+	{
+		return endpoint_;
+	}
+
+	bool is_connected() const
+	{
+		return connected_;
+	}
+
+	void added()
+	{}
+
+	void removed()
+	{}
+
+	void process_events(int)
+	{
+		UringPoller::Completion completion;
+
+		while(poller_->next(fd_, completion))
+		{
+			if(not process_completion(completion))
+			{
+				return;
+			}
+		}
+	}
+
+	// returns false if the connection was terminated
+	bool process_completion(UringPoller::Completion const& completion)
+	{
+		switch(completion.op)
+		{
+			case UringPoller::RECV:
+				if(completion.result > 0)
+				{
+					endpoint_->process_read_data(completion.data, completion.result);
+					return true;
+				}
+				break;
+
+			case UringPoller::SEND:
+				if(completion.result >= 0)
+				{
+					check_low_watermark_();
+					return true;
+				}
+				break;
+
+			default:
+				return true;
+		}
+
+		if(completion.result < 0)
+		{
+			LINUX_EPOLL_LOG_DEBUG(
+				"fd:%d %s failed: %s",
+				fd_,
+				completion.op == UringPoller::RECV ? "recv" : "send",
+				strerror(-completion.result));
+		}
+
+		set_disconnected();
+		return false;
+	}
+
+	// data is copied, a send of it is in flight once the loop waits again
+	void write(uint8_t const* data, uint32_t size)
+	{
+		if(not connected_)
+		{
+			return;
+		}
+
+		poller_->send(fd_, data, size);
+
+		if(not above_high_watermark_ and poller_->queued(fd_) >= high_watermark_)
+		{
+			above_high_watermark_ = true;
+			WatermarkCallbacks<LOCAL_ENDPOINT>::high(endpoint_);
+		}
+	}
+
+private:
+	LOCAL_ENDPOINT          * endpoint_;
+	UringPoller             * poller_;
+	int                       fd_;
+	bool                      connected_;
+	Delegate<void(Self_t*)>   handle_terminated_connection_;
+	uint32_t                  low_watermark_;
+	uint32_t                  high_watermark_;
+	bool                      above_high_watermark_;
+
+	void check_low_watermark_()
+	{
+		if(above_high_watermark_ and poller_->queued(fd_) <= low_watermark_)
+		{
+			above_high_watermark_ = false;
+			WatermarkCallbacks<LOCAL_ENDPOINT>::low(endpoint_);
+		}
+	}
+};
+
+
+//----------------------------------------------------------------------------//
+
+
+// Connects with an IORING_OP_CONNECT request and reconnects after
+// retry_interval once the connection failed or terminated.
+template<
+	class POLL_INTERFACE,
+	class LOCAL_ENDPOINT,
+	class SYS = SystemFunctions>
+class UringActiveSocket : private SYS
+{
+public:
+	UringActiveSocket(
+		POLL_INTERFACE * poll_interface,
+		LOCAL_ENDPOINT * endpoint,
+		DurationMs retry_interval,
+		std::string const& ip,
+		uint16_t port,
+		DurationMs connect_timeout = DurationMs(3000))
+	: retry_interval_(retry_interval)
+	, connect_timeout_(connect_timeout)
+	, poll_interface_(poll_interface)
+	, socket_()
+	, remote_(SocketAddress::inet(ip, port))
+	, type_(SOCK_STREAM)
+	, connecting_(false)
+	, no_delay_(false)
+	{
+		setup_(endpoint);
+	}
+
+	UringActiveSocket(
+		POLL_INTERFACE * poll_interface,
+		LOCAL_ENDPOINT * endpoint,
+		DurationMs retry_interval,
+		SocketAddress const& remote,
+		int type = SOCK_STREAM,
+		DurationMs connect_timeout = DurationMs(3000))
+	: retry_interval_(retry_interval)
+	, connect_timeout_(connect_timeout)
+	, poll_interface_(poll_interface)
+	, socket_()
+	, remote_(remote)
+	, type_(type)
+	, connecting_(false)
+	, no_delay_(false)
+	{
+		setup_(endpoint);
+	}
+
+	~UringActiveSocket()
+	{
+		close_();
+		poll_interface_->remove_timeouts(this);
+	}
+
+	void added()
+	{}
+
+	void removed()
+	{}
+
+	void connect()
+	{
+		if(socket_.is_connected() or connecting_)
+		{
+			return;
+		}
+
+		socket_.open(remote_.domain(), type_);
+		if(socket_.get_fd() == -1)
+		{
+			LINUX_EPOLL_LOG_WARNING(
+				"UringActiveSocket socket failed: %s",
+				SYS::strerror_());
+			retry_();
+			return;
+		}
+
+		if(no_delay_ and remote_.domain() == AF_INET)
+		{
+			socket_.set_no_delay(true);
+		}
+
+		if(not poll_interface_->add(*this, 0))
+		{
+			LINUX_EPOLL_LOG_WARNING(
+				"UringActiveSocket fd:%d loop is full, retrying",
+				socket_.get_fd());
+			socket_.close();
+			retry_();
+			return;
+		}
+
+		LINUX_EPOLL_LOG_DEBUG("UringActiveSocket connect fd:%d", socket_.get_fd());
+
+		connecting_ = true;
+		poll_interface_->poller().connect(
+			socket_.get_fd(),
+			remote_.get(),
+			remote_.length());
+		deadline_ = poll_interface_->register_timeout(
+			connect_timeout_,
+			std::tr1::bind(&Self_t::retry_, this),
+			this,
+			retry_slack(connect_timeout_));
+	}
+
+	// applied to the current and every later connection
+	void set_no_delay(bool no_delay)
+	{
+		no_delay_ = no_delay;
+
+		if(socket_.get_fd() != -1 and remote_.domain() == AF_INET)
+		{
+			socket_.set_no_delay(no_delay);
+		}
+	}
+
+	int get_fd() const
+	{
+		return socket_.get_fd();
+	}
+
+	void process_events(int)
+	{
+		UringPoller::Completion completion;
+
+		while(poll_interface_->poller().next(socket_.get_fd(), completion))
+		{
+			if(completion.op != UringPoller::CONNECT)
+			{
+				if(not socket_.process_completion(completion))
+				{
+					return;
+				}
+				continue;
+			}
+
+			connecting_ = false;
+			poll_interface_->cancel_timeout(deadline_);
+
+			if(completion.result < 0)
+			{
+				LINUX_EPOLL_LOG_INFO(
+					"UringActiveSocket connect failed: %s",
+					strerror(-completion.result));
+				retry_();
+				return;
+			}
+
+			socket_.set_connected();
+		}
+	}
+
+private:
+	typedef UringTcpSocket<LOCAL_ENDPOINT, SYS> Socket_t;
+	typedef UringActiveSocket<POLL_INTERFACE, LOCAL_ENDPOINT, SYS> Self_t;
+
+	DurationMs       retry_interval_;
+	DurationMs       connect_timeout_;
+	POLL_INTERFACE * poll_interface_;
+	Socket_t         socket_;
+	SocketAddress    remote_;
+	int              type_;
+	bool             connecting_;
+	bool             no_delay_;
+	TimeoutHandle    deadline_;
+
+	void setup_(LOCAL_ENDPOINT * endpoint)
+	{
+		if(poll_interface_->is_full())
+		{
+			throw std::runtime_error(
+				"UringActiveSocket can not be added to poll_interface");
+		}
+
+		socket_.set(endpoint);
+		socket_.set(&poll_interface_->poller());
+		socket_.set(
+			std::tr1::bind(
+				&Self_t::handle_terminated_connection_,
+				this,
+				std::tr1::placeholders::_1));
+
+		connect();
+	}
+
+	// removing the socket cancels a connect still in flight, the next
+	// attempt needs a fresh socket
+	void close_()
+	{
+		connecting_ = false;
+
+		if(socket_.get_fd() != -1)
+		{
+			poll_interface_->remove(*this);
+			socket_.close();
+		}
+	}
+
+	void retry_()
+	{
+		close_();
+
+		poll_interface_->register_timeout(
+			retry_interval_,
+			std::tr1::bind(&Self_t::connect, this),
+			this,
+			retry_slack(retry_interval_));
+	}
+
+	void handle_terminated_connection_(Socket_t *)
+	{
+		retry_();
+	}
+};
+
+
+//----------------------------------------------------------------------------//
+
+
+// Accepts with a multishot IORING_OP_ACCEPT request. The request is
+// cancelled while the connections or the loop are full. The kernel accepts
+// everything in the backlog at once, so connections it accepted before the
+// cancel wait in backlog_ until there is room again.
+template<
+	class POLL_INTERFACE,
+	class LOCAL_ENDPOINT,
+	uint32_t MAX_CONNECTIONS,
+	class SYS = SystemFunctions
+	>
+class UringPassiveSocket : private SYS
+{
+public:
+	UringPassiveSocket(
+		POLL_INTERFACE * poll_interface,
+		Delegate<LOCAL_ENDPOINT *()> const& connect_callback,
+		uint32_t port,
+		std::string const& ip = "0.0.0.0",
+		DurationMs retry_interval = DurationMs(3000),
+		bool reuse_port = false)
+	: listening_(false)
+	, poll_interface_(poll_interface)
+	, connect_callback_(connect_callback)
+	, address_(SocketAddress::inet(ip, port))
+	, type_(SOCK_STREAM)
+	, retry_interval_(retry_interval)
+	, no_delay_(false)
+	, accept_blocked_(false)
+	, accept_retry_()
+	{
+		open_(reuse_port);
+	}
+
+	// the listener removes the path of an AF_UNIX address again when it
+	// closes, see PassiveSocket
+	UringPassiveSocket(
+		POLL_INTERFACE * poll_interface,
+		Delegate<LOCAL_ENDPOINT *()> const& connect_callback,
+		SocketAddress const& address,
+		int type = SOCK_STREAM,
+		DurationMs retry_interval = DurationMs(3000))
+	: listening_(false)
+	, poll_interface_(poll_interface)
+	, connect_callback_(connect_callback)
+	, address_(address)
+	, type_(type)
+	, retry_interval_(retry_interval)
+	, no_delay_(false)
+	, accept_blocked_(false)
+	, accept_retry_()
+	{
+		open_(false);
+	}
+
+	~UringPassiveSocket()
+	{
+		removed();
+	}
+
+	void close()
+	{
+		if(fd_ != -1)
+		{
+			SYS::close_(fd_);
+			fd_ = -1;
+		}
+	}
+
+	int get_fd() const
+	{
+		return fd_;
+	}
+
+	void added()
+	{
+		if(listening_)
+		{
+			return;
+		}
+
+		if(not SYS::bind_(fd_, address_.get(), address_.length()))
+		{
+			poll_interface_->register_timeout(
+				retry_interval_,
+				std::tr1::bind(&Self_t::added, this),
+				this,
+				retry_slack(retry_interval_));
+			return;
+		}
+
+		SYS::listen_(fd_, MAX_CONNECTIONS);
+		listening_ = true;
+		poll_interface_->poller().accept(fd_);
+	}
+
+	void removed()
+	{
+		if(listening_)
+		{
+			listening_ = false;
+
+			std::string path = address_.path();
+			if(not path.empty())
+			{
+				SYS::unlink_(path.c_str());
+			}
+		}
+
+		RemoveFunc r(poll_interface_);
+		connected_sockets_.for_each(r);
+		connected_sockets_.clear();
+
+		for(uint32_t i=0; i<backlog_.size(); ++i)
+		{
+			SYS::close_(backlog_[i]);
+		}
+		backlog_.clear();
+
+		poll_interface_->remove(*this);
+		close();
+	}
+
+	void process_events(int)
+	{
+		UringPoller::Completion completion;
+
+		while(poll_interface_->poller().next(fd_, completion))
+		{
+			if(completion.result >= 0)
+			{
+				process_accept_(completion.result);
+				continue;
+			}
+
+			int error = -completion.result;
+			if(error == EINTR or error == ECONNABORTED or error == EAGAIN)
+			{
+				poll_interface_->poller().accept(fd_);
+				continue;
+			}
+
+			LINUX_EPOLL_LOG_ERROR(
+				"UringPassiveSocket accept failed: %s",
+				strerror(error));
+			block_accept_();
+			retry_accept_();
+		}
+	}
+
+	// applied to every connection accepted from now on
+	void set_no_delay(bool no_delay)
+	{
+		no_delay_ = no_delay;
+	}
+
+private:
+	typedef UringPassiveSocket<
+		POLL_INTERFACE,
+		LOCAL_ENDPOINT,
+		MAX_CONNECTIONS,
+		SYS> Self_t;
+	typedef UringTcpSocket<LOCAL_ENDPOINT, SYS> Socket_t;
+
+	bool                                    listening_;
+	POLL_INTERFACE                        * poll_interface_;
+	Delegate<LOCAL_ENDPOINT *()>            connect_callback_;
+	int                                     fd_;
+	SocketAddress                           address_;
+	int                                     type_;
+	DurationMs                              retry_interval_;
+	bool                                    no_delay_;
+	bool                                    accept_blocked_;
+	TimeoutHandle                           accept_retry_;
+	std::deque<int>                         backlog_;
+
+	List<Socket_t, MAX_CONNECTIONS>         connected_sockets_;
+
+
+	struct RemoveFunc
+	{
+		RemoveFunc(POLL_INTERFACE * poll_interface)
+		: poll_interface_(poll_interface)
+		{}
+
+		Socket_t * operator()(Socket_t & s)
+		{
+			poll_interface_->remove(s);
+			return NULL;
+		}
+
+	private:
+		POLL_INTERFACE * poll_interface_;
+	};
+
+	friend class RemoveFunc;
+
+	void open_(bool reuse_port)
+	{
+		if(poll_interface_->is_full())
+		{
+			throw std::runtime_error(
+				"UringPassiveSocket can not be added to poll_interface");
+		}
+
+		fd_ = SYS::socket_(address_.domain(), type_|SOCK_CLOEXEC, 0).value();
+		if(fd_ == -1)
+		{
+			throw std::runtime_error(
+				std::string("acquire socket fd failed with: ") + SYS::strerror_());
+		}
+
+		int on = 1;
+		if(not SYS::setsockopt_(fd_, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on)))
+		{
+			throw std::runtime_error(
+				std::string("set socket options failed with: ") + SYS::strerror_());
+		}
+
+		if(reuse_port and
+		   not SYS::setsockopt_(fd_, SOL_SOCKET, SO_REUSEPORT, (char*)&on, sizeof(on)))
+		{
+			throw std::runtime_error(
+				std::string("set SO_REUSEPORT failed with: ") + SYS::strerror_());
+		}
+
+		poll_interface_->add(*this, 0);
+	}
+
+	void handle_terminated_connection_(Socket_t * s)
+	{
+		poll_interface_->remove(*s);
+		connected_sockets_.remove(s);
+		resume_accept_();
+	}
+
+	void block_accept_()
+	{
+		accept_blocked_ = true;
+		poll_interface_->poller().cancel(fd_, UringPoller::ACCEPT);
+	}
+
+	void resume_accept_()
+	{
+		if(not accept_blocked_ or not listening_)
+		{
+			return;
+		}
+
+		accept_blocked_ = false;
+
+		while(not backlog_.empty() and not accept_blocked_)
+		{
+			int fd = backlog_.front();
+			backlog_.pop_front();
+			process_accept_(fd);
+		}
+
+		if(not accept_blocked_)
+		{
+			poll_interface_->poller().accept(fd_);
+		}
+	}
+
+	// the handlers filling the loop need not be connections of this
+	// listener, so none of its own terminating may ever resume it
+	void retry_accept_()
+	{
+		poll_interface_->cancel_timeout(accept_retry_);
+		accept_retry_ = poll_interface_->register_timeout(
+			retry_interval_,
+			std::tr1::bind(&Self_t::resume_accept_, this),
+			this,
+			retry_slack(retry_interval_));
+	}
+
+	void process_accept_(int fd)
+	{
+		if(accept_blocked_)
+		{
+			backlog_.push_back(fd);
+			return;
+		}
+
+		// only a loop filled by other handlers gets here, the own
+		// connections are checked after each accept
+		if(poll_interface_->is_full())
+		{
+			backlog_.push_back(fd);
+			block_accept_();
+			retry_accept_();
+			return;
+		}
+
+		Socket_t * s = connected_sockets_.add(fd);
+		poll_interface_->add(*s, 0);
+
+		s->set(&poll_interface_->poller());
+		s->set(connect_callback_());
+		s->set(
+			std::tr1::bind(
+				&Self_t::handle_terminated_connection_,
+				this,
+				std::tr1::placeholders::_1));
+		if(no_delay_ and address_.domain() == AF_INET)
+		{
+			s->set_no_delay(true);
+		}
+
+		s->set_connected();
+
+		// resumed once a connection terminates, a full loop is also
+		// checked again after retry_interval_
+		if(connected_sockets_.is_full() or poll_interface_->is_full())
+		{
+			block_accept_();
+			if(not connected_sockets_.is_full())
+			{
+				retry_accept_();
+			}
+		}
+	}
+};
+
+
+} //namespace linux_epoll
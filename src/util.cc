@@ -26,6 +26,19 @@ struct timespec operator+(struct timespec const& rhs, DurationMs const& d)
 }
 
 
+struct timespec operator+(struct timespec const& rhs, DurationNs const& d)
+{
+	struct timespec result;
+
+	uint64_t ns = rhs.tv_nsec + d.value%1000000000;
+
+	result.tv_sec = rhs.tv_sec + d.value/1000000000 + ns/1000000000;
+	result.tv_nsec = ns%1000000000;
+
+	return result;
+}
+
+
 std::string to_string(struct timespec const& t)
 {
 	char buffer[26];
@@ -46,12 +59,28 @@ std::string to_string(DurationMs const& d)
 }
 
 
+std::string to_string(DurationNs const& d)
+{
+	char buffer[24];
+
+	size_t size = sprintf(buffer, "%lluns", (unsigned long long)d.value);
+
+	return std::string(buffer, size);
+}
+
+
 struct timespec make_ts(DurationMs const& d)
 {
 	return make_ts(0,0) + d;
 }
 
 
+struct timespec make_ts(DurationNs const& d)
+{
+	return make_ts(0,0) + d;
+}
+
+
 struct timespec make_ts(uint32_t s, uint32_t ns)
 {
 	struct timespec t;
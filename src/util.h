@@ -17,14 +17,34 @@ struct DurationMs
 	{}
 };
 
+
+struct DurationNs
+{
+	uint64_t value;
+
+	explicit DurationNs(uint64_t v)
+	: value(v)
+	{}
+
+	DurationNs(DurationMs const& d)
+	: value(uint64_t(d.value) * 1000000)
+	{}
+};
+
 struct timespec operator+(struct timespec const& rhs, DurationMs const& d);
 
+struct timespec operator+(struct timespec const& rhs, DurationNs const& d);
+
 std::string to_string(struct timespec const& t);
 
 std::string to_string(DurationMs const& d);
 
+std::string to_string(DurationNs const& d);
+
 struct timespec make_ts(DurationMs const& d);
 
+struct timespec make_ts(DurationNs const& d);
+
 struct timespec make_ts(uint32_t s, uint32_t ns);
 
 struct itimerspec make_its(struct timespec const& ts);
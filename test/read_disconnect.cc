@@ -0,0 +1,248 @@
+// A write failing inside process_read_data disconnects the socket while it is
+// still reading. Checks that every read mode, of accepted and of connecting
+// sockets, returns without touching the socket afterwards: the accepted one
+// is destroyed by then, the connecting one has released its buffers.
+//
+// Exits with a non-zero status if a case fails; memory errors show best when
+// built with -fsanitize=address.
+//
+// Build with src/ reachable as linux_epoll/ on the include path:
+//   g++ -std=c++03 -I<include dir> test/read_disconnect.cc src/util.cc -lpthread
+
+#include "linux_epoll/epoll.h"
+#include "linux_epoll/sockets.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+using namespace linux_epoll;
+
+
+namespace
+{
+
+
+typedef Epoll<16> Loop;
+
+
+// every write fails as if the peer had reset the connection
+struct FailingWrites : SystemFunctions
+{
+	Result write_(int, const void *, size_t)
+	{
+		errno = EPIPE;
+		return Result(-1);
+	}
+};
+
+
+struct Endpoint
+{
+	Endpoint()
+	: reads(0)
+	, disconnects(0)
+	{}
+
+	void set_write_function(Delegate<void(uint8_t const*, uint32_t)> const& write_)
+	{
+		write = write_;
+	}
+
+	void connected()
+	{}
+
+	void disconnected()
+	{
+		++disconnects;
+	}
+
+	Delegate<void(uint8_t const*, uint32_t)> write;
+	uint32_t                                 reads;
+	uint32_t                                 disconnects;
+};
+
+
+struct BufferEndpoint : Endpoint
+{
+	uint8_t * get_buffer()
+	{
+		return buffer;
+	}
+
+	uint32_t get_buffer_size()
+	{
+		return sizeof(buffer);
+	}
+
+	void process_read_data(uint8_t const* data, uint32_t size)
+	{
+		++reads;
+		write(data, size);
+	}
+
+	uint8_t buffer[4096];
+};
+
+
+struct RingEndpoint : Endpoint
+{
+	static const uint32_t READ_RING_SIZE = 4096;
+
+	void process_read_data(uint8_t const* data, uint32_t size)
+	{
+		++reads;
+		write(data, size);
+	}
+};
+
+
+struct PooledEndpoint : Endpoint
+{
+	static const bool READ_BUFFER_POOL = true;
+
+	// keeps a byte, so the socket would move the rest to the slab's front
+	uint32_t process_read_data(uint8_t const* data, uint32_t size)
+	{
+		++reads;
+		write(data, size);
+		return size - 1;
+	}
+};
+
+
+void noop()
+{}
+
+
+void spin(Loop & loop)
+{
+	loop.register_timeout(DurationMs(5), &noop, &loop);
+	loop.wait();
+	loop.process();
+}
+
+
+sockaddr_in loopback(uint16_t port)
+{
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return addr;
+}
+
+
+bool report(char const* name, Endpoint const& endpoint)
+{
+	bool ok = endpoint.reads == 1 and endpoint.disconnects == 1;
+	printf(
+		"%s %s: reads=%u disconnects=%u\n",
+		ok ? "ok  " : "FAIL",
+		name,
+		endpoint.reads,
+		endpoint.disconnects);
+	return ok;
+}
+
+
+template<class ENDPOINT>
+ENDPOINT * accepted_endpoint()
+{
+	static ENDPOINT endpoint;
+	return &endpoint;
+}
+
+
+template<class ENDPOINT>
+bool accepted(char const* name, uint16_t port)
+{
+	Loop loop;
+	PassiveSocket<Loop, ENDPOINT, 4, FailingWrites> server(
+		&loop,
+		&accepted_endpoint<ENDPOINT>,
+		port,
+		"127.0.0.1");
+
+	sockaddr_in addr = loopback(port);
+	int client = ::socket(AF_INET, SOCK_STREAM, 0);
+	for(int i=0; i<100 and
+	    ::connect(client, (sockaddr*)&addr, sizeof(addr)) == -1; ++i)
+	{
+		spin(loop);
+	}
+	::write(client, "hello", 5);
+
+	ENDPOINT & endpoint = *accepted_endpoint<ENDPOINT>();
+	for(int i=0; i<100 and endpoint.disconnects == 0; ++i)
+	{
+		spin(loop);
+	}
+
+	::close(client);
+	return report(name, endpoint);
+}
+
+
+template<class ENDPOINT>
+bool connecting(char const* name, uint16_t port)
+{
+	sockaddr_in addr = loopback(port);
+	int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if(::bind(listener, (sockaddr*)&addr, sizeof(addr)) == -1 or
+	   ::listen(listener, 4) == -1)
+	{
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+
+	Loop loop;
+	ENDPOINT endpoint;
+	ActiveSocket<Loop, ENDPOINT, FailingWrites> client(
+		&loop,
+		&endpoint,
+		DurationMs(1000),
+		"127.0.0.1",
+		port);
+
+	int peer = ::accept(listener, NULL, NULL);
+	::write(peer, "hello", 5);
+
+	for(int i=0; i<100 and endpoint.disconnects == 0; ++i)
+	{
+		spin(loop);
+	}
+
+	::close(peer);
+	::close(listener);
+	return report(name, endpoint);
+}
+
+
+} //namespace
+
+
+int main()
+{
+	bool ok = true;
+
+	ok = accepted<BufferEndpoint>("accepted endpoint buffer", 47601) and ok;
+	ok = accepted<RingEndpoint>("accepted read ring", 47602) and ok;
+	ok = accepted<PooledEndpoint>("accepted buffer pool", 47603) and ok;
+	ok = connecting<BufferEndpoint>("connecting endpoint buffer", 47604) and ok;
+	ok = connecting<RingEndpoint>("connecting read ring", 47605) and ok;
+	ok = connecting<PooledEndpoint>("connecting buffer pool", 47606) and ok;
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
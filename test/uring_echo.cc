@@ -0,0 +1,185 @@
+// Echoes data between a UringActiveSocket and a UringPassiveSocket on one
+// loop, so every read, write, accept and connect is an io_uring request. The
+// poller gets few small receive buffers, which makes the multishot receives
+// run out of them and resume once they are given back.
+//
+// Exits with a non-zero status if the echo does not match what was sent.
+//
+// Build with src/ reachable as linux_epoll/ on the include path:
+//   g++ -std=c++03 -I<include dir> test/uring_echo.cc src/util.cc -lpthread
+
+#include "linux_epoll/epoll.h"
+#include "linux_epoll/uring_sockets.h"
+
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+using namespace linux_epoll;
+
+
+namespace
+{
+
+
+typedef Epoll<16, Pollable, UringPoller> Loop;
+
+static const uint16_t PORT       = 47611;
+static const uint32_t TOTAL      = 4 * 1024 * 1024;
+static const uint32_t CHUNK      = 64 * 1024;
+
+
+struct Endpoint
+{
+	Endpoint()
+	: connects(0)
+	, disconnects(0)
+	{}
+
+	void set_write_function(Delegate<void(uint8_t const*, uint32_t)> const& write_)
+	{
+		write = write_;
+	}
+
+	void connected()
+	{
+		++connects;
+	}
+
+	void disconnected()
+	{
+		++disconnects;
+	}
+
+	Delegate<void(uint8_t const*, uint32_t)> write;
+	uint32_t                                 connects;
+	uint32_t                                 disconnects;
+};
+
+
+struct EchoEndpoint : Endpoint
+{
+	void process_read_data(uint8_t const* data, uint32_t size)
+	{
+		write(data, size);
+	}
+};
+
+
+struct ClientEndpoint : Endpoint
+{
+	ClientEndpoint()
+	: mismatches(0)
+	, high(0)
+	, low(0)
+	{}
+
+	void connected()
+	{
+		Endpoint::connected();
+
+		for(uint32_t i=0; i<TOTAL; ++i)
+		{
+			sent.push_back(uint8_t(i * 7 + i / 251));
+		}
+
+		for(uint32_t offset = 0; offset < TOTAL; offset += CHUNK)
+		{
+			write(&sent[offset], CHUNK);
+		}
+	}
+
+	void process_read_data(uint8_t const* data, uint32_t size)
+	{
+		for(uint32_t i=0; i<size; ++i)
+		{
+			if(received.size() + i >= sent.size() or
+			   data[i] != sent[received.size() + i])
+			{
+				++mismatches;
+			}
+		}
+		received.insert(received.end(), data, data + size);
+	}
+
+	void output_high_watermark()
+	{
+		++high;
+	}
+
+	void output_low_watermark()
+	{
+		++low;
+	}
+
+	std::vector<uint8_t> sent;
+	std::vector<uint8_t> received;
+	uint32_t             mismatches;
+	uint32_t             high;
+	uint32_t             low;
+};
+
+
+EchoEndpoint * echo_endpoint()
+{
+	static EchoEndpoint endpoint;
+	return &endpoint;
+}
+
+
+void noop()
+{}
+
+
+} //namespace
+
+
+int main()
+{
+	Loop loop;
+	loop.poller().configure_buffers(8, 4096);
+
+	UringPassiveSocket<Loop, EchoEndpoint, 4> server(
+		&loop,
+		&echo_endpoint,
+		PORT,
+		"127.0.0.1");
+
+	ClientEndpoint endpoint;
+	UringActiveSocket<Loop, ClientEndpoint> client(
+		&loop,
+		&endpoint,
+		DurationMs(10),
+		"127.0.0.1",
+		PORT);
+
+	for(int i=0; i<10000 and endpoint.received.size() < TOTAL; ++i)
+	{
+		loop.register_timeout(DurationMs(5), &noop, &loop);
+		loop.wait();
+		loop.process();
+	}
+
+	bool ok =
+		endpoint.connects == 1 and
+		echo_endpoint()->connects == 1 and
+		endpoint.received.size() == TOTAL and
+		endpoint.mismatches == 0 and
+		endpoint.high == 1 and
+		endpoint.low == 1;
+
+	printf(
+		"%s connects=%u/%u received=%zu mismatches=%u watermarks=%u/%u\n",
+		ok ? "ok  " : "FAIL",
+		endpoint.connects,
+		echo_endpoint()->connects,
+		endpoint.received.size(),
+		endpoint.mismatches,
+		endpoint.high,
+		endpoint.low);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}